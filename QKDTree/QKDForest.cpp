@@ -0,0 +1,400 @@
+#include "QKDForest.h"
+
+#include "QKDTreeInternal.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+typedef QPair<qreal, QKDTreeNode> Candidate;
+
+bool candidateLess(const Candidate& a, const Candidate& b)
+{
+    return a.first < b.first;
+}
+
+//Keeps best sorted and at most k long
+void offerCandidate(QVector<Candidate> * best, int k, qreal dist, const QVectorND& position, const QVariant& value)
+{
+    if (best->size() == k && dist >= best->last().first)
+        return;
+
+    const Candidate candidate(dist, QKDTreeNode(position, value));
+    const int index = std::upper_bound(best->constBegin(), best->constEnd(), candidate, candidateLess) - best->constBegin();
+    best->insert(index, candidate);
+    if (best->size() > k)
+        best->removeLast();
+}
+}
+
+QKDForest::QKDForest(int dimension, bool allowDuplicates, QKDTreeDistanceMetric *distanceMetric, int bufferSize) :
+    _dimension(dimension), _size(0), _allowDuplicates(allowDuplicates), _bufferSize(qMax(1, bufferSize))
+{
+    //If they don't give us a distance metric (or one that doesn't fit), just use the default
+    _distanceMetric = QKDTreeInternal::metricOrDefault(distanceMetric, _dimension, "QKDForest");
+}
+
+QKDForest::~QKDForest()
+{
+    this->clear();
+    delete _distanceMetric;
+}
+
+int QKDForest::dimension() const
+{
+    return _dimension;
+}
+
+qint64 QKDForest::size() const
+{
+    return _size;
+}
+
+int QKDForest::treeCount() const
+{
+    int toRet = 0;
+    for (int t = 0; t < _trees.size(); t++)
+    {
+        if (_trees.at(t))
+            toRet++;
+    }
+    return toRet;
+}
+
+bool QKDForest::add(QKDTreeNode *node, QString *resultOut)
+{
+    if (node == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_NODE;
+        return false;
+    }
+
+    if (!this->add(node->position(), node->value(), resultOut))
+        return false;
+
+    delete node;
+    return true;
+}
+
+bool QKDForest::add(const QVectorND &position, const QVariant &value, QString *resultOut)
+{
+    if (position.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_FOREST_DIM;
+        return false;
+    }
+    else if (!_allowDuplicates && this->containsKey(position))
+    {
+        if (resultOut)
+            *resultOut = "Cannot add duplicate";
+        return false;
+    }
+
+    for (int i = 0; i < _dimension; i++)
+        _bufferCoords.append(position[i]);
+    _bufferValues.append(value);
+    _size++;
+
+    if (_bufferValues.size() >= _bufferSize)
+        this->merge();
+    return true;
+}
+
+bool QKDForest::add(const QPointF &position, const QVariant &value, QString *resultOut)
+{
+    return this->add(QVectorND(position), value, resultOut);
+}
+
+void QKDForest::clear()
+{
+    for (int t = 0; t < _trees.size(); t++)
+        delete _trees.at(t);
+    _trees.clear();
+
+    _bufferCoords.clear();
+    _bufferValues.clear();
+    _size = 0;
+}
+
+bool QKDForest::nearestNode(const QVectorND &position, QKDTreeNode *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (position.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_FOREST_DIM;
+        return false;
+    }
+    else if (_size <= 0)
+    {
+        if (resultOut)
+            *resultOut = "Forest is empty";
+        return false;
+    }
+
+    QVectorND candidate(_dimension);
+    qreal bestDist = std::numeric_limits<qreal>::max();
+
+    for (int i = 0; i < _bufferValues.size(); i++)
+    {
+        std::copy(this->bufferCoordinates(i), this->bufferCoordinates(i) + _dimension, candidate.data());
+        const qreal dist = _distanceMetric->distance(candidate, position);
+        if (dist < bestDist)
+        {
+            bestDist = dist;
+            *output = QKDTreeNode(candidate, _bufferValues.at(i));
+        }
+    }
+
+    //Largest first, since that is where the nearest node most likely is
+    for (int t = _trees.size() - 1; t >= 0; t--)
+    {
+        const QKDTree * tree = _trees.at(t);
+        if (tree == 0)
+            continue;
+
+        const quint32 index = tree->nearestWithin(position, bestDist, &bestDist, 0.0);
+        if (index == QKDTree::NO_NODE)
+            continue;
+
+        tree->loadPosition(index, &candidate);
+        *output = QKDTreeNode(candidate, tree->valueAt(index));
+    }
+
+    return true;
+}
+
+bool QKDForest::nearestNode(const QPointF &position, QKDTreeNode *output, QString *resultOut) const
+{
+    return this->nearestNode(QVectorND(position), output, resultOut);
+}
+
+bool QKDForest::nearestNodes(const QVectorND &position, int k, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (k <= 0)
+    {
+        if (resultOut)
+            *resultOut = "k must be positive";
+        return false;
+    }
+    else if (position.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_FOREST_DIM;
+        return false;
+    }
+    else if (_size <= 0)
+    {
+        if (resultOut)
+            *resultOut = "Forest is empty";
+        return false;
+    }
+
+    QVectorND candidate(_dimension);
+    QVector<Candidate> best;
+
+    for (int i = 0; i < _bufferValues.size(); i++)
+    {
+        std::copy(this->bufferCoordinates(i), this->bufferCoordinates(i) + _dimension, candidate.data());
+        offerCandidate(&best, k, _distanceMetric->distance(candidate, position), candidate, _bufferValues.at(i));
+    }
+
+    //Each tree only has to beat the k-th best distance found so far
+    QVector<QPair<qreal, quint32> > treeBest;
+    for (int t = _trees.size() - 1; t >= 0; t--)
+    {
+        const QKDTree * tree = _trees.at(t);
+        if (tree == 0)
+            continue;
+
+        const qreal bound = (best.size() == k) ? best.last().first : std::numeric_limits<qreal>::max();
+        tree->nearestCandidates(position, k, bound, &treeBest, 0.0);
+        for (int i = 0; i < treeBest.size(); i++)
+        {
+            tree->loadPosition(treeBest[i].second, &candidate);
+            offerCandidate(&best, k, treeBest[i].first, candidate, tree->valueAt(treeBest[i].second));
+        }
+    }
+
+    output->clear();
+    for (int i = 0; i < best.size(); i++)
+        output->append(best[i].second);
+
+    return true;
+}
+
+bool QKDForest::nearestNodes(const QPointF &position, int k, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    return this->nearestNodes(QVectorND(position), k, output, resultOut);
+}
+
+bool QKDForest::withinDistance(const QVectorND &center, qreal radius, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+
+    output->clear();
+    QKDTreeNodeCollector collector(output);
+    return this->withinDistance(center, radius, &collector, resultOut);
+}
+
+bool QKDForest::withinDistance(const QPointF &center, qreal radius, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    return this->withinDistance(QVectorND(center), radius, output, resultOut);
+}
+
+bool QKDForest::withinDistance(const QVectorND &center, qreal radius, QKDTreeVisitor *visitor, QString *resultOut) const
+{
+    if (visitor == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_VISITOR;
+        return false;
+    }
+    else if (center.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_FOREST_DIM;
+        return false;
+    }
+
+    QVectorND candidate(_dimension);
+    for (int i = 0; i < _bufferValues.size(); i++)
+    {
+        std::copy(this->bufferCoordinates(i), this->bufferCoordinates(i) + _dimension, candidate.data());
+        if (_distanceMetric->distance(candidate, center) <= radius)
+            visitor->visit(candidate, _bufferValues.at(i));
+    }
+
+    for (int t = 0; t < _trees.size(); t++)
+    {
+        const QKDTree * tree = _trees.at(t);
+        if (tree && !tree->withinDistance(center, radius, visitor, resultOut))
+            return false;
+    }
+    return true;
+}
+
+bool QKDForest::containsKey(const QVectorND &position) const
+{
+    if (position.dimension() != this->dimension())
+        return false;
+    else if (this->bufferFind(position) >= 0)
+        return true;
+
+    for (int t = 0; t < _trees.size(); t++)
+    {
+        const QKDTree * tree = _trees.at(t);
+        if (tree && tree->containsKey(position))
+            return true;
+    }
+    return false;
+}
+
+bool QKDForest::value(const QVectorND &positionKey, QVariant *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (positionKey.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_FOREST_DIM;
+        return false;
+    }
+
+    const int bufferIndex = this->bufferFind(positionKey);
+    if (bufferIndex >= 0)
+    {
+        *output = _bufferValues.at(bufferIndex);
+        return true;
+    }
+
+    for (int t = 0; t < _trees.size(); t++)
+    {
+        const QKDTree * tree = _trees.at(t);
+        if (tree && tree->value(positionKey, output))
+            return true;
+    }
+
+    if (resultOut)
+        *resultOut = "Key not found";
+    return false;
+}
+
+QKDTreeDistanceMetric *QKDForest::distanceMetric() const
+{
+    return _distanceMetric;
+}
+
+//private
+const qreal *QKDForest::bufferCoordinates(int index) const
+{
+    return _bufferCoords.constData() + qint64(index) * _dimension;
+}
+
+//private
+int QKDForest::bufferFind(const QVectorND &position) const
+{
+    for (int i = 0; i < _bufferValues.size(); i++)
+    {
+        if (std::equal(position.constData(), position.constData() + _dimension, this->bufferCoordinates(i)))
+            return i;
+    }
+    return -1;
+}
+
+//private
+void QKDForest::merge()
+{
+    //The buffer plus every tree below the first empty slot add up to exactly that slot's size
+    int slot = 0;
+    while (slot < _trees.size() && _trees.at(slot) != 0)
+        slot++;
+    if (slot == _trees.size())
+        _trees.append(0);
+
+    //Duplicates were already turned away by add(), so the tree doesn't need to look for them again
+    QKDTree * merged = new QKDTree(_dimension, true);
+    merged->setDistanceMetric(_distanceMetric, false);
+    const qint64 slotSize = qint64(_bufferSize) << slot;
+    const qint64 intMax = std::numeric_limits<int>::max();
+    merged->_coords.reserve(int(qMin(slotSize * _dimension, intMax)));
+    merged->_values.reserve(int(qMin(slotSize, intMax)));
+
+    merged->_coords += _bufferCoords;
+    merged->_values += _bufferValues;
+    for (int i = 0; i < slot; i++)
+    {
+        merged->_coords += _trees.at(i)->_coords;
+        merged->_values += _trees.at(i)->_values;
+        delete _trees.at(i);
+        _trees[i] = 0;
+    }
+    merged->buildFromStorage(1);
+    _trees[slot] = merged;
+
+    _bufferCoords.clear();
+    _bufferValues.clear();
+}
@@ -0,0 +1,94 @@
+#ifndef QKDFOREST_H
+#define QKDFOREST_H
+
+#include "QKDTree_global.h"
+
+#include "QKDTree.h"
+
+/**
+ * @brief The QKDForest class is a dynamic kd-tree for heavy insert loads, built with the logarithmic
+ * method of Bentley and Saxe. New key/value pairs go into a small unsorted buffer. When the buffer
+ * fills up it is merged with the smaller trees into one perfectly balanced QKDTree, so the forest
+ * always holds at most one tree of each size bufferSize * 2^i. Inserts cost O(log^2 n) amortized and
+ * never leave a badly balanced tree behind.
+ *
+ * Queries visit every tree, starting with the largest. The best distance found so far is handed on so
+ * that the other trees can prune against it.
+ */
+class QKDTREESHARED_EXPORT QKDForest
+{
+public:
+    /**
+     * @brief QKDForest constructs an empty forest that takes positions of the given dimension.
+     * @param dimension
+     * @param allowDuplicates whether or not you can add multiple nodes with the same key
+     * @param distanceMetric the custom distance metric object you would like to use. If 0 euclidean
+     * distance squared is used. The forest takes ownership of it and shares it with its trees. A
+     * metric that QKDTree::setDistanceMetric() would reject is deleted with a qWarning() and the
+     * default used instead; distanceMetric() then differs from the one given.
+     * @param bufferSize how many key/value pairs are collected before they are built into a tree
+     */
+    QKDForest(int dimension, bool allowDuplicates = false, QKDTreeDistanceMetric * distanceMetric = 0,
+              int bufferSize = 64);
+    ~QKDForest();
+
+    int dimension() const;
+    qint64 size() const;
+
+    /**
+     * @brief treeCount returns the number of static trees currently in the forest.
+     * @return
+     */
+    int treeCount() const;
+
+    bool add(QKDTreeNode * node, QString * resultOut = 0);
+    bool add(const QVectorND& position, const QVariant& value, QString * resultOut = 0);
+    bool add(const QPointF& position, const QVariant& value, QString * resultOut = 0);
+
+    void clear();
+
+    bool nearestNode(const QVectorND& position, QKDTreeNode * output, QString * resultOut = 0) const;
+    bool nearestNode(const QPointF& position, QKDTreeNode * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief nearestNodes finds the k nodes nearest to the given position, sorted from nearest to
+     * farthest. If the forest holds fewer than k nodes, all of them are returned.
+     * @param position
+     * @param k
+     * @param output
+     * @param resultOut
+     * @return
+     */
+    bool nearestNodes(const QVectorND& position, int k, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+    bool nearestNodes(const QPointF& position, int k, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+
+    bool withinDistance(const QVectorND& center, qreal radius, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+    bool withinDistance(const QPointF& center, qreal radius, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+    bool withinDistance(const QVectorND& center, qreal radius, QKDTreeVisitor * visitor, QString * resultOut = 0) const;
+
+    bool containsKey(const QVectorND& position) const;
+    bool value(const QVectorND& positionKey, QVariant * output, QString * resultOut = 0) const;
+
+    QKDTreeDistanceMetric * distanceMetric() const;
+
+private:
+    const qreal * bufferCoordinates(int index) const;
+    int bufferFind(const QVectorND& position) const;
+    void merge();
+
+private:
+    int _dimension;
+    qint64 _size;
+    bool _allowDuplicates;
+    QKDTreeDistanceMetric * _distanceMetric;
+
+    //The insert buffer, stored like QKDTree's own arrays
+    int _bufferSize;
+    QVector<qreal> _bufferCoords;
+    QVector<QVariant> _bufferValues;
+
+    //_trees[i] holds bufferSize * 2^i key/value pairs, or is 0
+    QVector<QKDTree *> _trees;
+};
+
+#endif // QKDFOREST_H
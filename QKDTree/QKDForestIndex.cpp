@@ -0,0 +1,457 @@
+#include "QKDForestIndex.h"
+
+#include "QKDTreeInternal.h"
+
+#include <QPair>
+#include <QStack>
+#include <QVarLengthArray>
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+//How many of the highest-variance dimensions each split picks from
+const int RANDOM_DIMENSIONS = 5;
+
+//How many keys of a subtree are looked at to estimate the variance of each dimension
+const int VARIANCE_SAMPLES = 100;
+
+//xorshift32. The state must never be 0.
+quint32 nextRandom(quint32 * state)
+{
+    quint32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+//Orders point indices by a single coordinate, breaking ties by index so the order is total
+class CoordinateLess
+{
+public:
+    CoordinateLess(const qreal * coords, int dimension, int dim) :
+        _coords(coords), _dimension(dimension), _dim(dim)
+    {
+    }
+
+    bool operator()(quint32 a, quint32 b) const
+    {
+        const qreal valA = _coords[qint64(a) * _dimension + _dim];
+        const qreal valB = _coords[qint64(b) * _dimension + _dim];
+        if (valA != valB)
+            return valA < valB;
+        return a < b;
+    }
+
+private:
+    const qreal * _coords;
+    int _dimension;
+    int _dim;
+};
+
+//A subtree still to be built: order[begin] to order[end - 1], hanging off parent
+struct IndexBuildRange
+{
+    int begin;
+    int end;
+    quint32 parent;
+    bool isLeft;
+};
+
+//An unexplored branch of one of the trees, with a lower bound of its distance to the search position
+struct Branch
+{
+    qreal bound;
+    int tree;
+    quint32 node;
+};
+
+//Makes the std heap functions keep the nearest branch on top
+bool branchFarther(const Branch& a, const Branch& b)
+{
+    return a.bound > b.bound;
+}
+
+/*
+ * The keys one query has already checked, as an open-addressing hash set. It costs memory in
+ * proportion to the keys checked, which the check budget keeps small, rather than to the size of the
+ * index. Up to 256 keys fit without allocating.
+ */
+class CheckedSet
+{
+public:
+    CheckedSet(int expected) : _count(0)
+    {
+        int capacity = 512;
+        while (capacity < 2 * expected)
+            capacity *= 2;
+        _slots.resize(capacity);
+        std::fill(_slots.begin(), _slots.end(), quint32(EMPTY));
+    }
+
+    //Adds point, returning false if it was already there
+    bool insert(quint32 point)
+    {
+        if (2 * (_count + 1) > _slots.size())
+            this->grow();
+
+        const int mask = _slots.size() - 1;
+        for (int i = CheckedSet::hash(point) & mask; ; i = (i + 1) & mask)
+        {
+            if (_slots[i] == point)
+                return false;
+            else if (_slots[i] == EMPTY)
+            {
+                _slots[i] = point;
+                _count++;
+                return true;
+            }
+        }
+    }
+
+private:
+    static const quint32 EMPTY = 0xFFFFFFFF;
+
+    //Spreads neighbouring indices apart, since linear probing clusters badly on runs
+    static int hash(quint32 x)
+    {
+        x ^= x >> 16;
+        x *= 0x45d9f3bU;
+        x ^= x >> 16;
+        return int(x & 0x7FFFFFFF);
+    }
+
+    void grow()
+    {
+        const QVarLengthArray<quint32, 512> old(_slots);
+        _slots.resize(2 * old.size());
+        std::fill(_slots.begin(), _slots.end(), quint32(EMPTY));
+        _count = 0;
+        for (int i = 0; i < old.size(); i++)
+        {
+            if (old[i] != EMPTY)
+                this->insert(old[i]);
+        }
+    }
+
+    QVarLengthArray<quint32, 512> _slots;
+    int _count;
+};
+
+//The same sum, in the same order, as QKDTreeDistanceMetric::distance()
+inline qreal squaredDistance(const qreal * a, const qreal * b, int dimension)
+{
+    qreal toRet = 0.0;
+    for (int i = 0; i < dimension; i++)
+    {
+        const qreal delta = a[i] - b[i];
+        toRet += delta * delta;
+    }
+    return toRet;
+}
+}
+
+QKDForestIndex::QKDForestIndex(int dimension, int treeCount, quint32 seed) :
+    _dimension(dimension), _treeCount(qMax(1, treeCount)), _seed(seed ? seed : 1)
+{
+}
+
+int QKDForestIndex::dimension() const
+{
+    return _dimension;
+}
+
+int QKDForestIndex::treeCount() const
+{
+    return _treeCount;
+}
+
+qint64 QKDForestIndex::size() const
+{
+    return _values.size();
+}
+
+bool QKDForestIndex::build(const QVector<QVectorND> &positions, const QVector<QVariant> &values, QString *resultOut)
+{
+    if (positions.size() != values.size())
+    {
+        if (resultOut)
+            *resultOut = "positions and values must have the same length";
+        return false;
+    }
+
+    for (int i = 0; i < positions.size(); i++)
+    {
+        if (positions.at(i).dimension() != this->dimension())
+        {
+            if (resultOut)
+                *resultOut = ERR_STRING_BAD_INDEX_DIM;
+            return false;
+        }
+    }
+
+    this->clear();
+
+    _coords.reserve(positions.size() * _dimension);
+    for (int i = 0; i < positions.size(); i++)
+    {
+        const QVectorND& position = positions.at(i);
+        for (int d = 0; d < _dimension; d++)
+            _coords.append(position[d]);
+    }
+    _values = values;
+
+    quint32 seed = _seed;
+    _trees.resize(_treeCount);
+    for (int t = 0; t < _treeCount; t++)
+        this->buildTree(&_trees[t], &seed);
+
+    return true;
+}
+
+void QKDForestIndex::clear()
+{
+    _coords.clear();
+    _values.clear();
+    _trees.clear();
+}
+
+bool QKDForestIndex::nearestNodes(const QVectorND &position, int k, int maxChecks, QList<QKDTreeNode> *output,
+                                  QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (k <= 0)
+    {
+        if (resultOut)
+            *resultOut = "k must be positive";
+        return false;
+    }
+    else if (position.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_INDEX_DIM;
+        return false;
+    }
+    else if (_values.isEmpty())
+    {
+        if (resultOut)
+            *resultOut = "Index is empty";
+        return false;
+    }
+
+    const qreal * search = position.constData();
+    const int budget = (maxChecks > 0) ? maxChecks : std::numeric_limits<int>::max();
+
+    //One queue for every tree, so the budget goes to whichever tree has the most promising branch
+    QVector<Branch> branches;
+    branches.reserve(_trees.size() * 16);
+    for (int t = 0; t < _trees.size(); t++)
+    {
+        const Branch root = {0.0, t, _trees.at(t).root};
+        branches.append(root);
+    }
+
+    //Max-heap of the k best so far, so the worst of them is always at the front
+    QVector<QPair<qreal, quint32> > best;
+    best.reserve(k);
+
+    //Exact searches have no budget to size it by, so they start small and let it grow
+    CheckedSet checked(qMin(budget, 4096));
+    int checks = 0;
+    while (!branches.isEmpty() && checks < budget)
+    {
+        std::pop_heap(branches.begin(), branches.end(), branchFarther);
+        const Branch branch = branches.last();
+        branches.removeLast();
+
+        //Every other branch is at least as far away, so none of them can improve on best
+        if (best.size() == k && branch.bound >= best.first().first)
+            break;
+
+        const QVector<Node>& nodes = _trees.at(branch.tree).nodes;
+        quint32 current = branch.node;
+        while (current != NO_NODE && checks < budget)
+        {
+            const Node& node = nodes.at(current);
+            const qreal * pos = this->coordinates(node.point);
+            const int divDim = node.dividingDimension;
+            const qreal delta = search[divDim] - pos[divDim];
+
+            if (checked.insert(node.point))
+            {
+                checks++;
+
+                const qreal dist = squaredDistance(pos, search, _dimension);
+                if (best.size() < k)
+                {
+                    best.append(qMakePair(dist, node.point));
+                    std::push_heap(best.begin(), best.end());
+                }
+                else if (dist < best.first().first)
+                {
+                    std::pop_heap(best.begin(), best.end());
+                    best.last() = qMakePair(dist, node.point);
+                    std::push_heap(best.begin(), best.end());
+                }
+            }
+
+            const quint32 farSide = (delta <= 0.0) ? node.right : node.left;
+            if (farSide != NO_NODE)
+            {
+                const qreal bound = qMax(branch.bound, delta * delta);
+                if (best.size() < k || bound < best.first().first)
+                {
+                    const Branch far = {bound, branch.tree, farSide};
+                    branches.append(far);
+                    std::push_heap(branches.begin(), branches.end(), branchFarther);
+                }
+            }
+            current = (delta <= 0.0) ? node.left : node.right;
+        }
+    }
+
+    std::sort_heap(best.begin(), best.end());
+
+    output->clear();
+    for (int i = 0; i < best.size(); i++)
+    {
+        const quint32 point = best[i].second;
+        output->append(QKDTreeNode(QVectorND(this->coordinates(point), _dimension), _values.at(point)));
+    }
+
+    return true;
+}
+
+bool QKDForestIndex::nearestNode(const QVectorND &position, int maxChecks, QKDTreeNode *output,
+                                 QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+
+    QList<QKDTreeNode> nearest;
+    if (!this->nearestNodes(position, 1, maxChecks, &nearest, resultOut))
+        return false;
+
+    *output = nearest.first();
+    return true;
+}
+
+//private
+void QKDForestIndex::buildTree(Tree *tree, quint32 *seed) const
+{
+    const int count = _values.size();
+    tree->nodes.clear();
+    tree->nodes.reserve(count);
+    tree->root = NO_NODE;
+    if (count == 0)
+        return;
+
+    QVector<quint32> order(count);
+    for (int i = 0; i < count; i++)
+        order[i] = i;
+
+    QStack<IndexBuildRange> toBuild;
+    const IndexBuildRange whole = {0, count, NO_NODE, true};
+    toBuild.push(whole);
+
+    while (!toBuild.isEmpty())
+    {
+        const IndexBuildRange range = toBuild.pop();
+        quint32 * begin = order.data() + range.begin;
+        quint32 * end = order.data() + range.end;
+
+        //Split on the median along the chosen dimension, so lower keys end up on the left
+        const int dim = this->chooseDimension(begin, end, seed);
+        const int pivotIndex = range.begin + (range.end - range.begin) / 2;
+        std::nth_element(begin, order.data() + pivotIndex, end, CoordinateLess(_coords.constData(), _dimension, dim));
+
+        const Node node = {NO_NODE, NO_NODE, order[pivotIndex], dim};
+        const quint32 index = tree->nodes.size();
+        tree->nodes.append(node);
+        if (range.parent == NO_NODE)
+            tree->root = index;
+        else if (range.isLeft)
+            tree->nodes[range.parent].left = index;
+        else
+            tree->nodes[range.parent].right = index;
+
+        if (pivotIndex > range.begin)
+        {
+            const IndexBuildRange left = {range.begin, pivotIndex, index, true};
+            toBuild.push(left);
+        }
+        if (pivotIndex + 1 < range.end)
+        {
+            const IndexBuildRange right = {pivotIndex + 1, range.end, index, false};
+            toBuild.push(right);
+        }
+    }
+}
+
+//private
+int QKDForestIndex::chooseDimension(const quint32 *begin, const quint32 *end, quint32 *seed) const
+{
+    //Estimate the variance of every dimension from evenly spaced keys of the subtree
+    const int count = end - begin;
+    const int samples = qMin(count, VARIANCE_SAMPLES);
+    QVarLengthArray<qreal, 128> mean(_dimension);
+    QVarLengthArray<qreal, 128> variance(_dimension);
+    for (int d = 0; d < _dimension; d++)
+    {
+        mean[d] = 0.0;
+        variance[d] = 0.0;
+    }
+
+    for (int s = 0; s < samples; s++)
+    {
+        const qreal * pos = this->coordinates(begin[qint64(s) * count / samples]);
+        for (int d = 0; d < _dimension; d++)
+            mean[d] += pos[d];
+    }
+    for (int d = 0; d < _dimension; d++)
+        mean[d] /= samples;
+
+    for (int s = 0; s < samples; s++)
+    {
+        const qreal * pos = this->coordinates(begin[qint64(s) * count / samples]);
+        for (int d = 0; d < _dimension; d++)
+        {
+            const qreal delta = pos[d] - mean[d];
+            variance[d] += delta * delta;
+        }
+    }
+
+    //Keep the highest few in a short sorted list, then pick one of them at random
+    QVarLengthArray<int, RANDOM_DIMENSIONS> top;
+    for (int d = 0; d < _dimension; d++)
+    {
+        if (top.size() == RANDOM_DIMENSIONS && variance[d] <= variance[top.last()])
+            continue;
+        if (top.size() < RANDOM_DIMENSIONS)
+            top.append(d);
+        else
+            top[top.size() - 1] = d;
+
+        for (int i = top.size() - 1; i > 0 && variance[top[i]] > variance[top[i - 1]]; i--)
+            std::swap(top[i], top[i - 1]);
+    }
+
+    return top[nextRandom(seed) % top.size()];
+}
+
+//private
+const qreal *QKDForestIndex::coordinates(quint32 point) const
+{
+    return _coords.constData() + qint64(point) * _dimension;
+}
@@ -0,0 +1,104 @@
+#ifndef QKDFORESTINDEX_H
+#define QKDFORESTINDEX_H
+
+#include "QKDTree_global.h"
+
+#include "QKDTreeNode.h"
+#include "QVectorND.h"
+
+#include <QList>
+#include <QVector>
+
+/**
+ * @brief The QKDForestIndex class is a randomized kd-forest for approximate nearest neighbor searches
+ * over high-dimensional keys (feature vectors and the like), where a single kd-tree that splits on
+ * each dimension in turn degrades into a slow linear scan.
+ *
+ * The index holds treeCount() trees over one shared copy of the key/value pairs. Each subtree is split
+ * on its median along a dimension picked at random among the few dimensions in which its keys vary
+ * most, so every tree divides space differently. A query descends all trees at once: unexplored
+ * branches of every tree wait on one priority queue, nearest first, and a single budget caps the
+ * number of keys whose distance is computed. Keys found through more than one tree are only checked
+ * once.
+ *
+ * Distances are squared euclidean. The index is built in one go by build(); it has no add() or
+ * remove().
+ */
+class QKDTREESHARED_EXPORT QKDForestIndex
+{
+public:
+    /**
+     * @brief QKDForestIndex constructs an empty index that takes positions of the given dimension.
+     * @param dimension
+     * @param treeCount how many randomized trees to build. 4 to 8 is usually plenty.
+     * @param seed seeds the random choice of splitting dimensions, so equal seeds give equal indexes
+     */
+    QKDForestIndex(int dimension, int treeCount = 4, quint32 seed = 1);
+
+    int dimension() const;
+    int treeCount() const;
+    qint64 size() const;
+
+    /**
+     * @brief build replaces the contents of the index with the given key/value pairs and builds
+     * treeCount() trees over them. O(treeCount * nlogn) time.
+     * @param positions
+     * @param values must have the same length as positions
+     * @param resultOut
+     * @return
+     */
+    bool build(const QVector<QVectorND>& positions, const QVector<QVariant>& values, QString * resultOut = 0);
+    void clear();
+
+    /**
+     * @brief nearestNodes finds (approximately) the k nodes nearest to position, sorted from nearest to
+     * farthest. The search stops once the distances of maxChecks keys have been computed, or earlier if
+     * nothing left in any tree could be nearer than what it has.
+     * @param position
+     * @param k
+     * @param maxChecks how many keys to check at most. 0 or less means no limit, which gives the exact
+     * answer.
+     * @param output
+     * @param resultOut
+     * @return
+     */
+    bool nearestNodes(const QVectorND& position, int k, int maxChecks, QList<QKDTreeNode> * output,
+                      QString * resultOut = 0) const;
+    bool nearestNode(const QVectorND& position, int maxChecks, QKDTreeNode * output, QString * resultOut = 0) const;
+
+private:
+    /*
+     * Every tree has a node per key/value pair. A node splits on the key it holds, which is stored
+     * once for all trees at _coords[point * _dimension].
+     */
+    struct Node
+    {
+        quint32 left;
+        quint32 right;
+        quint32 point;
+        qint32 dividingDimension;
+    };
+
+    struct Tree
+    {
+        QVector<Node> nodes;
+        quint32 root;
+    };
+
+    static const quint32 NO_NODE = 0xFFFFFFFF;
+
+    void buildTree(Tree * tree, quint32 * seed) const;
+    int chooseDimension(const quint32 * begin, const quint32 * end, quint32 * seed) const;
+    const qreal * coordinates(quint32 point) const;
+
+private:
+    int _dimension;
+    int _treeCount;
+    quint32 _seed;
+
+    QVector<qreal> _coords;
+    QVector<QVariant> _values;
+    QVector<Tree> _trees;
+};
+
+#endif // QKDFORESTINDEX_H
@@ -0,0 +1,802 @@
+#include "QKDSnapshotTree.h"
+
+#include "QKDTreeInternal.h"
+
+#include <QPair>
+#include <QStack>
+#include <QVarLengthArray>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+//The same alpha as QKDTree::setBalanceFactor(2.0)
+const qreal SNAPSHOT_BALANCE_FACTOR = 2.0;
+
+namespace
+{
+/*
+ * Nodes are never modified once another version can see them. Writers copy the nodes they need to
+ * change, so each version shares every untouched subtree with the version before it.
+ */
+struct SnapshotNode
+{
+    SnapshotNode() : dividingDimension(0), dead(false), size(1)
+    {
+    }
+
+    ~SnapshotNode();
+
+    QVectorND position;
+    QVariant value;
+    int dividingDimension;
+    bool dead;
+
+    //Nodes in this subtree, dead ones included
+    qint64 size;
+
+    std::shared_ptr<const SnapshotNode> left;
+    std::shared_ptr<const SnapshotNode> right;
+};
+
+typedef std::shared_ptr<const SnapshotNode> NodePtr;
+
+/*
+ * Copies of one key always go left, so with duplicates allowed they form a chain no rebuild can
+ * shorten, and nested shared_ptr destructors would take a stack frame per node of it. Instead the
+ * outermost node destroyed on a thread keeps a list, every node destroyed while it runs just hands
+ * its children to that list, and the outermost one drops them one at a time. Only the dying node's
+ * own links are moved, so a child still shared with another version merely loses a reference.
+ */
+SnapshotNode::~SnapshotNode()
+{
+    static thread_local std::vector<NodePtr> * doomed = 0;
+    if (doomed)
+    {
+        if (left)
+            doomed->push_back(std::move(left));
+        if (right)
+            doomed->push_back(std::move(right));
+        return;
+    }
+
+    std::vector<NodePtr> pending;
+    if (left)
+        pending.push_back(std::move(left));
+    if (right)
+        pending.push_back(std::move(right));
+
+    doomed = &pending;
+    while (!pending.empty())
+    {
+        NodePtr node = std::move(pending.back());
+        pending.pop_back();
+        node.reset();
+    }
+    doomed = 0;
+}
+
+//Lets the searches shared with QKDTree (see QKDTreeInternal.h) walk a version's nodes
+class SnapshotNodes
+{
+public:
+    typedef const SnapshotNode * Index;
+
+    SnapshotNodes(const SnapshotNode * root) : _root(root)
+    {
+    }
+
+    Index root() const
+    {
+        return _root;
+    }
+
+    bool isNull(Index node) const
+    {
+        return node == 0;
+    }
+
+    const qreal * coordinates(Index node) const
+    {
+        return node->position.constData();
+    }
+
+    int dividingDimension(Index node) const
+    {
+        return node->dividingDimension;
+    }
+
+    bool isDead(Index node) const
+    {
+        return node->dead;
+    }
+
+    Index left(Index node) const
+    {
+        return node->left.get();
+    }
+
+    Index right(Index node) const
+    {
+        return node->right.get();
+    }
+
+private:
+    const SnapshotNode * _root;
+};
+
+bool samePosition(const QVectorND& a, const QVectorND& b)
+{
+    return std::equal(a.constData(), a.constData() + a.dimension(), b.constData());
+}
+
+//Gathers the live key/value pairs below root
+void collectLive(const SnapshotNode * root, QVector<QVectorND> * positions, QVector<QVariant> * values)
+{
+    QStack<const SnapshotNode *> pending;
+    if (root)
+        pending.push(root);
+
+    while (!pending.isEmpty())
+    {
+        const SnapshotNode * node = pending.pop();
+        if (!node->dead)
+        {
+            positions->append(node->position);
+            values->append(node->value);
+        }
+        if (node->left)
+            pending.push(node->left.get());
+        if (node->right)
+            pending.push(node->right.get());
+    }
+}
+
+/*
+ * Builds a balanced subtree by median split, with the same splitting rule as QKDTree::build(). Done
+ * in two passes because a node can only be created once its children exist: first lay out the tree
+ * top-down, then create it bottom-up.
+ */
+NodePtr buildBalanced(const QVector<QVectorND>& positions, const QVector<QVariant>& values, int firstDimension)
+{
+    if (positions.isEmpty())
+        return NodePtr();
+
+    struct Range
+    {
+        int begin;
+        int end;
+        int dividingDimension;
+        int parent;
+        bool isLeft;
+    };
+
+    struct Planned
+    {
+        int item;
+        int dividingDimension;
+        int left;
+        int right;
+    };
+
+    const int dimension = positions.first().dimension();
+    QVector<qreal> coords(positions.size() * dimension);
+    QVector<quint32> order(positions.size());
+    for (int i = 0; i < positions.size(); i++)
+    {
+        std::copy(positions.at(i).constData(), positions.at(i).constData() + dimension, coords.data() + i * dimension);
+        order[i] = i;
+    }
+
+    QVector<Planned> plan;
+    plan.reserve(positions.size());
+
+    QStack<Range> ranges;
+    const Range whole = {0, order.size(), firstDimension, -1, false};
+    ranges.push(whole);
+    while (!ranges.isEmpty())
+    {
+        const Range range = ranges.pop();
+        const int d = range.dividingDimension;
+        quint32 * pivot = QKDTreeInternal::splitAtMedian(0, coords.constData(), dimension, d,
+                                                         order.data() + range.begin, order.data() + range.end, 0);
+
+        const Planned planned = {int(*pivot), d, -1, -1};
+        plan.append(planned);
+        const int index = plan.size() - 1;
+        if (range.parent >= 0)
+        {
+            if (range.isLeft)
+                plan[range.parent].left = index;
+            else
+                plan[range.parent].right = index;
+        }
+
+        const int next = (d + 1) % dimension;
+        const int pivotOffset = int(pivot - order.data());
+        if (pivotOffset > range.begin)
+        {
+            const Range left = {range.begin, pivotOffset, next, index, true};
+            ranges.push(left);
+        }
+        if (pivotOffset + 1 < range.end)
+        {
+            const Range right = {pivotOffset + 1, range.end, next, index, false};
+            ranges.push(right);
+        }
+    }
+
+    //Children are always planned after their parent
+    QVector<NodePtr> built(plan.size());
+    for (int i = plan.size() - 1; i >= 0; i--)
+    {
+        const Planned& planned = plan.at(i);
+        std::shared_ptr<SnapshotNode> node = std::make_shared<SnapshotNode>();
+        node->position = positions.at(planned.item);
+        node->value = values.at(planned.item);
+        node->dividingDimension = planned.dividingDimension;
+        if (planned.left >= 0)
+        {
+            node->left = std::move(built[planned.left]);
+            node->size += node->left->size;
+        }
+        if (planned.right >= 0)
+        {
+            node->right = std::move(built[planned.right]);
+            node->size += node->right->size;
+        }
+        built[i] = node;
+    }
+    return built.first();
+}
+
+//Runs the shared nearest neighbor search with whichever metric adapter dispatchMetric picks
+class SnapshotNearest
+{
+public:
+    SnapshotNearest(const SnapshotNode * root, const QVectorND& searchPos, int k,
+                    QVector<QPair<qreal, const SnapshotNode *> > * output) :
+        _root(root), _searchPos(searchPos), _k(k), _output(output)
+    {
+    }
+
+    template <typename Metric>
+    void operator()(const Metric& metric) const
+    {
+        QKDTreeInternal::nearestCandidates(SnapshotNodes(_root), metric, _searchPos, _k,
+                                           std::numeric_limits<qreal>::max(), 0.0, _output, 0);
+    }
+
+private:
+    const SnapshotNode * _root;
+    const QVectorND& _searchPos;
+    int _k;
+    QVector<QPair<qreal, const SnapshotNode *> > * _output;
+};
+
+//Runs the shared radius search with whichever metric adapter dispatchMetric picks
+class SnapshotWithin
+{
+public:
+    SnapshotWithin(const SnapshotNode * root, const QVectorND& center, qreal radius, QKDTreeVisitor * visitor) :
+        _root(root), _center(center), _radius(radius), _visitor(visitor)
+    {
+    }
+
+    template <typename Metric>
+    void operator()(const Metric& metric) const
+    {
+        QKDTreeVisitor * visitor = _visitor;
+        QKDTreeInternal::withinDistance(SnapshotNodes(_root), metric, _center, _radius, [=](const SnapshotNode * node) {
+            visitor->visit(node->position, node->value);
+        });
+    }
+
+private:
+    const SnapshotNode * _root;
+    const QVectorND& _center;
+    qreal _radius;
+    QKDTreeVisitor * _visitor;
+};
+}
+
+struct QKDSnapshotVersion
+{
+    NodePtr root;
+    qint64 size;
+    qint64 deadCount;
+    quint64 version;
+    int dimension;
+    std::shared_ptr<const QKDTreeDistanceMetric> distanceMetric;
+    QKDTreeInternal::MetricKind metricKind;
+
+    const SnapshotNode * find(const QVectorND& position) const
+    {
+        const qreal * pos = position.constData();
+        const SnapshotNode * current = root.get();
+        while (current)
+        {
+            if (!current->dead && samePosition(current->position, position))
+                return current;
+
+            const int divDim = current->dividingDimension;
+            current = (pos[divDim] <= current->position[divDim]) ? current->left.get() : current->right.get();
+        }
+        return 0;
+    }
+};
+
+QKDTreeSnapshot::QKDTreeSnapshot()
+{
+}
+
+bool QKDTreeSnapshot::isNull() const
+{
+    return !_version;
+}
+
+quint64 QKDTreeSnapshot::version() const
+{
+    return _version ? _version->version : 0;
+}
+
+int QKDTreeSnapshot::dimension() const
+{
+    return _version ? _version->dimension : 0;
+}
+
+qint64 QKDTreeSnapshot::size() const
+{
+    return _version ? _version->size : 0;
+}
+
+bool QKDTreeSnapshot::nearestNode(const QVectorND &position, QKDTreeNode *output, QString *resultOut) const
+{
+    QList<QKDTreeNode> nearest;
+    if (!this->nearestNodes(position, 1, &nearest, resultOut))
+        return false;
+    else if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+
+    *output = nearest.first();
+    return true;
+}
+
+bool QKDTreeSnapshot::nearestNode(const QPointF &position, QKDTreeNode *output, QString *resultOut) const
+{
+    return this->nearestNode(QVectorND(position), output, resultOut);
+}
+
+bool QKDTreeSnapshot::nearestNodes(const QVectorND &position, int k, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (k <= 0)
+    {
+        if (resultOut)
+            *resultOut = "k must be positive";
+        return false;
+    }
+    else if (position.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (this->size() <= 0)
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    QVector<QPair<qreal, const SnapshotNode *> > best;
+    QKDTreeInternal::dispatchMetric(_version->metricKind, _version->distanceMetric.get(), _version->dimension,
+                                    SnapshotNearest(_version->root.get(), position, k, &best));
+
+    output->clear();
+    for (int i = 0; i < best.size(); i++)
+        output->append(QKDTreeNode(best[i].second->position, best[i].second->value));
+    return true;
+}
+
+bool QKDTreeSnapshot::nearestNodes(const QPointF &position, int k, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    return this->nearestNodes(QVectorND(position), k, output, resultOut);
+}
+
+bool QKDTreeSnapshot::withinDistance(const QVectorND &center, qreal radius, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+
+    output->clear();
+    QKDTreeNodeCollector collector(output);
+    return this->withinDistance(center, radius, &collector, resultOut);
+}
+
+bool QKDTreeSnapshot::withinDistance(const QPointF &center, qreal radius, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    return this->withinDistance(QVectorND(center), radius, output, resultOut);
+}
+
+bool QKDTreeSnapshot::withinDistance(const QVectorND &center, qreal radius, QKDTreeVisitor *visitor, QString *resultOut) const
+{
+    if (visitor == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_VISITOR;
+        return false;
+    }
+    else if (center.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (this->size() <= 0)
+        return true;
+
+    QKDTreeInternal::dispatchMetric(_version->metricKind, _version->distanceMetric.get(), _version->dimension,
+                                    SnapshotWithin(_version->root.get(), center, radius, visitor));
+    return true;
+}
+
+bool QKDTreeSnapshot::containsKey(const QVectorND &position) const
+{
+    if (!_version || position.dimension() != this->dimension())
+        return false;
+    return _version->find(position) != 0;
+}
+
+bool QKDTreeSnapshot::value(const QVectorND &positionKey, QVariant *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (!_version)
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+    else if (positionKey.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+
+    const SnapshotNode * found = _version->find(positionKey);
+    if (found == 0)
+    {
+        if (resultOut)
+            *resultOut = "Key not found";
+        return false;
+    }
+
+    *output = found->value;
+    return true;
+}
+
+//private
+QKDTreeSnapshot::QKDTreeSnapshot(const std::shared_ptr<const QKDSnapshotVersion> &version) :
+    _version(version)
+{
+}
+
+QKDSnapshotTree::QKDSnapshotTree(int dimension, bool allowDuplicates, QKDTreeDistanceMetric *distanceMetric) :
+    _dimension(dimension), _allowDuplicates(allowDuplicates)
+{
+    //If they don't give us a distance metric (or one that doesn't fit), just use the default
+    distanceMetric = QKDTreeInternal::metricOrDefault(distanceMetric, _dimension, "QKDSnapshotTree");
+    _distanceMetric.reset(distanceMetric);
+
+    std::shared_ptr<QKDSnapshotVersion> empty = std::make_shared<QKDSnapshotVersion>();
+    empty->size = 0;
+    empty->deadCount = 0;
+    empty->version = 0;
+    empty->dimension = _dimension;
+    empty->distanceMetric = _distanceMetric;
+    empty->metricKind = QKDTreeInternal::metricKind(distanceMetric);
+    _current = empty;
+}
+
+QKDSnapshotTree::~QKDSnapshotTree()
+{
+}
+
+int QKDSnapshotTree::dimension() const
+{
+    return _dimension;
+}
+
+const QKDTreeDistanceMetric *QKDSnapshotTree::distanceMetric() const
+{
+    return _distanceMetric.get();
+}
+
+qint64 QKDSnapshotTree::size() const
+{
+    return this->current()->size;
+}
+
+QKDTreeSnapshot QKDSnapshotTree::snapshot() const
+{
+    return QKDTreeSnapshot(this->current());
+}
+
+bool QKDSnapshotTree::add(const QVectorND &position, const QVariant &value, QString *resultOut)
+{
+    if (position.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+
+    const std::shared_ptr<const QKDSnapshotVersion> previous = this->current();
+    const qreal * pos = position.constData();
+
+    //The nodes on the way down are the ones the new version needs its own copies of
+    QVarLengthArray<const SnapshotNode *, 64> path;
+    const SnapshotNode * current = previous->root.get();
+    while (current)
+    {
+        if (!_allowDuplicates && !current->dead && samePosition(current->position, position))
+        {
+            if (resultOut)
+                *resultOut = "Cannot add duplicate";
+            return false;
+        }
+
+        path.append(current);
+        const int divDim = current->dividingDimension;
+        current = (pos[divDim] <= current->position[divDim]) ? current->left.get() : current->right.get();
+    }
+
+    //Too deep? Find the scapegoat: the deepest ancestor whose subtree is too tall for its size
+    const int depth = path.size();
+    const qint64 total = previous->size + previous->deadCount + 1;
+    int scapegoat = -1;
+    if (depth > SNAPSHOT_BALANCE_FACTOR * std::log2(qreal(total)))
+    {
+        for (int i = depth - 1; i >= 0; i--)
+        {
+            if (depth - i > SNAPSHOT_BALANCE_FACTOR * std::log2(qreal(path[i]->size + 1)))
+            {
+                scapegoat = i;
+                break;
+            }
+        }
+    }
+
+    NodePtr child;
+    int top = depth;
+    qint64 deadDropped = 0;
+    if (scapegoat >= 0)
+    {
+        //Rebuild the scapegoat's subtree with the new pair in it, leaving its dead nodes behind
+        QVector<QVectorND> positions;
+        QVector<QVariant> values;
+        collectLive(path[scapegoat], &positions, &values);
+        deadDropped = path[scapegoat]->size - positions.size();
+        positions.append(position);
+        values.append(value);
+        child = buildBalanced(positions, values, path[scapegoat]->dividingDimension);
+        top = scapegoat;
+    }
+    else
+    {
+        std::shared_ptr<SnapshotNode> leaf = std::make_shared<SnapshotNode>();
+        leaf->position = position;
+        leaf->value = value;
+        if (!path.isEmpty())
+            leaf->dividingDimension = (path.last()->dividingDimension + 1) % this->dimension();
+        child = leaf;
+    }
+
+    //Copy the path above it, pointing each copy at the new version of its child
+    for (int i = top - 1; i >= 0; i--)
+    {
+        std::shared_ptr<SnapshotNode> copy = std::make_shared<SnapshotNode>(*path[i]);
+        copy->size += 1 - deadDropped;
+        if (pos[copy->dividingDimension] <= copy->position[copy->dividingDimension])
+            copy->left = child;
+        else
+            copy->right = child;
+        child = copy;
+    }
+
+    std::shared_ptr<QKDSnapshotVersion> next = std::make_shared<QKDSnapshotVersion>(*previous);
+    next->root = child;
+    next->size = previous->size + 1;
+    next->deadCount = previous->deadCount - deadDropped;
+    this->publish(previous, next);
+    return true;
+}
+
+bool QKDSnapshotTree::add(const QPointF &position, const QVariant &value, QString *resultOut)
+{
+    return this->add(QVectorND(position), value, resultOut);
+}
+
+bool QKDSnapshotTree::remove(const QVectorND &position, QString *resultOut)
+{
+    if (position.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+
+    const std::shared_ptr<const QKDSnapshotVersion> previous = this->current();
+    const qreal * pos = position.constData();
+
+    //Every copy of a key lies on the path a lookup takes, since ties always go left
+    QVarLengthArray<const SnapshotNode *, 64> path;
+    QVarLengthArray<int, 8> matches;
+    int last = -1;
+    const SnapshotNode * current = previous->root.get();
+    while (current)
+    {
+        path.append(current);
+        if (!current->dead && samePosition(current->position, position))
+        {
+            last = path.size() - 1;
+            matches.append(last);
+            if (!_allowDuplicates)
+                break;
+        }
+
+        const int divDim = current->dividingDimension;
+        current = (pos[divDim] <= current->position[divDim]) ? current->left.get() : current->right.get();
+    }
+
+    if (last < 0)
+    {
+        if (resultOut)
+            *resultOut = "Key not found";
+        return false;
+    }
+
+    //Copy the path down to the last match, marking the matches dead
+    NodePtr child;
+    int removed = 0;
+    for (int i = last; i >= 0; i--)
+    {
+        std::shared_ptr<SnapshotNode> copy = std::make_shared<SnapshotNode>(*path[i]);
+        if (!matches.isEmpty() && matches.last() == i)
+        {
+            matches.removeLast();
+            copy->dead = true;
+            copy->value = QVariant();
+            removed++;
+        }
+        if (i < last)
+        {
+            if (copy->left.get() == path[i + 1])
+                copy->left = child;
+            else
+                copy->right = child;
+        }
+        child = copy;
+    }
+
+    std::shared_ptr<QKDSnapshotVersion> next = std::make_shared<QKDSnapshotVersion>(*previous);
+    next->root = child;
+    next->size = previous->size - removed;
+    next->deadCount = previous->deadCount + removed;
+
+    //Once most of the tree is dead, start the next version over from the live pairs
+    if (next->deadCount > next->size)
+    {
+        QVector<QVectorND> positions;
+        QVector<QVariant> values;
+        collectLive(next->root.get(), &positions, &values);
+        next->root = buildBalanced(positions, values, 0);
+        next->deadCount = 0;
+    }
+
+    this->publish(previous, next);
+    return true;
+}
+
+bool QKDSnapshotTree::remove(const QPointF &position, QString *resultOut)
+{
+    return this->remove(QVectorND(position), resultOut);
+}
+
+bool QKDSnapshotTree::build(const QVector<QVectorND> &positions, const QVector<QVariant> &values, QString *resultOut)
+{
+    if (positions.size() != values.size())
+    {
+        if (resultOut)
+            *resultOut = "positions and values must have the same length";
+        return false;
+    }
+    for (int i = 0; i < positions.size(); i++)
+    {
+        if (positions.at(i).dimension() != this->dimension())
+        {
+            if (resultOut)
+                *resultOut = ERR_STRING_BAD_DIM;
+            return false;
+        }
+    }
+
+    const std::shared_ptr<const QKDSnapshotVersion> previous = this->current();
+    std::shared_ptr<QKDSnapshotVersion> next = std::make_shared<QKDSnapshotVersion>(*previous);
+    next->deadCount = 0;
+
+    if (_allowDuplicates)
+    {
+        next->root = buildBalanced(positions, values, 0);
+        next->size = positions.size();
+    }
+    else
+    {
+        //Like add(), the first occurrence of a key wins
+        QVector<int> order(positions.size());
+        for (int i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return std::lexicographical_compare(positions.at(a).constData(), positions.at(a).constData() + _dimension,
+                                                positions.at(b).constData(), positions.at(b).constData() + _dimension);
+        });
+
+        QVector<QVectorND> uniquePositions;
+        QVector<QVariant> uniqueValues;
+        for (int i = 0; i < order.size(); i++)
+        {
+            if (i > 0 && samePosition(positions.at(order[i]), positions.at(order[i - 1])))
+                continue;
+            uniquePositions.append(positions.at(order[i]));
+            uniqueValues.append(values.at(order[i]));
+        }
+        next->root = buildBalanced(uniquePositions, uniqueValues, 0);
+        next->size = uniquePositions.size();
+    }
+
+    this->publish(previous, next);
+    return true;
+}
+
+void QKDSnapshotTree::clear()
+{
+    const std::shared_ptr<const QKDSnapshotVersion> previous = this->current();
+    std::shared_ptr<QKDSnapshotVersion> next = std::make_shared<QKDSnapshotVersion>(*previous);
+    next->root.reset();
+    next->size = 0;
+    next->deadCount = 0;
+    this->publish(previous, next);
+}
+
+//private
+std::shared_ptr<const QKDSnapshotVersion> QKDSnapshotTree::current() const
+{
+    return std::atomic_load(&_current);
+}
+
+//private
+void QKDSnapshotTree::publish(const std::shared_ptr<const QKDSnapshotVersion> &previous,
+                              const std::shared_ptr<QKDSnapshotVersion> &next)
+{
+    next->version = previous->version + 1;
+    std::atomic_store(&_current, std::shared_ptr<const QKDSnapshotVersion>(next));
+}
@@ -0,0 +1,158 @@
+#ifndef QKDSNAPSHOTTREE_H
+#define QKDSNAPSHOTTREE_H
+
+#include "QKDTree_global.h"
+
+#include "QKDTreeNode.h"
+#include "QKDTreeDistanceMetric.h"
+#include "QKDTreeVisitor.h"
+#include "QVectorND.h"
+
+#include <memory>
+
+struct QKDSnapshotVersion;
+
+/**
+ * @brief The QKDTreeSnapshot class is a read-only handle to one published version of a
+ * QKDSnapshotTree. The version it refers to never changes, so any number of threads can query a
+ * snapshot at the same time without locking, while the writer goes on publishing new versions.
+ *
+ * Snapshots are cheap to copy. A version (and whatever parts of it no later version shares) is freed
+ * as soon as the last snapshot referring to it goes away.
+ */
+class QKDTREESHARED_EXPORT QKDTreeSnapshot
+{
+public:
+    /**
+     * @brief QKDTreeSnapshot constructs a null snapshot, which holds nothing.
+     */
+    QKDTreeSnapshot();
+
+    bool isNull() const;
+
+    /**
+     * @brief version returns the number of versions the tree had published before this one.
+     * @return
+     */
+    quint64 version() const;
+
+    int dimension() const;
+    qint64 size() const;
+
+    bool nearestNode(const QVectorND& position, QKDTreeNode * output, QString * resultOut = 0) const;
+    bool nearestNode(const QPointF& position, QKDTreeNode * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief nearestNodes finds the k nodes nearest to the given position, sorted from nearest to
+     * farthest. If the snapshot holds fewer than k nodes, all of them are returned.
+     * @param position
+     * @param k
+     * @param output
+     * @param resultOut
+     * @return
+     */
+    bool nearestNodes(const QVectorND& position, int k, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+    bool nearestNodes(const QPointF& position, int k, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+
+    bool withinDistance(const QVectorND& center, qreal radius, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+    bool withinDistance(const QPointF& center, qreal radius, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+    bool withinDistance(const QVectorND& center, qreal radius, QKDTreeVisitor * visitor, QString * resultOut = 0) const;
+
+    bool containsKey(const QVectorND& position) const;
+    bool value(const QVectorND& positionKey, QVariant * output, QString * resultOut = 0) const;
+
+private:
+    friend class QKDSnapshotTree;
+    QKDTreeSnapshot(const std::shared_ptr<const QKDSnapshotVersion>& version);
+
+    std::shared_ptr<const QKDSnapshotVersion> _version;
+};
+
+/**
+ * @brief The QKDSnapshotTree class is a kd-tree for one writer and many concurrent readers. Its nodes
+ * are immutable: add() and remove() copy only the nodes on the path they change, share the rest with
+ * the previous version, and then publish the new root. Readers call snapshot() and query the version
+ * they got for as long as they like; those queries take no locks.
+ *
+ * snapshot() and publishing a version are not lock-free: both go through std::atomic_load and
+ * std::atomic_store on a std::shared_ptr, which most standard libraries implement with a small pool of
+ * mutexes. The lock is held only while the pointer is copied, never while a tree is walked.
+ *
+ * Only snapshot() may be called concurrently with the other methods. add(), remove(), build() and
+ * clear() must all be called from one thread at a time.
+ *
+ * Inserts are kept balanced the same way as QKDTree::setBalanceFactor(2.0), and removed pairs stay
+ * behind as dead dividers until more than half of the tree is dead, at which point the next version
+ * is rebuilt from the live pairs.
+ */
+class QKDTREESHARED_EXPORT QKDSnapshotTree
+{
+public:
+    /**
+     * @brief QKDSnapshotTree constructs an empty tree that takes positions of the given dimension.
+     * @param dimension
+     * @param allowDuplicates whether or not you can add multiple nodes with the same key
+     * @param distanceMetric the custom distance metric object you would like to use. If 0 euclidean
+     * distance squared is used. The tree takes ownership of it; it is deleted once neither the tree nor
+     * any snapshot uses it any more. A metric that QKDTree::setDistanceMetric() would reject is deleted
+     * with a qWarning() and the default used instead; distanceMetric() then differs from the one given.
+     */
+    QKDSnapshotTree(int dimension, bool allowDuplicates = false, QKDTreeDistanceMetric * distanceMetric = 0);
+    ~QKDSnapshotTree();
+
+    int dimension() const;
+    const QKDTreeDistanceMetric * distanceMetric() const;
+
+    /**
+     * @brief size returns the number of key/value pairs in the latest version.
+     * @return
+     */
+    qint64 size() const;
+
+    /**
+     * @brief snapshot returns the latest published version. Safe to call from any thread; it briefly
+     * locks the pointer to the latest version while copying it.
+     * @return
+     */
+    QKDTreeSnapshot snapshot() const;
+
+    bool add(const QVectorND& position, const QVariant& value, QString * resultOut = 0);
+    bool add(const QPointF& position, const QVariant& value, QString * resultOut = 0);
+
+    /**
+     * @brief remove removes every key/value pair with the given key and publishes the result.
+     * @param position
+     * @param resultOut
+     * @return false if the tree held no pair with that key
+     */
+    bool remove(const QVectorND& position, QString * resultOut = 0);
+    bool remove(const QPointF& position, QString * resultOut = 0);
+
+    /**
+     * @brief build publishes a balanced version holding exactly the given key/value pairs.
+     * @param positions
+     * @param values must have the same length as positions
+     * @param resultOut
+     * @return
+     */
+    bool build(const QVector<QVectorND>& positions, const QVector<QVariant>& values, QString * resultOut = 0);
+
+    /**
+     * @brief clear publishes an empty version.
+     */
+    void clear();
+
+private:
+    std::shared_ptr<const QKDSnapshotVersion> current() const;
+    void publish(const std::shared_ptr<const QKDSnapshotVersion>& previous, const std::shared_ptr<QKDSnapshotVersion>& next);
+
+private:
+    int _dimension;
+    bool _allowDuplicates;
+    std::shared_ptr<const QKDTreeDistanceMetric> _distanceMetric;
+
+    //Only ever touched through std::atomic_load and std::atomic_store, which lock it while copying
+    std::shared_ptr<const QKDSnapshotVersion> _current;
+};
+
+#endif // QKDSNAPSHOTTREE_H
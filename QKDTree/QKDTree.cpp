@@ -1,362 +1,2562 @@
 #include "QKDTree.h"
 
+#include "QKDTreeInternal.h"
+#include "QKDTreeMetrics.h"
+
+#include <QBitArray>
+#include <QDataStream>
+#include <QFile>
+#include <QPair>
 #include <QQueue>
+#include <QRunnable>
+#include <QSemaphore>
 #include <QStack>
+#include <QThread>
+#include <QThreadPool>
+#include <QVarLengthArray>
 #include <QtDebug>
+#include <algorithm>
+#include <cmath>
+#include <functional>
 #include <limits>
 
 
-const QString ERR_STRING_BAD_DIM = "Dimension of position does not match that of tree.";
-const QString ERR_STRING_BAD_OUTPTR = "You didn't provide a pointer for output.";
+const QString ERR_STRING_BAD_DIM = "Dimension of position does not match that of tree.";
+const QString ERR_STRING_BAD_FOREST_DIM = "Dimension of position does not match that of forest.";
+const QString ERR_STRING_BAD_INDEX_DIM = "Dimension of position does not match that of index.";
+const QString ERR_STRING_BAD_OUTPTR = "You didn't provide a pointer for output.";
+const QString ERR_STRING_BAD_EPSILON = "epsilon must not be negative.";
+const QString ERR_STRING_BAD_NODE = "You didn't provide a node.";
+const QString ERR_STRING_BAD_VISITOR = "You didn't provide a visitor.";
+const QString ERR_STRING_BAD_TREE = "You didn't provide a tree.";
+
+using namespace QKDTreeInternal;
+
+namespace
+{
+//Orders point indices lexicographically by position, breaking ties by index
+class PositionLess
+{
+public:
+    PositionLess(const qreal * coords, int dimension) :
+        _coords(coords), _dimension(dimension)
+    {
+    }
+
+    bool operator()(quint32 a, quint32 b) const
+    {
+        const qreal * posA = _coords + qint64(a) * _dimension;
+        const qreal * posB = _coords + qint64(b) * _dimension;
+        for (int i = 0; i < _dimension; i++)
+        {
+            if (posA[i] != posB[i])
+                return posA[i] < posB[i];
+        }
+        return a < b;
+    }
+
+private:
+    const qreal * _coords;
+    int _dimension;
+};
+
+bool samePosition(const qreal * a, const qreal * b, int dimension)
+{
+    for (int i = 0; i < dimension; i++)
+    {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+
+//nearestJoin() compares groups of at most this many keys key by key rather than splitting them further
+const int JOIN_LEAF = 16;
+
+//nearestJoin() hands the groups of queries with at most this many keys to the threads one at a time
+const int JOIN_TASK = 1024;
+
+const char FILE_MAGIC[8] = {'Q', 'K', 'D', 'T', 'R', 'E', 'E', 0};
+const quint32 FILE_BYTE_ORDER_MARK = 0x01020304;
+const quint32 FILE_FORMAT_VERSION = 1;
+const quint64 FILE_ALIGNMENT = 64;
+
+/*
+ * The header at the start of a file written by QKDTree::save(). Everything is stored in the byte
+ * order of the machine that wrote it, which byteOrder records, so the arrays can be used in place.
+ */
+struct FileHeader
+{
+    char magic[8];
+    quint32 byteOrder;
+    quint32 formatVersion;
+    quint32 headerSize;
+    quint32 realSize;
+    quint32 nodeSize;
+    quint32 dataStreamVersion;
+    qint32 dimension;
+    quint32 root;
+    quint32 nodeCount;
+    quint32 freeCount;
+    qint64 size;
+    quint64 nodesOffset;
+    quint64 coordsOffset;
+    quint64 valueOffsetsOffset;
+    quint64 freeNodesOffset;
+    quint64 valuesOffset;
+    quint64 valuesLength;
+};
+
+//True if count items of itemSize bytes starting at offset lie within a file of fileSize bytes
+bool sectionFits(quint64 offset, quint64 count, quint64 itemSize, quint64 fileSize)
+{
+    return offset <= fileSize && (itemSize == 0 || count <= (fileSize - offset) / itemSize);
+}
+
+quint64 alignedOffset(quint64 offset)
+{
+    return (offset + FILE_ALIGNMENT - 1) / FILE_ALIGNMENT * FILE_ALIGNMENT;
+}
+
+//Writes bytes at offset, zero-filling the gap from the current position
+bool writeSection(QFile * file, quint64 offset, const char * data, qint64 length)
+{
+    const qint64 gap = qint64(offset) - file->pos();
+    if (gap > 0 && file->write(QByteArray(int(gap), 0)) != gap)
+        return false;
+    return length == 0 || file->write(data, length) == length;
+}
+
+/*
+ * Writes count nodes at offset. Each is copied field by field into zeroed memory first, so the file
+ * gets zeros rather than whatever the padding between the fields happened to hold.
+ */
+template <typename Node>
+bool writeNodes(QFile * file, quint64 offset, const Node * nodes, quint32 count)
+{
+    const quint32 chunkSize = 4096;
+    QByteArray chunk;
+    for (quint32 first = 0; first < count; first += chunkSize)
+    {
+        const quint32 chunkCount = qMin(chunkSize, count - first);
+        chunk.fill(0, int(chunkCount * sizeof(Node)));
+        Node * out = reinterpret_cast<Node *>(chunk.data());
+        for (quint32 i = 0; i < chunkCount; i++)
+        {
+            const Node& node = nodes[first + i];
+            out[i].left = node.left;
+            out[i].right = node.right;
+            out[i].dividingDimension = node.dividingDimension;
+            out[i].size = node.size;
+            out[i].deadCount = node.deadCount;
+            out[i].dead = node.dead;
+        }
+        if (!writeSection(file, offset + quint64(first) * sizeof(Node), chunk.constData(), chunk.size()))
+            return false;
+    }
+    return true;
+}
+}
+
+//A contiguous range of the index array that still has to become a subtree of parent
+struct QKDTree::BuildRange
+{
+    int begin;
+    int end;
+    int depth;
+    quint32 parent;
+    bool isLeft;
+};
+
+//A file opened by openMapped(), with pointers to each of its sections
+struct QKDTree::Mapping
+{
+    Mapping(const QString& path) : file(path), base(0)
+    {
+    }
+
+    ~Mapping()
+    {
+        if (base)
+            file.unmap(base);
+    }
+
+    QFile file;
+    uchar * base;
+    const Node * nodes;
+    const qreal * coords;
+    const quint64 * valueOffsets;
+    const quint32 * freeNodes;
+    const char * values;
+    quint32 nodeCount;
+    quint32 freeCount;
+    int dataStreamVersion;
+};
+
+//Claims chunks of a batch of nearest neighbor queries until none are left
+class QKDTree::BatchNearestTask : public QRunnable
+{
+public:
+    BatchNearestTask(const QKDTree * tree, const QVector<QVectorND> * queries, QKDTreeNode * results,
+                     QAtomicInt * nextChunk, int chunkSize, QSemaphore * finished) :
+        _tree(tree), _queries(queries), _results(results), _nextChunk(nextChunk), _chunkSize(chunkSize),
+        _finished(finished)
+    {
+    }
+
+    void run()
+    {
+        _tree->nearestBatch(*_queries, _results, _nextChunk, _chunkSize);
+        _finished->release();
+    }
+
+private:
+    const QKDTree * _tree;
+    const QVector<QVectorND> * _queries;
+    QKDTreeNode * _results;
+    QAtomicInt * _nextChunk;
+    int _chunkSize;
+    QSemaphore * _finished;
+};
+
+//Buffers one thread reuses across the nearest neighbor searches of a batch
+struct QKDTree::SearchScratch : public QKDTreeInternal::SearchScratch<quint32>
+{
+};
+
+//Lets the searches shared with QKDSnapshotTree (see QKDTreeInternal.h) walk the node pool
+class QKDTree::SearchNodes
+{
+public:
+    typedef quint32 Index;
+
+    SearchNodes(const QKDTree * tree) : _tree(tree)
+    {
+    }
+
+    Index root() const
+    {
+        return _tree->_root;
+    }
+
+    bool isNull(Index node) const
+    {
+        return node == NO_NODE;
+    }
+
+    const qreal * coordinates(Index node) const
+    {
+        return _tree->coordinates(node);
+    }
+
+    int dividingDimension(Index node) const
+    {
+        return _tree->nodeAt(node).dividingDimension;
+    }
+
+    bool isDead(Index node) const
+    {
+        return _tree->nodeAt(node).dead;
+    }
+
+    Index left(Index node) const
+    {
+        return _tree->nodeAt(node).left;
+    }
+
+    Index right(Index node) const
+    {
+        return _tree->nodeAt(node).right;
+    }
+
+private:
+    const QKDTree * _tree;
+};
+
+/*
+ * A copy of a tree's live keys for nearestJoin(), regrouped so that every key sits in a leaf: each
+ * group covers one range of the copied keys and knows their bounding box, and is either a leaf of at
+ * most JOIN_LEAF keys or is halved at its median, along each dimension in turn. Unlike the tree's own
+ * nodes, no group holds a key of its own. Groups come before their children, the root first.
+ */
+struct QKDTree::JoinNodes
+{
+    struct Group
+    {
+        int begin;
+        int end;
+        quint32 left;
+        quint32 right;
+    };
+
+    void build(const QKDTree * tree);
+
+    const qreal * keyAt(int key) const
+    {
+        return coords.constData() + qint64(key) * dimension;
+    }
+
+    const qreal * minsOf(quint32 group) const
+    {
+        return mins.constData() + qint64(group) * dimension;
+    }
+
+    const qreal * maxsOf(quint32 group) const
+    {
+        return maxs.constData() + qint64(group) * dimension;
+    }
+
+    int dimension;
+    QVector<quint32> keySlots;
+    QVector<qreal> coords;
+    QVector<Group> groups;
+    QVector<qreal> mins;
+    QVector<qreal> maxs;
+};
+
+void QKDTree::JoinNodes::build(const QKDTree *tree)
+{
+    dimension = tree->dimension();
+    tree->liveInOrder(&keySlots);
+    coords.resize(keySlots.size() * dimension);
+    for (int i = 0; i < keySlots.size(); i++)
+    {
+        const qreal * key = tree->coordinates(keySlots.at(i));
+        std::copy(key, key + dimension, coords.data() + qint64(i) * dimension);
+    }
+
+    //Each key's coordinate along the dimension being split, next to its position in keySlots
+    QVector<QPair<qreal, quint32> > order(keySlots.size());
+    for (int i = 0; i < order.size(); i++)
+        order[i].second = i;
+
+    struct Pending
+    {
+        int begin;
+        int end;
+        quint32 parent;
+        bool isLeft;
+        int divDim;
+    };
+
+    QVarLengthArray<Pending, 128> toSplit;
+    if (!order.isEmpty())
+    {
+        const Pending root = {0, order.size(), NO_NODE, false, 0};
+        toSplit.append(root);
+    }
+    while (!toSplit.isEmpty())
+    {
+        const Pending current = toSplit.last();
+        toSplit.removeLast();
+
+        const quint32 index = groups.size();
+        if (current.parent != NO_NODE)
+            (current.isLeft ? groups[current.parent].left : groups[current.parent].right) = index;
+        const Group group = {current.begin, current.end, NO_NODE, NO_NODE};
+        groups.append(group);
+        if (current.end - current.begin <= JOIN_LEAF)
+            continue;
+
+        QPair<qreal, quint32> * const begin = order.data() + current.begin;
+        QPair<qreal, quint32> * const end = order.data() + current.end;
+        for (QPair<qreal, quint32> * it = begin; it != end; ++it)
+            it->first = coords.at(qint64(it->second) * dimension + current.divDim);
+
+        const int mid = current.begin + (current.end - current.begin) / 2;
+        std::nth_element(begin, order.data() + mid, end);
+
+        const int divDim = (current.divDim + 1) % dimension;
+        const Pending right = {mid, current.end, index, false, divDim};
+        const Pending left = {current.begin, mid, index, true, divDim};
+        toSplit.append(right);
+        toSplit.append(left);
+    }
+
+    //Store the keys in leaf order, so each group's keys are next to each other
+    const QVector<quint32> liveSlots = keySlots;
+    const QVector<qreal> liveCoords = coords;
+    for (int i = 0; i < order.size(); i++)
+    {
+        keySlots[i] = liveSlots.at(order.at(i).second);
+        const qreal * key = liveCoords.constData() + qint64(order.at(i).second) * dimension;
+        std::copy(key, key + dimension, coords.data() + qint64(i) * dimension);
+    }
+
+    //Children come after their parents, so walking backwards finishes each child's box first
+    mins.resize(groups.size() * dimension);
+    maxs.resize(groups.size() * dimension);
+    for (int g = groups.size() - 1; g >= 0; g--)
+    {
+        const Group& group = groups.at(g);
+        qreal * groupMins = mins.data() + qint64(g) * dimension;
+        qreal * groupMaxs = maxs.data() + qint64(g) * dimension;
+        if (group.left == NO_NODE)
+        {
+            std::copy(this->keyAt(group.begin), this->keyAt(group.begin) + dimension, groupMins);
+            std::copy(this->keyAt(group.begin), this->keyAt(group.begin) + dimension, groupMaxs);
+            for (int key = group.begin + 1; key < group.end; key++)
+            {
+                for (int i = 0; i < dimension; i++)
+                {
+                    groupMins[i] = qMin(groupMins[i], this->keyAt(key)[i]);
+                    groupMaxs[i] = qMax(groupMaxs[i], this->keyAt(key)[i]);
+                }
+            }
+            continue;
+        }
+
+        for (int i = 0; i < dimension; i++)
+        {
+            groupMins[i] = qMin(this->minsOf(group.left)[i], this->minsOf(group.right)[i]);
+            groupMaxs[i] = qMax(this->maxsOf(group.left)[i], this->maxsOf(group.right)[i]);
+        }
+    }
+}
+
+/*
+ * Walks a group of the queries and the whole reference tree together for nearestJoin(). A pair of
+ * groups is dropped as soon as the distance between their boxes reaches the query group's bound: the
+ * largest over its keys of the distance to the nearest reference key found so far. The bound only
+ * ever comes down and never drops below any of those distances, so no key that could be nearer is
+ * skipped.
+ */
+class QKDTree::NearestJoin
+{
+public:
+    NearestJoin(const JoinNodes * queries, const JoinNodes * references, quint32 start, qreal * best,
+                int * nearest, qreal * groupBounds) :
+        _queries(queries), _references(references), _start(start), _best(best), _nearest(nearest),
+        _groupBounds(groupBounds)
+    {
+    }
+
+    template <typename Metric>
+    void operator()(const Metric& metric) const
+    {
+        QVarLengthArray<Pair, 256> toVisit;
+        toVisit.append(this->pair(metric, _start, 0));
+        while (!toVisit.isEmpty())
+        {
+            const Pair current = toVisit.last();
+            toVisit.removeLast();
+
+            if (current.reference == NO_NODE)
+            {
+                this->tightenGroup(current.query);
+                continue;
+            }
+            else if (current.lowerBound >= _groupBounds[current.query])
+                continue;
+
+            const JoinNodes::Group& query = _queries->groups.at(current.query);
+            const JoinNodes::Group& reference = _references->groups.at(current.reference);
+            const bool splitQuery = query.left != NO_NODE;
+            const bool splitReference = reference.left != NO_NODE;
+            if (splitQuery && (!splitReference || query.end - query.begin >= reference.end - reference.begin))
+            {
+                //Revisited after both children, when their bounds have come down
+                const Pair tighten = {current.query, quint32(NO_NODE), 0.0};
+                toVisit.append(tighten);
+
+                const quint32 children[2] = {query.left, query.right};
+                for (int c = 0; c < 2; c++)
+                {
+                    _groupBounds[children[c]] = qMin(_groupBounds[children[c]], _groupBounds[current.query]);
+                    const Pair next = this->pair(metric, children[c], current.reference);
+                    if (next.lowerBound < _groupBounds[children[c]])
+                        toVisit.append(next);
+                }
+            }
+            else if (splitReference)
+            {
+                //Nearer child last, so that it is searched first
+                Pair nearer = this->pair(metric, current.query, reference.left);
+                Pair farther = this->pair(metric, current.query, reference.right);
+                if (farther.lowerBound < nearer.lowerBound)
+                    std::swap(nearer, farther);
+
+                const qreal bound = _groupBounds[current.query];
+                if (farther.lowerBound < bound)
+                    toVisit.append(farther);
+                if (nearer.lowerBound < bound)
+                    toVisit.append(nearer);
+            }
+            else
+                this->compareKeys(metric, query, reference, current.query, current.reference);
+        }
+    }
+
+private:
+    struct Pair
+    {
+        quint32 query;
+        quint32 reference;
+        qreal lowerBound;
+    };
+
+    template <typename Metric>
+    Pair pair(const Metric& metric, quint32 query, quint32 reference) const
+    {
+        const Pair toRet = {query, reference, metric.boxDistance(_references->minsOf(reference),
+                                                                 _references->maxsOf(reference),
+                                                                 _queries->minsOf(query), _queries->maxsOf(query))};
+        return toRet;
+    }
+
+    void tightenGroup(quint32 query) const
+    {
+        const JoinNodes::Group& group = _queries->groups.at(query);
+        _groupBounds[query] = qMin(_groupBounds[query], qMax(_groupBounds[group.left], _groupBounds[group.right]));
+    }
+
+    //Compares every key of a query leaf with every key of a reference leaf
+    template <typename Metric>
+    void compareKeys(const Metric& metric, const JoinNodes::Group& query, const JoinNodes::Group& reference,
+                     quint32 queryGroup, quint32 referenceGroup) const
+    {
+        qreal bound = 0.0;
+        for (int q = query.begin; q < query.end; q++)
+        {
+            const qreal * searchPos = _queries->keyAt(q);
+            if (metric.boxDistance(_references->minsOf(referenceGroup), _references->maxsOf(referenceGroup),
+                                   searchPos, searchPos) < _best[q])
+            {
+                for (int r = reference.begin; r < reference.end; r++)
+                {
+                    const qreal distance = metric.keyDistance(_references->keyAt(r), searchPos);
+                    if (distance < _best[q])
+                    {
+                        _best[q] = distance;
+                        _nearest[q] = r;
+                    }
+                }
+            }
+            bound = qMax(bound, _best[q]);
+        }
+        _groupBounds[queryGroup] = qMin(_groupBounds[queryGroup], bound);
+    }
+
+    const JoinNodes * _queries;
+    const JoinNodes * _references;
+    quint32 _start;
+    qreal * _best;
+    int * _nearest;
+    qreal * _groupBounds;
+};
+
+//Runs the shared k nearest neighbor search with whichever metric adapter dispatchMetric picks
+class QKDTree::NearestCandidates
+{
+public:
+    NearestCandidates(const QKDTree * tree, const QVectorND& searchPos, int k, qreal bound, qreal epsilon,
+                      QVector<QPair<qreal, quint32> > * output, SearchScratch * scratch) :
+        _tree(tree), _searchPos(searchPos), _k(k), _bound(bound), _epsilon(epsilon), _output(output),
+        _scratch(scratch)
+    {
+    }
+
+    template <typename Metric>
+    void operator()(const Metric& metric) const
+    {
+        QKDTreeInternal::nearestCandidates(SearchNodes(_tree), metric, _searchPos, _k, _bound, _epsilon, _output,
+                                           _scratch);
+    }
+
+private:
+    const QKDTree * _tree;
+    const QVectorND& _searchPos;
+    int _k;
+    qreal _bound;
+    qreal _epsilon;
+    QVector<QPair<qreal, quint32> > * _output;
+    SearchScratch * _scratch;
+};
+
+//Runs nearestWithin() with whichever metric adapter dispatchMetric picks
+class QKDTree::NearestWithin
+{
+public:
+    NearestWithin(const QKDTree * tree, const QVectorND& searchPos, qreal bound, qreal epsilon, qreal * distanceOut,
+                  quint32 * nearestOut) :
+        _tree(tree), _searchPos(searchPos), _bound(bound), _epsilon(epsilon), _distanceOut(distanceOut),
+        _nearestOut(nearestOut)
+    {
+    }
+
+    template <typename Metric>
+    void operator()(const Metric& metric) const
+    {
+        *_nearestOut = _tree->nearestWithin(metric, _searchPos, _bound, _distanceOut, _epsilon);
+    }
+
+private:
+    const QKDTree * _tree;
+    const QVectorND& _searchPos;
+    qreal _bound;
+    qreal _epsilon;
+    qreal * _distanceOut;
+    quint32 * _nearestOut;
+};
+
+//Runs the shared radius search with whichever metric adapter dispatchMetric picks
+class QKDTree::WithinDistance
+{
+public:
+    WithinDistance(const QKDTree * tree, const QVectorND& center, qreal radius, QKDTreeVisitor * visitor) :
+        _tree(tree), _center(center), _radius(radius), _visitor(visitor)
+    {
+    }
+
+    template <typename Metric>
+    void operator()(const Metric& metric) const
+    {
+        const QKDTree * tree = _tree;
+        QKDTreeVisitor * visitor = _visitor;
+        QVectorND key(tree->_dimension);
+        QKDTreeInternal::withinDistance(SearchNodes(tree), metric, _center, _radius, [&](quint32 index) {
+            tree->loadPosition(index, &key);
+            visitor->visit(key, tree->valueAt(index));
+        });
+    }
+
+private:
+    const QKDTree * _tree;
+    const QVectorND& _center;
+    qreal _radius;
+    QKDTreeVisitor * _visitor;
+};
+
+//Runs bestBinCandidates() with whichever metric adapter dispatchMetric picks
+class QKDTree::BestBinCandidates
+{
+public:
+    BestBinCandidates(const QKDTree * tree, const QVectorND& searchPos, int k, int maxChecks,
+                      QVector<QPair<qreal, quint32> > * output) :
+        _tree(tree), _searchPos(searchPos), _k(k), _maxChecks(maxChecks), _output(output)
+    {
+    }
+
+    template <typename Metric>
+    void operator()(const Metric& metric) const
+    {
+        _tree->bestBinCandidates(metric, _searchPos, _k, _maxChecks, _output);
+    }
+
+private:
+    const QKDTree * _tree;
+    const QVectorND& _searchPos;
+    int _k;
+    int _maxChecks;
+    QVector<QPair<qreal, quint32> > * _output;
+};
+
+//Runs nearestStep() with whichever metric adapter dispatchMetric picks
+class QKDTree::NearestStep
+{
+public:
+    NearestStep(const QKDTree * tree, const QVectorND& searchPos, QVector<QPair<qreal, quint64> > * queue,
+                quint32 * indexOut, qreal * distanceOut, bool * foundOut) :
+        _tree(tree), _searchPos(searchPos), _queue(queue), _indexOut(indexOut), _distanceOut(distanceOut),
+        _foundOut(foundOut)
+    {
+    }
+
+    template <typename Metric>
+    void operator()(const Metric& metric) const
+    {
+        *_foundOut = _tree->nearestStep(metric, _searchPos, _queue, _indexOut, _distanceOut);
+    }
+
+private:
+    const QKDTree * _tree;
+    const QVectorND& _searchPos;
+    QVector<QPair<qreal, quint64> > * _queue;
+    quint32 * _indexOut;
+    qreal * _distanceOut;
+    bool * _foundOut;
+};
+
+QKDTree::QKDTree(int dimension, bool allowDuplicates, QKDTreeDistanceMetric *distanceMetric) :
+    _dimension(dimension), _size(0), _root(NO_NODE), _mapping(0), _allowDuplicates(allowDuplicates),
+    _balanceFactor(0.0)
+{
+    _distanceMetric = 0;
+    _ownsDistanceMetric = false;
+    this->setDistanceMetric(metricOrDefault(distanceMetric, _dimension, "QKDTree"));
+}
+
+QKDTree::~QKDTree()
+{
+    delete _mapping;
+    if (_ownsDistanceMetric)
+        delete _distanceMetric;
+}
+
+int QKDTree::dimension() const
+{
+    return _dimension;
+}
+
+qint64 QKDTree::size() const
+{
+    return _size;
+}
+
+int QKDTree::depth() const
+{
+    if (_size <= 0)
+        return 0;
+
+    QStack<QPair<quint32, int> > toVisit;
+    toVisit.push(qMakePair(_root, 1));
+
+    int toRet = 0;
+    while (!toVisit.isEmpty())
+    {
+        const QPair<quint32, int> current = toVisit.pop();
+        const Node& node = this->nodeAt(current.first);
+        toRet = qMax(toRet, current.second);
+        if (node.left != NO_NODE)
+            toVisit.push(qMakePair(node.left, current.second + 1));
+        if (node.right != NO_NODE)
+            toVisit.push(qMakePair(node.right, current.second + 1));
+    }
+    return toRet;
+}
+
+void QKDTree::setBalanceFactor(qreal alpha)
+{
+    _balanceFactor = (alpha > 1.0) ? alpha : 0.0;
+}
+
+qreal QKDTree::balanceFactor() const
+{
+    return _balanceFactor;
+}
+
+bool QKDTree::add(QKDTreeNode *node, QString *resultOut)
+{
+    if (node == 0)
+    {
+        if (resultOut)
+            *resultOut = "Cannot add null node";
+        return false;
+    }
+
+    if (!this->add(node->position(), node->value(), resultOut))
+        return false;
+
+    delete node;
+    return true;
+}
+
+bool QKDTree::add(const QVectorND &position, const QVariant &value, QString *resultOut)
+{
+    if (position.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+
+    if (!this->detachMapping(resultOut))
+        return false;
+    if (_nodes.size() >= int(NO_NODE >> 1))
+    {
+        if (resultOut)
+            *resultOut = "Tree is full";
+        return false;
+    }
+
+    const qreal * pos = position.constData();
+    Node node = {NO_NODE, NO_NODE, 0, 1, 0, false};
+
+    //Remember the way down so the subtree sizes can be updated once we know the add succeeds
+    QVarLengthArray<quint32, 64> path;
+    if (_root != NO_NODE)
+    {
+        quint32 current = _root;
+        while (current != NO_NODE)
+        {
+            const Node& parent = _nodes.at(current);
+            const qreal * parentPos = this->coordinates(current);
+            if (!_allowDuplicates && !parent.dead && samePosition(pos, parentPos, _dimension))
+            {
+                if (resultOut)
+                    *resultOut = "Cannot add duplicate";
+                return false;
+            }
+
+            path.append(current);
+            const int divDim = parent.dividingDimension;
+            current = (pos[divDim] <= parentPos[divDim]) ? parent.left : parent.right;
+        }
+        node.dividingDimension = (_nodes.at(path.last()).dividingDimension + 1) % this->dimension();
+    }
+
+    //Reuse the slot of a removed node if there is one
+    quint32 index;
+    if (!_freeNodes.isEmpty())
+    {
+        index = _freeNodes.last();
+        _freeNodes.removeLast();
+        _nodes[index] = node;
+        std::copy(pos, pos + _dimension, _coords.data() + qint64(index) * _dimension);
+        _values[index] = value;
+    }
+    else
+    {
+        index = _nodes.size();
+        _nodes.append(node);
+        for (int i = 0; i < _dimension; i++)
+            _coords.append(pos[i]);
+        _values.append(value);
+    }
+
+    if (path.isEmpty())
+        _root = index;
+    else
+    {
+        Node& parent = _nodes[path.last()];
+        const int divDim = parent.dividingDimension;
+        if (pos[divDim] <= this->coordinates(path.last())[divDim])
+            parent.left = index;
+        else
+            parent.right = index;
+    }
+
+    for (int i = 0; i < path.size(); i++)
+        _nodes[path[i]].size++;
+    _size++;
+
+    //Too deep? Find the scapegoat: the deepest ancestor whose subtree is too tall for its size
+    const int depth = path.size();
+    if (_balanceFactor > 0.0 && depth > _balanceFactor * std::log2(qreal(_nodes.at(_root).size)))
+    {
+        for (int i = path.size() - 1; i >= 0; i--)
+        {
+            if (depth - i > _balanceFactor * std::log2(qreal(_nodes.at(path[i]).size)))
+            {
+                this->rebuildOnPath(path.constData(), i);
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool QKDTree::add(const QPointF &position, const QVariant &value, QString *resultOut)
+{
+    return this->add(QVectorND(position), value, resultOut);
+}
+
+bool QKDTree::build(const QVector<QVectorND> &positions, const QVector<QVariant> &values, QString *resultOut,
+                    int threadCount)
+{
+    if (positions.size() != values.size())
+    {
+        if (resultOut)
+            *resultOut = "Number of positions does not match number of values";
+        return false;
+    }
+    else if (positions.size() >= int(NO_NODE >> 1)
+             || qint64(positions.size()) * this->dimension() > std::numeric_limits<int>::max())
+    {
+        if (resultOut)
+            *resultOut = "Too many positions";
+        return false;
+    }
+
+    for (int i = 0; i < positions.size(); i++)
+    {
+        if (positions[i].dimension() != this->dimension())
+        {
+            if (resultOut)
+                *resultOut = ERR_STRING_BAD_DIM;
+            return false;
+        }
+    }
+
+    this->clear();
+
+    //Copy everything into our own storage first; selection then works directly on it
+    const int dimension = this->dimension();
+    _coords.resize(positions.size() * dimension);
+    qreal * coords = _coords.data();
+    for (int i = 0; i < positions.size(); i++)
+        std::copy(positions[i].constData(), positions[i].constData() + dimension, coords + qint64(i) * dimension);
+    _values = values;
+
+    this->buildFromStorage(threadCount);
+    return true;
+}
+
+bool QKDTree::remove(const QVectorND &position, QString *resultOut)
+{
+    return this->removeMatching(position, 0, resultOut);
+}
+
+bool QKDTree::remove(const QPointF &position, QString *resultOut)
+{
+    return this->removeMatching(QVectorND(position), 0, resultOut);
+}
+
+bool QKDTree::remove(QKDTreeNode *node, QString *resultOut)
+{
+    if (node == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_NODE;
+        return false;
+    }
+
+    return this->removeMatching(node->position(), &node->value(), resultOut);
+}
+
+void QKDTree::clear()
+{
+    //No per-node cleanup needed, everything lives in a handful of arrays (or one mapped file)
+    delete _mapping;
+    _mapping = 0;
+
+    _nodes.clear();
+    _coords.clear();
+    _values.clear();
+    _freeNodes.clear();
+
+    _root = NO_NODE;
+    _size = 0;
+}
+
+bool QKDTree::save(const QString &path, QString *resultOut) const
+{
+    const quint32 nodeCount = this->slotCount();
+    const quint32 freeCount = _mapping ? _mapping->freeCount : quint32(_freeNodes.size());
+    const Node * nodes = _mapping ? _mapping->nodes : _nodes.constData();
+    const qreal * coords = _mapping ? _mapping->coords : _coords.constData();
+    const quint32 * freeNodes = _mapping ? _mapping->freeNodes : _freeNodes.constData();
+
+    //Values are the only part that needs serializing
+    QByteArray values;
+    QVector<quint64> valueOffsets(nodeCount + 1);
+    QDataStream stream(&values, QIODevice::WriteOnly);
+    for (quint32 i = 0; i < nodeCount; i++)
+    {
+        valueOffsets[i] = quint64(values.size());
+        stream << this->valueAt(i);
+    }
+    valueOffsets[nodeCount] = quint64(values.size());
+
+    FileHeader header;
+    std::fill(reinterpret_cast<char *>(&header), reinterpret_cast<char *>(&header) + sizeof(header), 0);
+    std::copy(FILE_MAGIC, FILE_MAGIC + sizeof(FILE_MAGIC), header.magic);
+    header.byteOrder = FILE_BYTE_ORDER_MARK;
+    header.formatVersion = FILE_FORMAT_VERSION;
+    header.headerSize = sizeof(FileHeader);
+    header.realSize = sizeof(qreal);
+    header.nodeSize = sizeof(Node);
+    header.dataStreamVersion = stream.version();
+    header.dimension = _dimension;
+    header.root = _root;
+    header.nodeCount = nodeCount;
+    header.freeCount = freeCount;
+    header.size = _size;
+    header.nodesOffset = alignedOffset(sizeof(FileHeader));
+    header.coordsOffset = alignedOffset(header.nodesOffset + quint64(nodeCount) * sizeof(Node));
+    header.valueOffsetsOffset = alignedOffset(header.coordsOffset + quint64(nodeCount) * _dimension * sizeof(qreal));
+    header.freeNodesOffset = alignedOffset(header.valueOffsetsOffset + quint64(nodeCount + 1) * sizeof(quint64));
+    header.valuesOffset = alignedOffset(header.freeNodesOffset + quint64(freeCount) * sizeof(quint32));
+    header.valuesLength = quint64(values.size());
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        if (resultOut)
+            *resultOut = "Could not open " + path + " for writing: " + file.errorString();
+        return false;
+    }
+
+    const bool written = writeSection(&file, 0, reinterpret_cast<const char *>(&header), sizeof(header))
+            && writeNodes(&file, header.nodesOffset, nodes, nodeCount)
+            && writeSection(&file, header.coordsOffset, reinterpret_cast<const char *>(coords),
+                            qint64(nodeCount) * _dimension * sizeof(qreal))
+            && writeSection(&file, header.valueOffsetsOffset, reinterpret_cast<const char *>(valueOffsets.constData()),
+                            qint64(nodeCount + 1) * sizeof(quint64))
+            && writeSection(&file, header.freeNodesOffset, reinterpret_cast<const char *>(freeNodes),
+                            qint64(freeCount) * sizeof(quint32))
+            && writeSection(&file, header.valuesOffset, values.constData(), values.size());
+    if (!written || !file.flush())
+    {
+        if (resultOut)
+            *resultOut = "Could not write " + path + ": " + file.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool QKDTree::openMapped(const QString &path, QString *resultOut)
+{
+    Mapping * mapping = new Mapping(path);
+    const qint64 fileSize = mapping->file.size();
+    if (!mapping->file.open(QIODevice::ReadOnly) || fileSize < qint64(sizeof(FileHeader))
+            || (mapping->base = mapping->file.map(0, fileSize)) == 0)
+    {
+        if (resultOut)
+            *resultOut = "Could not map " + path + ": " + mapping->file.errorString();
+        delete mapping;
+        return false;
+    }
+
+    //Check everything the queries will trust before letting them near the file
+    const FileHeader& header = *reinterpret_cast<const FileHeader *>(mapping->base);
+    const quint64 nodeCount = header.nodeCount;
+    QString error;
+    if (!std::equal(FILE_MAGIC, FILE_MAGIC + sizeof(FILE_MAGIC), header.magic))
+        error = "Not a QKDTree file";
+    else if (header.byteOrder != FILE_BYTE_ORDER_MARK)
+        error = "File was written on a machine with a different byte order";
+    else if (header.formatVersion != FILE_FORMAT_VERSION)
+        error = "Unsupported file format version";
+    else if (header.headerSize != sizeof(FileHeader) || header.realSize != sizeof(qreal)
+             || header.nodeSize != sizeof(Node))
+        error = "File was written with different number sizes";
+    else if (header.dimension != _dimension)
+        error = ERR_STRING_BAD_DIM;
+    else if (header.nodesOffset % FILE_ALIGNMENT || header.coordsOffset % FILE_ALIGNMENT
+             || header.valueOffsetsOffset % FILE_ALIGNMENT || header.freeNodesOffset % FILE_ALIGNMENT
+             || nodeCount > quint64(NO_NODE >> 1)
+             || !sectionFits(header.nodesOffset, nodeCount, sizeof(Node), fileSize)
+             || !sectionFits(header.coordsOffset, nodeCount, quint64(_dimension) * sizeof(qreal), fileSize)
+             || !sectionFits(header.valueOffsetsOffset, nodeCount + 1, sizeof(quint64), fileSize)
+             || !sectionFits(header.freeNodesOffset, header.freeCount, sizeof(quint32), fileSize)
+             || !sectionFits(header.valuesOffset, header.valuesLength, 1, fileSize)
+             || (header.root != NO_NODE && header.root >= nodeCount))
+        error = "File is truncated or damaged";
+
+    if (error.isEmpty())
+    {
+        mapping->nodes = reinterpret_cast<const Node *>(mapping->base + header.nodesOffset);
+        mapping->coords = reinterpret_cast<const qreal *>(mapping->base + header.coordsOffset);
+        mapping->valueOffsets = reinterpret_cast<const quint64 *>(mapping->base + header.valueOffsetsOffset);
+        mapping->freeNodes = reinterpret_cast<const quint32 *>(mapping->base + header.freeNodesOffset);
+        mapping->values = reinterpret_cast<const char *>(mapping->base + header.valuesOffset);
+        mapping->nodeCount = header.nodeCount;
+        mapping->freeCount = header.freeCount;
+        mapping->dataStreamVersion = header.dataStreamVersion;
+        if (!QKDTree::mappingIsConsistent(*mapping, header.root, header.size, header.valuesLength, _dimension))
+            error = "File is truncated or damaged";
+    }
+
+    if (!error.isEmpty())
+    {
+        if (resultOut)
+            *resultOut = error;
+        delete mapping;
+        return false;
+    }
+
+    this->clear();
+    _mapping = mapping;
+    _root = header.root;
+    _size = header.size;
+    return true;
+}
+
+bool QKDTree::isMapped() const
+{
+    return _mapping != 0;
+}
+
+bool QKDTree::nearestNode(const QVectorND &searchPos, QKDTreeNode *output, QString *resultOut, qreal epsilon) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (searchPos.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (!(epsilon >= 0.0))
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_EPSILON;
+        return false;
+    }
+    else if (_size <= 0)
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    const quint32 bestSoFar = this->nearestWithin(searchPos, std::numeric_limits<qreal>::max(), 0, epsilon);
+    *output = QKDTreeNode(QVectorND(this->coordinates(bestSoFar), _dimension), this->valueAt(bestSoFar));
+
+    return true;
+}
+
+bool QKDTree::nearestNode(const QPointF &position, QKDTreeNode *output, QString *resultOut, qreal epsilon) const
+{
+    return this->nearestNode(QVectorND(position), output, resultOut, epsilon);
+}
+
+bool QKDTree::nearestNode(QKDTreeNode *node, QKDTreeNode *output, QString *resultOut) const
+{
+    return this->nearestNode(node->position(), output, resultOut);
+}
+
+bool QKDTree::nearestKey(const QVectorND &position, QVectorND *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+
+    QKDTreeNode nearestNode;
+    if (!this->nearestNode(position, &nearestNode, resultOut))
+        return false;
+
+    *output = nearestNode.position();
+
+    return true;
+}
+
+bool QKDTree::nearestIndex(const QVectorND &position, quint32 *indexOut, qreal *distanceOut, QString *resultOut) const
+{
+    if (indexOut == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (position.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (_size <= 0)
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    qreal distance;
+    *indexOut = this->nearestWithin(position, std::numeric_limits<qreal>::max(), &distance, 0.0);
+    if (distanceOut)
+        *distanceOut = distance;
+    return true;
+}
+
+const qreal *QKDTree::keyAt(quint32 index) const
+{
+    return this->coordinates(index);
+}
+
+QVariant QKDTree::valueAt(quint32 index) const
+{
+    if (_mapping == 0)
+        return _values.at(index);
+
+    //Mapped values are decoded on demand, straight from the file
+    const quint64 begin = _mapping->valueOffsets[index];
+    const quint64 end = _mapping->valueOffsets[index + 1];
+    const QByteArray bytes = QByteArray::fromRawData(_mapping->values + begin, int(end - begin));
+    QDataStream stream(bytes);
+    stream.setVersion(_mapping->dataStreamVersion);
+
+    QVariant toRet;
+    stream >> toRet;
+    return toRet;
+}
+
+bool QKDTree::nearestNodes(const QVectorND &searchPos, int k, QList<QKDTreeNode> *output, QString *resultOut,
+                           qreal epsilon) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (k <= 0)
+    {
+        if (resultOut)
+            *resultOut = "k must be positive";
+        return false;
+    }
+    else if (searchPos.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (!(epsilon >= 0.0))
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_EPSILON;
+        return false;
+    }
+    else if (_size <= 0)
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    QVector<QPair<qreal, quint32> > best;
+    this->nearestCandidates(searchPos, k, std::numeric_limits<qreal>::max(), &best, epsilon);
+
+    output->clear();
+    for (int i = 0; i < best.size(); i++)
+    {
+        const quint32 index = best[i].second;
+        output->append(QKDTreeNode(QVectorND(this->coordinates(index), _dimension), this->valueAt(index)));
+    }
+
+    return true;
+}
+
+bool QKDTree::nearestNodes(const QPointF &position, int k, QList<QKDTreeNode> *output, QString *resultOut,
+                           qreal epsilon) const
+{
+    return this->nearestNodes(QVectorND(position), k, output, resultOut, epsilon);
+}
+
+bool QKDTree::bestBinNearestNodes(const QVectorND &position, int k, int maxChecks, QList<QKDTreeNode> *output,
+                                  QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (k <= 0)
+    {
+        if (resultOut)
+            *resultOut = "k must be positive";
+        return false;
+    }
+    else if (position.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (_size <= 0)
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    QVector<QPair<qreal, quint32> > best;
+    this->bestBinCandidates(position, k, maxChecks, &best);
+
+    output->clear();
+    for (int i = 0; i < best.size(); i++)
+    {
+        const quint32 index = best[i].second;
+        output->append(QKDTreeNode(QVectorND(this->coordinates(index), _dimension), this->valueAt(index)));
+    }
+
+    return true;
+}
+
+bool QKDTree::bestBinNearestNode(const QVectorND &position, int maxChecks, QKDTreeNode *output,
+                                 QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+
+    QList<QKDTreeNode> nearest;
+    if (!this->bestBinNearestNodes(position, 1, maxChecks, &nearest, resultOut))
+        return false;
+
+    *output = nearest.first();
+    return true;
+}
+
+bool QKDTree::nearestNodes(const QVector<QVectorND> &queries, QVector<QKDTreeNode> *output, QString *resultOut,
+                           QThreadPool *pool) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+
+    for (int i = 0; i < queries.size(); i++)
+    {
+        if (queries.at(i).dimension() != this->dimension())
+        {
+            if (resultOut)
+                *resultOut = ERR_STRING_BAD_DIM;
+            return false;
+        }
+    }
+
+    if (_size <= 0 && !queries.isEmpty())
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    //Size the output up front so each thread can write its results straight into place
+    output->resize(queries.size());
+    if (queries.isEmpty())
+        return true;
+    QKDTreeNode * results = output->data();
+
+    if (pool == 0)
+        pool = QThreadPool::globalInstance();
+
+    //Small chunks balance the load, but not so small that threads fight over the counter
+    const int threadCount = qMax(1, pool->maxThreadCount());
+    const int chunkSize = qBound(1, queries.size() / (threadCount * 16), 256);
+
+    QAtomicInt nextChunk(0);
+    QSemaphore finished;
+
+    //Only take threads that are free right now, so this can't deadlock when called from a pool thread
+    int started = 0;
+    const int wanted = qMin(threadCount, (queries.size() + chunkSize - 1) / chunkSize) - 1;
+    for (int i = 0; i < wanted; i++)
+    {
+        BatchNearestTask * task = new BatchNearestTask(this, &queries, results, &nextChunk, chunkSize, &finished);
+        if (!pool->tryStart(task))
+        {
+            delete task;
+            break;
+        }
+        started++;
+    }
+
+    this->nearestBatch(queries, results, &nextChunk, chunkSize);
+    finished.acquire(started);
+
+    return true;
+}
+
+bool QKDTree::knnGraph(int k, QVector<qint64> *offsetsOut, QVector<quint32> *neighborsOut,
+                       QVector<qreal> *distancesOut, QString *resultOut, QThreadPool *pool) const
+{
+    if (offsetsOut == 0 || neighborsOut == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (k <= 0)
+    {
+        if (resultOut)
+            *resultOut = "k must be positive";
+        return false;
+    }
+
+    //Every key gets the same number of neighbors, so the rows can be laid out before searching
+    const quint32 count = this->slotCount();
+    const int rowLength = int(qMin(qint64(k), qMax(qint64(0), _size - 1)));
+    if (_size * rowLength > std::numeric_limits<int>::max())
+    {
+        if (resultOut)
+            *resultOut = "Graph has too many edges to fit in a QVector";
+        return false;
+    }
+
+    offsetsOut->resize(count + 1);
+    qint64 total = 0;
+    for (quint32 i = 0; i < count; i++)
+    {
+        (*offsetsOut)[i] = total;
+        if (this->nextLive(i) == i)
+            total += rowLength;
+    }
+    (*offsetsOut)[count] = total;
+    neighborsOut->resize(int(total));
+    if (distancesOut)
+        distancesOut->resize(int(total));
+    if (rowLength == 0)
+        return true;
+
+    QVector<quint32> order;
+    this->liveInOrder(&order);
+
+    if (pool == 0)
+        pool = QThreadPool::globalInstance();
+
+    //Small chunks balance the load, but not so small that threads fight over the counter
+    const int threadCount = qMax(1, pool->maxThreadCount());
+    const int chunkSize = qBound(1, order.size() / (threadCount * 16), 256);
+    const int chunks = (order.size() + chunkSize - 1) / chunkSize;
+
+    const qint64 * offsets = offsetsOut->constData();
+    quint32 * neighbors = neighborsOut->data();
+    qreal * distances = distancesOut ? distancesOut->data() : 0;
+
+    //Each worker keeps its buffers, and its last results to bound the next search, for all the chunks it claims
+    QAtomicInt nextChunk(0);
+    parallelForIdle(pool, qMin(threadCount, chunks), [&](int) {
+        QVectorND searchPos(_dimension);
+        QVector<QPair<qreal, quint32> > candidates;
+        candidates.reserve(rowLength + 1);
+        SearchScratch scratch;
+
+        for (int chunk = nextChunk.fetchAndAddRelaxed(1); chunk < chunks; chunk = nextChunk.fetchAndAddRelaxed(1))
+        {
+            const int end = qMin(order.size(), (chunk + 1) * chunkSize);
+            for (int q = chunk * chunkSize; q < end; q++)
+            {
+                const quint32 self = order.at(q);
+                this->loadPosition(self, &searchPos);
+                this->nearestCandidates(searchPos, rowLength + 1, std::numeric_limits<qreal>::max(), &candidates, 0.0,
+                                        &scratch);
+
+                //Leave out the key itself, or if enough copies of it crowded it out, the last candidate
+                int skip = candidates.size() - 1;
+                for (int j = 0; j < candidates.size(); j++)
+                {
+                    if (candidates.at(j).second == self)
+                    {
+                        skip = j;
+                        break;
+                    }
+                }
+
+                qint64 out = offsets[self];
+                for (int j = 0; j < candidates.size(); j++)
+                {
+                    if (j == skip)
+                        continue;
+                    neighbors[out] = candidates.at(j).second;
+                    if (distances)
+                        distances[out] = candidates.at(j).first;
+                    out++;
+                }
+            }
+        }
+    });
+
+    return true;
+}
+
+bool QKDTree::nearestJoin(const QKDTree &queries, QVector<quint32> *nearestOut, QVector<qreal> *distancesOut,
+                          QString *resultOut, QThreadPool *pool) const
+{
+    if (nearestOut == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (queries.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (_size <= 0 && queries.size() > 0)
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    const quint32 count = queries.slotCount();
+    nearestOut->fill(quint32(NO_NODE), count);
+    if (distancesOut)
+        distancesOut->fill(-1.0, count);
+
+    if (queries.size() <= 0)
+        return true;
+
+    if (pool == 0)
+        pool = QThreadPool::globalInstance();
+
+    //A tree joined with itself only needs the one copy
+    const bool selfJoin = &queries == this;
+    JoinNodes references;
+    JoinNodes ownNodes;
+    parallelForIdle(pool, selfJoin ? 1 : 2, [&](int tree) {
+        if (tree == 0)
+            references.build(this);
+        else
+            ownNodes.build(&queries);
+    });
+    const JoinNodes& queryNodes = selfJoin ? references : ownNodes;
+
+    //The queries are split into groups the same way for any pool, so ties resolve the same way too
+    QVector<quint32> tasks;
+    QVarLengthArray<quint32, 128> toSplit;
+    toSplit.append(0);
+    while (!toSplit.isEmpty())
+    {
+        const quint32 group = toSplit.last();
+        toSplit.removeLast();
+        const JoinNodes::Group& current = queryNodes.groups.at(group);
+        if (current.end - current.begin <= JOIN_TASK)
+        {
+            tasks.append(group);
+            continue;
+        }
+        toSplit.append(current.right);
+        toSplit.append(current.left);
+    }
+
+    QVector<qreal> best(queryNodes.keySlots.size(), std::numeric_limits<qreal>::max());
+    QVector<int> nearest(queryNodes.keySlots.size(), -1);
+    QVector<qreal> groupBounds(queryNodes.groups.size(), std::numeric_limits<qreal>::max());
+
+    parallelForIdle(pool, tasks.size(), [&](int task) {
+        dispatchMetric(MetricKind(_metricKind), _distanceMetric, _dimension,
+                       NearestJoin(&queryNodes, &references, tasks.at(task), best.data(), nearest.data(),
+                                   groupBounds.data()));
+    });
+
+    for (int q = 0; q < queryNodes.keySlots.size(); q++)
+    {
+        //Only keys no distance could be measured to (e.g. NaN) go without a match
+        if (nearest.at(q) < 0)
+            continue;
+        (*nearestOut)[queryNodes.keySlots.at(q)] = references.keySlots.at(nearest.at(q));
+        if (distancesOut)
+            (*distancesOut)[queryNodes.keySlots.at(q)] = best.at(q);
+    }
+
+    return true;
+}
+
+bool QKDTree::withinDistance(const QVectorND &center, qreal radius, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+
+    output->clear();
+    QKDTreeNodeCollector collector(output);
+    return this->withinDistance(center, radius, &collector, resultOut);
+}
+
+bool QKDTree::withinDistance(const QPointF &center, qreal radius, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    return this->withinDistance(QVectorND(center), radius, output, resultOut);
+}
+
+bool QKDTree::withinDistance(const QVectorND &center, qreal radius, QKDTreeVisitor *visitor, QString *resultOut) const
+{
+    if (visitor == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_VISITOR;
+        return false;
+    }
+    else if (center.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (_size <= 0)
+        return true;
+
+    //Not threadMetricScratch(): the visitor may run searches of its own on this thread
+    dispatchMetric(MetricKind(_metricKind), _distanceMetric, _dimension,
+                   WithinDistance(this, center, radius, visitor));
+    return true;
+}
+
+bool QKDTree::rangeQuery(const QVectorND &min, const QVectorND &max, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+
+    output->clear();
+    QKDTreeNodeCollector collector(output);
+    return this->rangeQuery(min, max, &collector, resultOut);
+}
+
+bool QKDTree::rangeQuery(const QRectF &rect, QList<QKDTreeNode> *output, QString *resultOut) const
+{
+    const QRectF normalized = rect.normalized();
+    return this->rangeQuery(QVectorND(normalized.topLeft()), QVectorND(normalized.bottomRight()),
+                            output, resultOut);
+}
+
+bool QKDTree::rangeQuery(const QVectorND &min, const QVectorND &max, QKDTreeVisitor *visitor, QString *resultOut) const
+{
+    if (visitor == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_VISITOR;
+        return false;
+    }
+    else if (min.dimension() != this->dimension() || max.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (_size <= 0)
+        return true;
+
+    const qreal * lower = min.constData();
+    const qreal * upper = max.constData();
+
+    QStack<quint32> toVisit;
+    toVisit.push(_root);
+
+    QVectorND position(_dimension);
+
+    while (!toVisit.isEmpty())
+    {
+        const quint32 current = toVisit.pop();
+        const Node& node = this->nodeAt(current);
+        const qreal * pos = this->coordinates(current);
+
+        bool inside = !node.dead;
+        for (int i = 0; i < _dimension && inside; i++)
+            inside = pos[i] >= lower[i] && pos[i] <= upper[i];
+        if (inside)
+        {
+            this->loadPosition(current, &position);
+            visitor->visit(position, this->valueAt(current));
+        }
+
+        //Only go down the sides of the hyperplane that the box overlaps
+        const int divDim = node.dividingDimension;
+        if (node.left != NO_NODE && lower[divDim] <= pos[divDim])
+            toVisit.push(node.left);
+        if (node.right != NO_NODE && upper[divDim] > pos[divDim])
+            toVisit.push(node.right);
+    }
+
+    return true;
+}
+
+bool QKDTree::rangeQuery(const QRectF &rect, QKDTreeVisitor *visitor, QString *resultOut) const
+{
+    const QRectF normalized = rect.normalized();
+    return this->rangeQuery(QVectorND(normalized.topLeft()), QVectorND(normalized.bottomRight()),
+                            visitor, resultOut);
+}
+
+bool QKDTree::containsKey(const QVectorND &position) const
+{
+    if (position.dimension() != this->dimension())
+        return false;
+    else if (_size <= 0)
+        return false;
+
+    const qreal * pos = position.constData();
+    quint32 current = _root;
+
+    while (current != NO_NODE)
+    {
+        const Node& node = this->nodeAt(current);
+        const qreal * currentPos = this->coordinates(current);
+        if (!node.dead && samePosition(currentPos, pos, _dimension))
+            return true;
+
+        const int divDim = node.dividingDimension;
+        if (pos[divDim] <= currentPos[divDim])
+            current = node.left;
+        else
+            current = node.right;
+    }
+    return false;
+}
+
+bool QKDTree::containsKey(QKDTreeNode *node) const
+{
+    if (node == 0)
+        return false;
+
+    return this->containsKey(node->position());
+}
+
+bool QKDTree::value(const QVectorND &positionKey, QVariant *output, QString *resultOut) const
+{
+    const QString errStringNotFound = "Key not found";
+
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (this->size() <= 0)
+    {
+        if (resultOut)
+            *resultOut = errStringNotFound;
+        return false;
+    }
+    else if (positionKey.dimension() != this->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+
+    const qreal * pos = positionKey.constData();
+    quint32 current = _root;
+    while (current != NO_NODE)
+    {
+        const Node& node = this->nodeAt(current);
+        const int divDim = node.dividingDimension;
+        const qreal * currentPos = this->coordinates(current);
+
+        if (!node.dead && samePosition(currentPos, pos, _dimension))
+        {
+            *output = this->valueAt(current);
+            return true;
+        }
+        else if (pos[divDim] <= currentPos[divDim])
+            current = node.left;
+        else
+            current = node.right;
+    }
+
+    if (resultOut)
+        *resultOut = errStringNotFound;
+    return false;
+}
+
+bool QKDTree::value(const QPointF &positionKey, QVariant *output, QString *resultOut) const
+{
+    return this->value(QVectorND(positionKey), output, resultOut);
+}
+
+QKDTree::const_iterator QKDTree::begin() const
+{
+    return const_iterator(this, this->nextLive(0));
+}
+
+QKDTree::const_iterator QKDTree::end() const
+{
+    return const_iterator(this, this->slotCount());
+}
+
+QKDTree::const_iterator QKDTree::constBegin() const
+{
+    return this->begin();
+}
+
+QKDTree::const_iterator QKDTree::constEnd() const
+{
+    return this->end();
+}
+
+bool QKDTree::forEach(QKDTreeVisitor *visitor, QString *resultOut) const
+{
+    if (visitor == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_VISITOR;
+        return false;
+    }
+    else if (_root == NO_NODE)
+        return true;
+
+    //Pre-order, right child pushed first, so the stack never holds more than one node per level
+    QVarLengthArray<quint32, 128> toVisit;
+    toVisit.append(_root);
+
+    QVectorND position(_dimension);
+    while (!toVisit.isEmpty())
+    {
+        const quint32 current = toVisit.last();
+        toVisit.removeLast();
+
+        const Node& node = this->nodeAt(current);
+        if (node.right != NO_NODE)
+            toVisit.append(node.right);
+        if (node.left != NO_NODE)
+            toVisit.append(node.left);
+
+        if (!node.dead)
+        {
+            this->loadPosition(current, &position);
+            visitor->visit(position, this->valueAt(current));
+        }
+    }
+    return true;
+}
+
+QKDTreeDistanceMetric *QKDTree::distanceMetric() const
+{
+    return _distanceMetric;
+}
+
+bool QKDTree::setDistanceMetric(QKDTreeDistanceMetric *distanceMetric, bool takeOwnership, QString *resultOut)
+{
+    if (distanceMetric && !metricFits(distanceMetric, _dimension, resultOut))
+        return false;
+
+    if (_ownsDistanceMetric && _distanceMetric != distanceMetric)
+        delete _distanceMetric;
+
+    //If they don't give us a distance metric, just use the default
+    _distanceMetric = distanceMetric;
+    _ownsDistanceMetric = takeOwnership;
+    if (_distanceMetric == 0)
+    {
+        _distanceMetric = new QKDTreeDistanceMetric();
+        _ownsDistanceMetric = true;
+    }
+
+    _metricKind = metricKind(_distanceMetric);
+    return true;
+}
+
+void QKDTree::debugPrint() const
+{
+    if (_size <= 0)
+        return;
+
+    QQueue<quint32> q;
+    q.enqueue(_root);
+
+    while (!q.isEmpty())
+    {
+        const quint32 n = q.dequeue();
+        if (!this->nodeAt(n).dead)
+            qDebug() << QVectorND(this->coordinates(n), _dimension) << this->valueAt(n);
+
+        if (this->nodeAt(n).left != NO_NODE)
+            q.enqueue(this->nodeAt(n).left);
+        if (this->nodeAt(n).right != NO_NODE)
+            q.enqueue(this->nodeAt(n).right);
+    }
+}
+
+//private
+void QKDTree::buildFromStorage(int threadCount)
+{
+    if (threadCount <= 0)
+        threadCount = QThread::idealThreadCount();
+
+    const int count = _values.size();
+    const int dimension = this->dimension();
+    qreal * coords = _coords.data();
+
+    //Our own pool, so the helpers are always available to us. The calling thread is one of the workers.
+    QThreadPool threadPool;
+    QThreadPool * pool = 0;
+    QVector<quint32> scratch;
+    if (threadCount > 1 && count >= PARALLEL_MIN)
+    {
+        threadPool.setMaxThreadCount(threadCount - 1);
+        pool = &threadPool;
+        scratch.resize(count);
+    }
+
+    QVector<quint32> order(count);
+    for (int i = 0; i < order.size(); i++)
+        order[i] = i;
+
+    //Keep only the first occurrence of each key, just like repeated calls to add() would
+    if (!_allowDuplicates && order.size() > 1)
+    {
+        parallelSort(pool, order.data(), order.data() + order.size(), PositionLess(coords, dimension), scratch.data());
+
+        QBitArray keep(order.size());
+        keep.setBit(order[0]);
+        for (int i = 1; i < order.size(); i++)
+        {
+            if (!samePosition(coords + qint64(order[i]) * dimension, coords + qint64(order[i - 1]) * dimension,
+                              dimension))
+                keep.setBit(order[i]);
+        }
+
+        //Compact the survivors, keeping them in input order
+        int kept = 0;
+        for (int i = 0; i < keep.size(); i++)
+        {
+            if (!keep.testBit(i))
+                continue;
+            if (kept != i)
+            {
+                std::copy(coords + qint64(i) * dimension, coords + qint64(i + 1) * dimension,
+                          coords + qint64(kept) * dimension);
+                _values[kept] = _values[i];
+            }
+            order[kept] = kept;
+            kept++;
+        }
+        order.resize(kept);
+        _coords.resize(order.size() * dimension);
+        _values.resize(order.size());
+    }
+
+    if (order.isEmpty())
+        return;
 
-QKDTree::QKDTree(int dimension, bool allowDuplicates, QKDTreeDistanceMetric *distanceMetric) :
-    _dimension(dimension), _size(0), _root(0), _allowDuplicates(allowDuplicates)
-{
-    //If they don't give us a distance metric, just use the default
-    _distanceMetric = distanceMetric;
-    if (_distanceMetric == 0)
-        _distanceMetric = new QKDTreeDistanceMetric();
-}
+    const Node emptyNode = {NO_NODE, NO_NODE, 0, 0, 0, false};
+    _nodes.fill(emptyNode, order.size());
+    _size = order.size();
 
-QKDTree::~QKDTree()
-{
-    if (_size > 0)
+    const BuildRange whole = {0, order.size(), 0, NO_NODE, false};
+    if (pool == 0)
     {
-        QQueue<QKDTreeNode *> deleteQueue;
-        deleteQueue.enqueue(_root);
+        this->buildSubtree(order.data(), whole);
+        return;
+    }
 
-        while (!deleteQueue.isEmpty())
+    //Split the levels near the root with every thread helping on each median...
+    QQueue<BuildRange> toSplit;
+    QVector<BuildRange> subtrees;
+    toSplit.enqueue(whole);
+    const int subtreeSize = qMax(PARALLEL_MIN, order.size() / (threadCount * 4));
+    while (!toSplit.isEmpty())
+    {
+        const BuildRange range = toSplit.dequeue();
+        if (range.end - range.begin < subtreeSize)
         {
-            QKDTreeNode * current = deleteQueue.dequeue();
-            if (current->left())
-                deleteQueue.enqueue(current->left());
-            if (current->right())
-                deleteQueue.enqueue(current->right());
-            delete current;
+            subtrees.append(range);
+            continue;
         }
 
-        _root = 0;
-        _size = 0;
+        const int pivotIndex = this->splitRange(order.data(), range, pool, scratch.data());
+        const quint32 pivot = order[pivotIndex];
+        if (pivotIndex > range.begin)
+        {
+            BuildRange left = {range.begin, pivotIndex, range.depth + 1, pivot, true};
+            toSplit.enqueue(left);
+        }
+        if (pivotIndex + 1 < range.end)
+        {
+            BuildRange right = {pivotIndex + 1, range.end, range.depth + 1, pivot, false};
+            toSplit.enqueue(right);
+        }
     }
-    delete _distanceMetric;
+
+    //...then build the subtrees below them independently, biggest first
+    std::sort(subtrees.begin(), subtrees.end(), [](const BuildRange& a, const BuildRange& b) {
+        return a.end - a.begin > b.end - b.begin;
+    });
+    quint32 * const orderData = order.data();
+    parallelFor(pool, subtrees.size(), [&](int i) {
+        this->buildSubtree(orderData, subtrees.at(i));
+    });
 }
 
-int QKDTree::dimension() const
+//private
+void QKDTree::buildSubtree(quint32 *order, const BuildRange &whole)
 {
-    return _dimension;
+    QStack<BuildRange> toBuild;
+    toBuild.push(whole);
+
+    while (!toBuild.isEmpty())
+    {
+        const BuildRange range = toBuild.pop();
+        const int pivotIndex = this->splitRange(order, range, 0, 0);
+        const quint32 pivot = order[pivotIndex];
+        if (pivotIndex > range.begin)
+        {
+            BuildRange left = {range.begin, pivotIndex, range.depth + 1, pivot, true};
+            toBuild.push(left);
+        }
+        if (pivotIndex + 1 < range.end)
+        {
+            BuildRange right = {pivotIndex + 1, range.end, range.depth + 1, pivot, false};
+            toBuild.push(right);
+        }
+    }
 }
 
-qint64 QKDTree::size() const
+//private
+int QKDTree::splitRange(quint32 *order, const BuildRange &range, QThreadPool *pool, quint32 *scratch)
 {
-    return _size;
+    const int divDim = range.depth % _dimension;
+    quint32 * const pivot = splitAtMedian(pool, _coords.constData(), _dimension, divDim, order + range.begin,
+                                          order + range.end, scratch);
+
+    //Subtrees built on different threads only ever touch their own nodes and their parent's link
+    Node * nodes = _nodes.data();
+    nodes[*pivot].dividingDimension = divDim;
+    nodes[*pivot].size = range.end - range.begin;
+    if (range.parent == NO_NODE)
+        _root = *pivot;
+    else if (range.isLeft)
+        nodes[range.parent].left = *pivot;
+    else
+        nodes[range.parent].right = *pivot;
+
+    return pivot - order;
 }
 
-bool QKDTree::add(QKDTreeNode *node, QString *resultOut)
+//private
+bool QKDTree::mappingIsConsistent(const Mapping &mapping, quint32 root, qint64 size, quint64 valuesLength,
+                                  int dimension)
 {
-    if (node == 0)
+    //A bad link or dividing dimension would send searches outside the file, so look at every node now
+    const quint32 nodeCount = mapping.nodeCount;
+    for (quint32 i = 0; i < nodeCount; i++)
     {
-        if (resultOut)
-            *resultOut = "Cannot add null node";
-        return false;
+        const Node& node = mapping.nodes[i];
+        if ((node.left != NO_NODE && node.left >= nodeCount) || (node.right != NO_NODE && node.right >= nodeCount)
+                || node.dividingDimension < 0 || node.dividingDimension >= dimension)
+            return false;
     }
-    else if (node->position().dimension() != this->dimension())
+
+    /*
+     * A link back up the tree or a child shared by two parents would send searches round in circles,
+     * and a size the tree doesn't hold would let them look for a nearest key that isn't there. So walk
+     * down from the root once, reaching no node twice, and count the live keys on the way.
+     */
+    QBitArray visited(int(nodeCount));
+    QStack<quint32> toVisit;
+    qint64 liveCount = 0;
+    if (root != NO_NODE)
+        toVisit.push(root);
+    while (!toVisit.isEmpty())
     {
-        if (resultOut)
-            *resultOut = ERR_STRING_BAD_DIM;
+        const quint32 current = toVisit.pop();
+        if (visited.testBit(int(current)))
+            return false;
+        visited.setBit(int(current));
+
+        const Node& node = mapping.nodes[current];
+        if (!node.dead)
+            liveCount++;
+        if (node.left != NO_NODE)
+            toVisit.push(node.left);
+        if (node.right != NO_NODE)
+            toVisit.push(node.right);
+    }
+    if (liveCount != size)
         return false;
+    for (quint32 i = 0; i < mapping.freeCount; i++)
+    {
+        if (mapping.freeNodes[i] >= nodeCount)
+            return false;
     }
 
-    //Special case for first node in the tree!
-    if (_root == 0)
+    /*
+     * Each value runs from its offset to the next one, so the offsets must climb from 0 to the end.
+     * valueAt() hands each value to a QByteArray, so none may be longer than an int can count.
+     */
+    if (mapping.valueOffsets[0] != 0 || mapping.valueOffsets[nodeCount] != valuesLength)
+        return false;
+    for (quint32 i = 0; i < nodeCount; i++)
     {
-        _root = node;
-        _size++;
-        return true;
+        if (mapping.valueOffsets[i] > mapping.valueOffsets[i + 1]
+                || mapping.valueOffsets[i + 1] - mapping.valueOffsets[i] > quint64(std::numeric_limits<int>::max()))
+            return false;
     }
+    return true;
+}
 
-    //Otherwise, normal insertion
-    QKDTreeNode * potentialParent = _root;
-    while (true)
+//private
+bool QKDTree::removeMatching(const QVectorND &position, const QVariant *value, QString *resultOut)
+{
+    if (position.dimension() != this->dimension())
     {
-        const int divDim = potentialParent->dividingDimension();
-        if (!_allowDuplicates && node->position() == potentialParent->position())
-        {
-            if (resultOut)
-                *resultOut = "Cannot add duplicate";
-            return false;
-        }
-        else if (node->position().val(divDim) <= potentialParent->position().val(divDim))
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (!this->detachMapping(resultOut))
+        return false;
+
+    //Every copy of a key lies on the path a lookup takes, since ties always go left
+    const qreal * pos = position.constData();
+    QVarLengthArray<quint32, 64> path;
+    int removed = 0;
+    quint32 current = _root;
+    while (current != NO_NODE)
+    {
+        path.append(current);
+        Node& node = _nodes[current];
+        const qreal * currentPos = this->coordinates(current);
+        if (!node.dead && samePosition(currentPos, pos, _dimension)
+                && (value == 0 || _values.at(current) == *value))
         {
-            if (potentialParent->left() != 0)
-                potentialParent = potentialParent->left();
-            else
-            {
-                potentialParent->setLeft(node);
-                node->setDividingDimension((divDim + 1) % this->dimension());
+            node.dead = true;
+            _values[current] = QVariant();
+            for (int i = 0; i < path.size(); i++)
+                _nodes[path[i]].deadCount++;
+            removed++;
+
+            if (value != 0 || !_allowDuplicates)
                 break;
-            }
         }
-        else
+
+        const int divDim = node.dividingDimension;
+        current = (pos[divDim] <= currentPos[divDim]) ? node.left : node.right;
+    }
+
+    if (removed == 0)
+    {
+        if (resultOut)
+            *resultOut = "Key not found";
+        return false;
+    }
+    _size -= removed;
+
+    //Rebuild the biggest subtree on the path that is now mostly dead
+    for (int i = 0; i < path.size(); i++)
+    {
+        const Node& node = _nodes.at(path[i]);
+        if (node.deadCount * 2 > node.size)
         {
-            if (potentialParent->right() != 0)
-                potentialParent = potentialParent->right();
-            else
-            {
-                potentialParent->setRight(node);
-                node->setDividingDimension((divDim + 1) % this->dimension());
-                break;
-            }
+            this->rebuildOnPath(path.constData(), i);
+            break;
         }
     }
 
-    _size++;
     return true;
 }
 
-bool QKDTree::add(const QVectorND &position, const QVariant &value, QString *resultOut)
+//private
+void QKDTree::rebuildOnPath(const quint32 *path, int index)
 {
-    QKDTreeNode * node = new QKDTreeNode(position, value);
+    //The rebuild drops the subtree's dead nodes, so its ancestors lose them too
+    const quint32 deadCount = _nodes.at(path[index]).deadCount;
+    for (int i = 0; i < index; i++)
+    {
+        _nodes[path[i]].size -= deadCount;
+        _nodes[path[i]].deadCount -= deadCount;
+    }
 
-    return this->add(node, resultOut);
+    const quint32 parent = (index > 0) ? path[index - 1] : NO_NODE;
+    const bool isLeft = (index > 0) && _nodes.at(parent).left == path[index];
+    this->rebuildSubtree(path[index], parent, isLeft);
 }
 
-bool QKDTree::add(const QPointF &position, const QVariant &value, QString *resultOut)
+//private
+void QKDTree::rebuildSubtree(quint32 subtreeRoot, quint32 parent, bool isLeft)
 {
-    QKDTreeNode * node = new QKDTreeNode(QVectorND(position), value);
+    const int divDim = _nodes.at(subtreeRoot).dividingDimension;
 
-    return this->add(node, resultOut);
-}
+    //Gather the live nodes and unlink everything; dead slots go on the free list
+    QVector<quint32> order;
+    order.reserve(_nodes.at(subtreeRoot).size - _nodes.at(subtreeRoot).deadCount);
+    QStack<quint32> toVisit;
+    toVisit.push(subtreeRoot);
+    while (!toVisit.isEmpty())
+    {
+        const quint32 current = toVisit.pop();
+        Node& node = _nodes[current];
+        if (node.left != NO_NODE)
+            toVisit.push(node.left);
+        if (node.right != NO_NODE)
+            toVisit.push(node.right);
 
+        if (node.dead)
+            _freeNodes.append(current);
+        else
+            order.append(current);
 
-bool QKDTree::nearestNode(const QVectorND &searchPos, QKDTreeNode *output, QString *resultOut)
-{
-    if (output == 0)
-    {
-        if (resultOut)
-            *resultOut = ERR_STRING_BAD_OUTPTR;
-        return false;
-    }
-    else if (searchPos.dimension() != this->dimension())
-    {
-        if (resultOut)
-            *resultOut = ERR_STRING_BAD_DIM;
-        return false;
+        const Node emptyNode = {NO_NODE, NO_NODE, 0, 0, 0, false};
+        node = emptyNode;
     }
-    else if (_size <= 0)
+
+    if (parent == NO_NODE)
     {
-        if (resultOut)
-            *resultOut = "Tree is empty";
-        return false;
+        //Rebuilding everything, so take the chance to give back the dead slots' memory too
+        std::sort(order.begin(), order.end());
+        qreal * coords = _coords.data();
+        for (int i = 0; i < order.size(); i++)
+        {
+            if (int(order[i]) == i)
+                continue;
+            std::copy(coords + qint64(order[i]) * _dimension, coords + qint64(order[i] + 1) * _dimension,
+                      coords + qint64(i) * _dimension);
+            _values[i] = _values.at(order[i]);
+            order[i] = i;
+        }
+        _nodes.resize(order.size());
+        _coords.resize(order.size() * _dimension);
+        _values.resize(order.size());
+        _freeNodes.clear();
+        _root = NO_NODE;
     }
+    else if (isLeft)
+        _nodes[parent].left = NO_NODE;
+    else
+        _nodes[parent].right = NO_NODE;
+
+    if (order.isEmpty())
+        return;
+
+    const BuildRange whole = {0, order.size(), divDim, parent, isLeft};
+    this->buildSubtree(order.data(), whole);
+}
+
+//private
+void QKDTree::nearestCandidates(const QVectorND &searchPos, int k, qreal bound,
+                                QVector<QPair<qreal, quint32> > *output, qreal epsilon, SearchScratch *scratch) const
+{
+    dispatchMetric(MetricKind(_metricKind), _distanceMetric, _dimension,
+                   NearestCandidates(this, searchPos, k, bound, epsilon, output, scratch));
+}
+
+//private
+quint32 QKDTree::nearestWithin(const QVectorND &searchPos, qreal bound, qreal *distanceOut, qreal epsilon) const
+{
+    //Custom metrics take vectors, so keep a pair of them per thread rather than making them per query
+    quint32 toRet = NO_NODE;
+    dispatchMetric(MetricKind(_metricKind), _distanceMetric, _dimension,
+                   NearestWithin(this, searchPos, bound, epsilon, distanceOut, &toRet),
+                   threadMetricScratch(_dimension));
+    return toRet;
+}
+
+//private
+template <typename Metric>
+quint32 QKDTree::nearestWithin(const Metric &metric, const QVectorND &searchPos, qreal bound, qreal *distanceOut,
+                               qreal epsilon) const
+{
+    const qreal * search = searchPos.constData();
 
-    QQueue<QKDTreeNode *> descend;
-    QStack<QKDTreeNode *> unwindChecks;
+    /*
+     * Depth first, nearer side first. Each far side waits on a small stack along with its distance
+     * to the splitting plane, and is dropped if something nearer than that has turned up by the time
+     * it comes off. The stack never holds more entries than the tree is deep.
+     *
+     * Approximate searches shrink the best distance by (1+epsilon)^2 before comparing it with a
+     * plane, so anything they skip is at best a little nearer than what they return.
+     */
+    struct Pending
+    {
+        quint32 node;
+        qreal planeDistance;
+    };
+    QVarLengthArray<Pending, 128> pending;
 
-    descend.enqueue(_root);
+    const qreal shrink = 1.0 / ((1.0 + epsilon) * (1.0 + epsilon));
+    quint32 bestSoFar = NO_NODE;
+    qreal bestDistSoFar = bound;
 
-    QKDTreeNode * bestSoFar = 0;
-    qreal bestDistSoFar = std::numeric_limits<qreal>::max();
+    const Pending root = {_root, 0.0};
+    if (_root != NO_NODE)
+        pending.append(root);
 
-    while (!descend.isEmpty() || !unwindChecks.isEmpty())
+    while (!pending.isEmpty())
     {
-        if (!descend.isEmpty())
+        const Pending next = pending.last();
+        pending.removeLast();
+        if (next.planeDistance >= bestDistSoFar * shrink)
+            continue;
+
+        quint32 current = next.node;
+        while (current != NO_NODE)
         {
-            QKDTreeNode * current = descend.dequeue();
-            unwindChecks.push(current);
+            const Node& node = this->nodeAt(current);
+            const qreal * pos = this->coordinates(current);
+            const int divDim = node.dividingDimension;
+            const qreal delta = search[divDim] - pos[divDim];
 
-            const int divDim = current->dividingDimension();
-            if (searchPos.val(divDim) <= current->position().val(divDim))
+            if (!node.dead)
             {
-                if (current->left() != 0)
-                    descend.enqueue(current->left());
-                else
+                const qreal dist = metric.distance(pos, searchPos);
+                if (dist < bestDistSoFar)
                 {
-                    const qreal dist = _distanceMetric->distance(current->position(), searchPos);
-                    if (dist < bestDistSoFar)
-                    {
-                        bestSoFar = current;
-                        bestDistSoFar = dist;
-                    }
+                    bestSoFar = current;
+                    bestDistSoFar = dist;
                 }
             }
-            else
+
+            const quint32 farSide = (delta <= 0.0) ? node.right : node.left;
+            if (farSide != NO_NODE)
             {
-                if (current->right() != 0)
-                    descend.enqueue(current->right());
-                else
+                const qreal planeDistance = metric.planeDistance(pos, searchPos, divDim);
+                if (planeDistance < bestDistSoFar * shrink)
                 {
-                    const qreal dist = _distanceMetric->distance(current->position(), searchPos);
-                    if (dist < bestDistSoFar)
-                    {
-                        bestSoFar = current;
-                        bestDistSoFar = dist;
-                    }
+                    const Pending far = {farSide, planeDistance};
+                    pending.append(far);
                 }
             }
-        }
-        else
-        {
-            //In this branch we "unwind" up the tree, checking those nodes for nearer-ness
-            QKDTreeNode * current = unwindChecks.pop();
-            const int divDim = current->dividingDimension();
-            const qreal dist = _distanceMetric->distance(current->position(), searchPos);
-            if (dist < bestDistSoFar)
-            {
-                bestSoFar = current;
-                bestDistSoFar = dist;
-            }
-
-            //Do we need to check other side of hyperplane?
-            QVectorND temp = current->position();
-            temp[divDim] = searchPos.val(divDim);
-            const qreal hyperplaneDistance = this->distanceMetric()->distance(temp, current->position());
-            if (hyperplaneDistance > bestDistSoFar)
-                continue;
-
-            //Search the other side of the dividing node
-            if (searchPos.val(divDim) <= current->position().val(divDim)
-                    && current->right() != 0)
-                descend.enqueue(current->right());
-            else if (current->left() != 0)
-                descend.enqueue(current->left());
-
+            current = (delta <= 0.0) ? node.left : node.right;
         }
     }
 
-    *output = *bestSoFar;
-
-    return true;
+    if (distanceOut)
+        *distanceOut = bestDistSoFar;
+    return bestSoFar;
 }
 
-bool QKDTree::nearestNode(const QPointF &position, QKDTreeNode *output, QString *resultOut)
+//private
+void QKDTree::bestBinCandidates(const QVectorND &searchPos, int k, int maxChecks,
+                                QVector<QPair<qreal, quint32> > *output) const
 {
-    return this->nearestNode(QVectorND(position), output, resultOut);
+    dispatchMetric(MetricKind(_metricKind), _distanceMetric, _dimension,
+                   BestBinCandidates(this, searchPos, k, maxChecks, output));
 }
 
-bool QKDTree::nearestNode(QKDTreeNode *node, QKDTreeNode *output, QString *resultOut)
+//private
+template <typename Metric>
+void QKDTree::bestBinCandidates(const Metric &metric, const QVectorND &searchPos, int k, int maxChecks,
+                                QVector<QPair<qreal, quint32> > *output) const
 {
-    return this->nearestNode(node->position(), output, resultOut);
-}
+    const qreal * search = searchPos.constData();
+    const int budget = (maxChecks > 0) ? maxChecks : std::numeric_limits<int>::max();
 
-bool QKDTree::nearestKey(const QVectorND &position, QVectorND *output, QString *resultOut)
-{
-    if (output == 0)
+    /*
+     * Unexplored far sides wait on a min-heap keyed on a lower bound of the distance to anything in
+     * them: the larger of their own plane distance and that of the branch they were found in. Each
+     * turn takes the nearest one and follows it down to the bottom of the tree, queueing the far side
+     * of every node on the way.
+     */
+    typedef QPair<qreal, quint32> Branch;
+    const std::greater<Branch> nearerFirst;
+    QVector<Branch> branches;
+    branches.append(qMakePair(qreal(0.0), _root));
+
+    //Max-heap of the k best so far, so the worst of them is always at the front
+    QVector<QPair<qreal, quint32> >& best = *output;
+    best.clear();
+    best.reserve(k);
+
+    int checks = 0;
+    while (!branches.isEmpty() && checks < budget)
     {
-        if (resultOut)
-            *resultOut = ERR_STRING_BAD_OUTPTR;
-        return false;
-    }
+        std::pop_heap(branches.begin(), branches.end(), nearerFirst);
+        const Branch branch = branches.last();
+        branches.removeLast();
 
-    QKDTreeNode nearestNode;
-    if (!this->nearestNode(position, &nearestNode, resultOut))
-        return false;
+        //Every other branch is at least as far away, so none of them can improve on best
+        if (best.size() == k && branch.first >= best.first().first)
+            break;
 
-    *output = nearestNode.position();
+        quint32 current = branch.second;
+        while (current != NO_NODE && checks < budget)
+        {
+            const Node& node = this->nodeAt(current);
+            const qreal * pos = this->coordinates(current);
+            const int divDim = node.dividingDimension;
+            const qreal delta = search[divDim] - pos[divDim];
+            checks++;
 
-    return true;
+            if (!node.dead)
+            {
+                const qreal dist = metric.distance(pos, searchPos);
+                if (best.size() < k)
+                {
+                    best.append(qMakePair(dist, current));
+                    std::push_heap(best.begin(), best.end());
+                }
+                else if (dist < best.first().first)
+                {
+                    std::pop_heap(best.begin(), best.end());
+                    best.last() = qMakePair(dist, current);
+                    std::push_heap(best.begin(), best.end());
+                }
+            }
+
+            const quint32 farSide = (delta <= 0.0) ? node.right : node.left;
+            if (farSide != NO_NODE)
+            {
+                const qreal bound = qMax(branch.first, metric.planeDistance(pos, searchPos, divDim));
+                if (best.size() < k || bound < best.first().first)
+                {
+                    branches.append(qMakePair(bound, farSide));
+                    std::push_heap(branches.begin(), branches.end(), nearerFirst);
+                }
+            }
+            current = (delta <= 0.0) ? node.left : node.right;
+        }
+    }
+
+    std::sort_heap(best.begin(), best.end());
 }
 
-bool QKDTree::containsKey(const QVectorND &position)
+//private
+bool QKDTree::nearestStep(const QVectorND &searchPos, QVector<QPair<qreal, quint64> > *queue, quint32 *indexOut,
+                          qreal *distanceOut) const
 {
-    if (position.dimension() != this->dimension())
-        return false;
-    else if (_size <= 0)
-        return false;
+    bool toRet = false;
+    dispatchMetric(MetricKind(_metricKind), _distanceMetric, _dimension,
+                   NearestStep(this, searchPos, queue, indexOut, distanceOut, &toRet),
+                   threadMetricScratch(_dimension));
+    return toRet;
+}
 
-    QKDTreeNode * current = _root;
+//private
+template <typename Metric>
+bool QKDTree::nearestStep(const Metric &metric, const QVectorND &searchPos, QVector<QPair<qreal, quint64> > *queue,
+                          quint32 *indexOut, qreal *distanceOut) const
+{
+    const qreal * search = searchPos.constData();
+    const std::greater<QPair<qreal, quint64> > nearerFirst;
+    QVector<QPair<qreal, quint64> >& entries = *queue;
 
-    while (current != 0)
+    while (!entries.isEmpty())
     {
-        if (current->position() == position)
+        std::pop_heap(entries.begin(), entries.end(), nearerFirst);
+        const QPair<qreal, quint64> entry = entries.last();
+        entries.removeLast();
+
+        //A key at the front is settled: every subtree still queued is at least as far away
+        if (entry.second & 1)
+        {
+            *indexOut = quint32(entry.second >> 1);
+            if (distanceOut)
+                *distanceOut = entry.first;
             return true;
+        }
 
-        const int divDim = current->dividingDimension();
-        if (position.val(divDim) <= current->position().val(divDim))
-            current = current->left();
-        else
-            current = current->right();
+        //Follow the subtree down to the bottom, queueing the live keys and far sides on the way
+        quint32 current = quint32(entry.second >> 1);
+        while (current != NO_NODE)
+        {
+            const Node& node = this->nodeAt(current);
+            const qreal * pos = this->coordinates(current);
+            const int divDim = node.dividingDimension;
+            const qreal delta = search[divDim] - pos[divDim];
+
+            if (!node.dead)
+            {
+                entries.append(qMakePair(metric.distance(pos, searchPos), (quint64(current) << 1) | 1));
+                std::push_heap(entries.begin(), entries.end(), nearerFirst);
+            }
+
+            const quint32 farSide = (delta <= 0.0) ? node.right : node.left;
+            if (farSide != NO_NODE)
+            {
+                const qreal bound = qMax(entry.first, metric.planeDistance(pos, searchPos, divDim));
+                entries.append(qMakePair(bound, quint64(farSide) << 1));
+                std::push_heap(entries.begin(), entries.end(), nearerFirst);
+            }
+            current = (delta <= 0.0) ? node.left : node.right;
+        }
     }
     return false;
 }
 
-bool QKDTree::containsKey(QKDTreeNode *node)
+//private
+void QKDTree::nearestBatch(const QVector<QVectorND> &queries, QKDTreeNode *results, QAtomicInt *nextChunk,
+                           int chunkSize) const
 {
-    if (node == 0)
-        return false;
+    while (true)
+    {
+        const int begin = nextChunk->fetchAndAddRelaxed(chunkSize);
+        if (begin >= queries.size())
+            break;
 
-    return this->containsKey(node->position());
+        const int end = qMin(begin + chunkSize, queries.size());
+        for (int i = begin; i < end; i++)
+        {
+            const quint32 nearest = this->nearestWithin(queries.at(i), std::numeric_limits<qreal>::max(), 0, 0.0);
+            results[i] = QKDTreeNode(QVectorND(this->coordinates(nearest), _dimension), this->valueAt(nearest));
+        }
+    }
 }
 
-bool QKDTree::value(const QVectorND &positionKey, QVariant *output, QString *resultOut)
+//private
+const QKDTree::Node &QKDTree::nodeAt(quint32 index) const
 {
-    const QString errStringNotFound = "Key not found";
+    return _mapping ? _mapping->nodes[index] : _nodes.at(index);
+}
 
-    if (output == 0)
-    {
-        if (resultOut)
-            *resultOut = ERR_STRING_BAD_OUTPTR;
-        return false;
-    }
-    else if (this->size() <= 0)
-    {
-        if (resultOut)
-            *resultOut = errStringNotFound;
-        return false;
-    }
-    else if (positionKey.dimension() != this->dimension())
-    {
-        if (resultOut)
-            *resultOut = ERR_STRING_BAD_DIM;
-        return false;
-    }
+//private
+quint32 QKDTree::slotCount() const
+{
+    return _mapping ? _mapping->nodeCount : quint32(_nodes.size());
+}
 
-    QKDTreeNode * current = _root;
-    while (current != 0)
-    {
-        const int divDim = current->dividingDimension();
+//private
+quint32 QKDTree::nextLive(quint32 index) const
+{
+    //Free slots are zeroed, so only slots holding a key of the tree have a nonzero subtree size
+    const quint32 count = this->slotCount();
+    while (index < count && (this->nodeAt(index).dead || this->nodeAt(index).size == 0))
+        index++;
+    return index;
+}
 
-        if (current->position() == positionKey)
+//private
+void QKDTree::liveInOrder(QVector<quint32> *output) const
+{
+    //In-order, so each key comes between the keys of its left and right subtrees
+    output->clear();
+    output->reserve(_size);
+    QVarLengthArray<quint32, 128> path;
+    quint32 current = _root;
+    while (current != NO_NODE || !path.isEmpty())
+    {
+        while (current != NO_NODE)
         {
-            *output = current->value();
-            return true;
+            path.append(current);
+            current = this->nodeAt(current).left;
         }
-        else if (positionKey.val(divDim) <= current->position().val(divDim))
-            current = current->left();
-        else
-            current = current->right();
-    }
 
-    if (resultOut)
-        *resultOut = errStringNotFound;
-    return false;
+        current = path.last();
+        path.removeLast();
+        if (!this->nodeAt(current).dead)
+            output->append(current);
+        current = this->nodeAt(current).right;
+    }
 }
 
-bool QKDTree::value(const QPointF &positionKey, QVariant *output, QString *resultOut)
+//private
+const qreal *QKDTree::coordinates(quint32 index) const
 {
-    return this->value(QVectorND(positionKey), output, resultOut);
+    return (_mapping ? _mapping->coords : _coords.constData()) + qint64(index) * _dimension;
 }
 
-QKDTreeDistanceMetric *QKDTree::distanceMetric() const
+//private
+void QKDTree::loadPosition(quint32 index, QVectorND *output) const
 {
-    return _distanceMetric;
+    const qreal * pos = this->coordinates(index);
+    std::copy(pos, pos + _dimension, output->data());
 }
 
-void QKDTree::debugPrint()
+//private
+bool QKDTree::detachMapping(QString *resultOut)
 {
-    if (_size <= 0)
-        return;
-
-    QQueue<QKDTreeNode *> q;
-    q.enqueue(_root);
+    if (_mapping == 0)
+        return true;
 
-    while (!q.isEmpty())
+    //Copy the file into ordinary memory so the tree can change, if its arrays fit in a QVector
+    const quint32 count = _mapping->nodeCount;
+    if (qint64(count) * _dimension > std::numeric_limits<int>::max())
     {
-        QKDTreeNode * n = q.dequeue();
-        qDebug() << n->position() << n->value();
-
-        if (n->left())
-            q.enqueue(n->left());
-        if (n->right())
-            q.enqueue(n->right());
+        if (resultOut)
+            *resultOut = "Mapped tree is too large to change";
+        return false;
     }
+    QVector<Node> nodes(count);
+    std::copy(_mapping->nodes, _mapping->nodes + count, nodes.data());
+    QVector<qreal> coords(int(count) * _dimension);
+    std::copy(_mapping->coords, _mapping->coords + qint64(count) * _dimension, coords.data());
+    QVector<QVariant> values(count);
+    for (quint32 i = 0; i < count; i++)
+        values[i] = this->valueAt(i);
+    QVector<quint32> freeNodes(_mapping->freeCount);
+    std::copy(_mapping->freeNodes, _mapping->freeNodes + _mapping->freeCount, freeNodes.data());
+
+    delete _mapping;
+    _mapping = 0;
+
+    _nodes = nodes;
+    _coords = coords;
+    _values = values;
+    _freeNodes = freeNodes;
+    return true;
 }
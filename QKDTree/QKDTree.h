@@ -5,8 +5,17 @@
 
 #include "QKDTreeNode.h"
 #include "QKDTreeDistanceMetric.h"
+#include "QKDTreeVisitor.h"
 #include "QVectorND.h"
 
+#include <QAtomicInt>
+#include <QPair>
+#include <QRectF>
+#include <iterator>
+
+class QFile;
+class QThreadPool;
+
 class QKDTREESHARED_EXPORT QKDTree
 {
 public:
@@ -16,7 +25,8 @@ public:
      * @param dimension
      * @param allowDuplocates whether or not you can add multiple nodes with the same key
      * @param distanceMetric the custom distance metric object you would like to use. If 0 euclidean
-     * distance squared is used.
+     * distance squared is used. A metric that setDistanceMetric() would reject is deleted with a
+     * qWarning() and the default used instead; distanceMetric() then differs from the one given.
      */
     QKDTree(int dimension, bool allowDuplicates = false, QKDTreeDistanceMetric * distanceMetric = 0);
     ~QKDTree();
@@ -33,18 +43,301 @@ public:
      */
     qint64 size() const;
 
+    /**
+     * @brief depth Returns the number of levels in the tree (0 when empty).
+     * @return
+     */
+    int depth() const;
+
+    /**
+     * @brief setBalanceFactor turns on rebalancing for add(). Whenever an insert lands deeper than
+     * alpha * log2(size), the deepest ancestor on its path whose subtree is deeper than alpha * log2
+     * of its own size is rebuilt by median split. This keeps the depth logarithmic even when keys arrive sorted,
+     * for O(log^2 n) amortized insertion. Values around 2 work well; 0 (the default) turns it off.
+     * @param alpha must be greater than 1, or 0
+     */
+    void setBalanceFactor(qreal alpha);
+    qreal balanceFactor() const;
+
+    /**
+     * @brief add copies the key/value pair held by node into the tree. On success the tree takes
+     * ownership of node and deletes it, since the tree keeps its data in its own contiguous storage.
+     * @param node
+     * @param resultOut
+     * @return
+     */
     bool add(QKDTreeNode * node, QString * resultOut = 0);
     bool add(const QVectorND& position, const QVariant& value, QString * resultOut = 0);
     bool add(const QPointF& position, const QVariant& value, QString * resultOut = 0);
 
-    bool nearestNode(const QVectorND& position, QKDTreeNode * output, QString * resultOut = 0);
-    bool nearestNode(const QPointF& position, QKDTreeNode * output, QString * resultOut = 0);
-    bool nearestNode(QKDTreeNode * node, QKDTreeNode * output, QString * resultOut = 0);
+    /**
+     * @brief build replaces the contents of the tree with the given key/value pairs. Rather than
+     * inserting them one at a time, each subtree is split on the median of its points (found by
+     * selection, not sorting) so the result is balanced regardless of input order. O(nlogn) time.
+     *
+     * With more than one thread, the median selections near the root are split across all threads
+     * and the subtrees below them are then built as independent tasks. The resulting tree is
+     * identical to the single-threaded one.
+     * @param positions
+     * @param values must have the same length as positions
+     * @param resultOut
+     * @param threadCount the number of threads to build with. 0 uses QThread::idealThreadCount().
+     * @return
+     */
+    bool build(const QVector<QVectorND>& positions, const QVector<QVariant>& values, QString * resultOut = 0,
+               int threadCount = 1);
 
-    bool nearestKey(const QVectorND& position, QVectorND * output, QString * resultOut = 0);
+    /**
+     * @brief remove removes every key/value pair with the given key. Removed pairs are only marked
+     * as dead at first; once more than half of a subtree is dead it is rebuilt from its live pairs and
+     * the dead slots are reused by later calls to add().
+     * @param position
+     * @param resultOut
+     * @return false if the tree held no pair with that key
+     */
+    bool remove(const QVectorND& position, QString * resultOut = 0);
+    bool remove(const QPointF& position, QString * resultOut = 0);
+
+    /**
+     * @brief remove removes one key/value pair matching both the key and the value of node. Unlike
+     * add(), this does not take ownership of node.
+     * @param node
+     * @param resultOut
+     * @return false if the tree held no such pair
+     */
+    bool remove(QKDTreeNode * node, QString * resultOut = 0);
+
+    /**
+     * @brief clear removes all key/value pairs from the tree.
+     */
+    void clear();
+
+    /**
+     * @brief save writes the tree to a binary file that openMapped() can use in place. The file holds
+     * the raw node array, the flat coordinates and an offset table into the serialized values, each
+     * section 64-byte aligned. The header records the format version and the byte order and type
+     * sizes of the machine that wrote it.
+     * @param path
+     * @param resultOut
+     * @return
+     */
+    bool save(const QString& path, QString * resultOut = 0) const;
 
-    bool containsKey(const QVectorND& position);
-    bool containsKey(QKDTreeNode * node);
+    /**
+     * @brief openMapped replaces the contents of the tree with a file written by save(). The file is
+     * mapped read-only rather than loaded: queries walk the mapped nodes and coordinates directly and
+     * only decode the values they return, and processes that map the same file share one copy of it in
+     * the page cache. Opening checks every node and value offset once, so it takes time linear in the
+     * number of nodes and reads those two sections, but leaves the coordinates and values on disk. The first add() or remove() copies the tree
+     * into ordinary memory and releases the mapping, or fails if the tree holds more coordinates than
+     * a QVector can.
+     * @param path
+     * @param resultOut
+     * @return false if the file is missing, damaged, of another dimension, or was written on a
+     * machine with a different byte order or number sizes
+     */
+    bool openMapped(const QString& path, QString * resultOut = 0);
+
+    /**
+     * @brief isMapped returns true while the tree is being served from a file opened by openMapped().
+     * @return
+     */
+    bool isMapped() const;
+
+    /**
+     * @brief nearestNode finds the node nearest to position. With a positive epsilon the search is
+     * approximate: it skips every branch whose splitting plane is not within best/(1+epsilon)^2 of
+     * position, so the node found may be up to (1+epsilon)^2 times as far away as the true nearest one,
+     * in the units of the distance metric. For the default squared metric that is at most 1+epsilon
+     * times the true euclidean distance. Larger epsilons visit far fewer nodes.
+     * @param position
+     * @param output
+     * @param resultOut
+     * @param epsilon how far from optimal the answer may be. 0 (the default) gives the exact answer.
+     * @return
+     */
+    bool nearestNode(const QVectorND& position, QKDTreeNode * output, QString * resultOut = 0,
+                     qreal epsilon = 0.0) const;
+    bool nearestNode(const QPointF& position, QKDTreeNode * output, QString * resultOut = 0,
+                     qreal epsilon = 0.0) const;
+    bool nearestNode(QKDTreeNode * node, QKDTreeNode * output, QString * resultOut = 0) const;
+
+    bool nearestKey(const QVectorND& position, QVectorND * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief nearestIndex finds the key/value pair nearest to position without allocating any memory,
+     * as long as the tree is no more than 128 levels deep and uses the default distance metric (or a
+     * custom one that doesn't allocate itself). Instead of copying the pair out it returns the slot
+     * it lives in; pass that to keyAt() and valueAt(). Slots stay valid until the tree is next changed.
+     * @param position
+     * @param indexOut
+     * @param distanceOut if not 0, receives the distance to the nearest key
+     * @param resultOut
+     * @return
+     */
+    bool nearestIndex(const QVectorND& position, quint32 * indexOut, qreal * distanceOut = 0,
+                      QString * resultOut = 0) const;
+
+    /**
+     * @brief keyAt returns the dimension() coordinates of the key in the given slot.
+     * @param index a slot returned by nearestIndex()
+     * @return
+     */
+    const qreal * keyAt(quint32 index) const;
+
+    /**
+     * @brief valueAt returns the value in the given slot.
+     * @param index a slot returned by nearestIndex()
+     * @return
+     */
+    QVariant valueAt(quint32 index) const;
+
+    /**
+     * @brief nearestNodes finds the k nodes nearest to the given position. Results are sorted from
+     * nearest to farthest. If the tree holds fewer than k nodes, all of them are returned. A positive
+     * epsilon makes the search approximate just as for nearestNode(): the i-th node returned is at
+     * most (1+epsilon)^2 times as far away as the true i-th nearest node.
+     * @param position
+     * @param k
+     * @param output
+     * @param resultOut
+     * @param epsilon how far from optimal the answer may be. 0 (the default) gives the exact answer.
+     * @return
+     */
+    bool nearestNodes(const QVectorND& position, int k, QList<QKDTreeNode> * output, QString * resultOut = 0,
+                      qreal epsilon = 0.0) const;
+    bool nearestNodes(const QPointF& position, int k, QList<QKDTreeNode> * output, QString * resultOut = 0,
+                      qreal epsilon = 0.0) const;
+
+    /**
+     * @brief bestBinNearestNodes finds (approximately) the k nodes nearest to position with a best-bin-first
+     * search: unexplored branches wait in a priority queue ordered by how near their region could be to
+     * position, and the nearest of them is always explored next. The search stops after examining
+     * maxChecks nodes, so its cost is bounded however many dimensions the keys have, and what it has
+     * found by then is returned, sorted from nearest to farthest. The answer is exact whenever the
+     * budget runs out after the search would have ended anyway. Mostly useful for 10 or more
+     * dimensions, where exact searches visit most of the tree.
+     * @param position
+     * @param k
+     * @param maxChecks how many nodes to examine at most. 0 or less means no limit.
+     * @param output
+     * @param resultOut
+     * @return
+     */
+    bool bestBinNearestNodes(const QVectorND& position, int k, int maxChecks, QList<QKDTreeNode> * output,
+                             QString * resultOut = 0) const;
+    bool bestBinNearestNode(const QVectorND& position, int maxChecks, QKDTreeNode * output,
+                            QString * resultOut = 0) const;
+
+    /**
+     * @brief nearestNodes finds the nearest node to each of a batch of positions, spreading the work
+     * over a thread pool. output is resized to queries.size() and output[i] receives the nearest node
+     * to queries[i]. Threads claim small chunks of the batch as they go, so uneven queries don't leave
+     * cores idle. The calling thread works on the batch too, and only idle pool threads are used.
+     * @param queries
+     * @param output
+     * @param resultOut
+     * @param pool the thread pool to use. If 0 QThreadPool::globalInstance() is used.
+     * @return
+     */
+    bool nearestNodes(const QVector<QVectorND>& queries, QVector<QKDTreeNode> * output, QString * resultOut = 0,
+                      QThreadPool * pool = 0) const;
+
+    /**
+     * @brief knnGraph finds the k nearest neighbors of every key in the tree, not counting the key
+     * itself, and returns them as a graph in compressed sparse row form. The neighbors of the key in
+     * slot i are neighborsOut[offsetsOut[i]] to neighborsOut[offsetsOut[i + 1] - 1], nearest first, and
+     * are slots as well (see keyAt() and valueAt()). Slots that hold no key get no neighbors. If the tree
+     * holds k or fewer keys, each key gets all of the others.
+     *
+     * Keys are queried in the order of an in-order walk of the tree, so consecutive queries are close
+     * together in space and mostly visit the same nodes. Each search starts out bounded by the previous
+     * key's neighbors, which prunes most of the tree before it is walked. Runs of that order are spread
+     * over the idle threads of the pool, as with the batch nearestNodes().
+     *
+     * Fails if the graph would hold more than INT_MAX neighbors, the most a QVector can.
+     * @param k
+     * @param offsetsOut receives one offset per slot plus a final one, the total number of neighbors
+     * @param neighborsOut
+     * @param distancesOut if not 0, receives the distance to each neighbor, in the same order as neighborsOut
+     * @param resultOut
+     * @param pool the thread pool to use. If 0 QThreadPool::globalInstance() is used.
+     * @return
+     */
+    bool knnGraph(int k, QVector<qint64> * offsetsOut, QVector<quint32> * neighborsOut,
+                  QVector<qreal> * distancesOut = 0, QString * resultOut = 0, QThreadPool * pool = 0) const;
+
+    /**
+     * @brief nearestJoin finds, for every key of queries, the nearest key in this tree, measured with
+     * this tree's distance metric.
+     *
+     * Rather than searching this tree once per query key, it walks both trees at once. The keys of
+     * each are first copied into groups of nearby keys, each with the bounding box of its keys. A pair
+     * of a query group and a group of this tree is dropped as a whole once the distance between their
+     * boxes reaches the farthest nearest neighbor found so far for any key of the query group; pairs of
+     * small groups are compared key by key. Custom metrics without axis distances bound the distance
+     * between boxes by that between their nearest points, as their searches do for splitting planes.
+     * Groups of queries are spread over the idle threads of the pool, as with knnGraph(), and are
+     * split up the same way for any pool, so ties between equally near keys resolve the same way too.
+     * @param queries a tree of the same dimension. It may be this tree itself.
+     * @param nearestOut receives one entry per slot of queries: the slot in this tree of the key nearest
+     * to the key in that slot (see keyAt() and valueAt()), or 0xFFFFFFFF if that slot holds no key
+     * @param distancesOut if not 0, receives the matching distances, or -1 for slots that hold no key
+     * @param resultOut
+     * @param pool the thread pool to use. If 0 QThreadPool::globalInstance() is used.
+     * @return
+     */
+    bool nearestJoin(const QKDTree& queries, QVector<quint32> * nearestOut, QVector<qreal> * distancesOut = 0,
+                     QString * resultOut = 0, QThreadPool * pool = 0) const;
+
+    /**
+     * @brief withinDistance finds every node whose distance to center is at most radius. The radius
+     * is in the units of the distance metric (i.e., squared for the default metric).
+     * @param center
+     * @param radius
+     * @param output
+     * @param resultOut
+     * @return
+     */
+    bool withinDistance(const QVectorND& center, qreal radius, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+    bool withinDistance(const QPointF& center, qreal radius, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief withinDistance calls visitor for every key/value pair whose distance to center is at
+     * most radius, without building a list of results.
+     * @param center
+     * @param radius
+     * @param visitor
+     * @param resultOut
+     * @return
+     */
+    bool withinDistance(const QVectorND& center, qreal radius, QKDTreeVisitor * visitor, QString * resultOut = 0) const;
+
+    /**
+     * @brief rangeQuery finds every node inside the axis-aligned box spanning min to max (inclusive).
+     * @param min
+     * @param max
+     * @param output
+     * @param resultOut
+     * @return
+     */
+    bool rangeQuery(const QVectorND& min, const QVectorND& max, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+    bool rangeQuery(const QRectF& rect, QList<QKDTreeNode> * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief rangeQuery calls visitor for every key/value pair inside the axis-aligned box spanning
+     * min to max (inclusive), without building a list of results.
+     * @param min
+     * @param max
+     * @param visitor
+     * @param resultOut
+     * @return
+     */
+    bool rangeQuery(const QVectorND& min, const QVectorND& max, QKDTreeVisitor * visitor, QString * resultOut = 0) const;
+    bool rangeQuery(const QRectF& rect, QKDTreeVisitor * visitor, QString * resultOut = 0) const;
+
+    bool containsKey(const QVectorND& position) const;
+    bool containsKey(QKDTreeNode * node) const;
 
     /**
      * @brief value returns the value of the first node found with the given key
@@ -53,24 +346,210 @@ public:
      * @param resultOut
      * @return
      */
-    bool value(const QVectorND& positionKey, QVariant * output, QString * resultOut = 0);
-    bool value(const QPointF& positionKey, QVariant * output, QString * resultOut = 0);
+    bool value(const QVectorND& positionKey, QVariant * output, QString * resultOut = 0) const;
+    bool value(const QPointF& positionKey, QVariant * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief The const_iterator class walks every key/value pair of a tree in storage order, which reads
+     * the tree's arrays front to back without allocating anything. Dereferencing gives the value, as
+     * with QHash; key() gives the dimension() coordinates of the key. Any change to the tree
+     * invalidates its iterators.
+     */
+    class const_iterator
+    {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef qptrdiff difference_type;
+        typedef QVariant value_type;
+        typedef const QVariant * pointer;
+        typedef QVariant reference;
+
+        const_iterator() : _tree(0), _index(0)
+        {
+        }
+
+        quint32 index() const
+        {
+            return _index;
+        }
+
+        const qreal * key() const
+        {
+            return _tree->keyAt(_index);
+        }
+
+        QVariant value() const
+        {
+            return _tree->valueAt(_index);
+        }
+
+        QVariant operator*() const
+        {
+            return _tree->valueAt(_index);
+        }
+
+        bool operator==(const const_iterator& other) const
+        {
+            return _index == other._index && _tree == other._tree;
+        }
+
+        bool operator!=(const const_iterator& other) const
+        {
+            return !(*this == other);
+        }
+
+        const_iterator& operator++()
+        {
+            _index = _tree->nextLive(_index + 1);
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const const_iterator toRet = *this;
+            ++*this;
+            return toRet;
+        }
+
+    private:
+        friend class QKDTree;
+
+        const_iterator(const QKDTree * tree, quint32 index) : _tree(tree), _index(index)
+        {
+        }
+
+        const QKDTree * _tree;
+        quint32 _index;
+    };
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator constBegin() const;
+    const_iterator constEnd() const;
+
+    /**
+     * @brief forEach calls visitor for every key/value pair in the tree, depth-first from the root, so
+     * pairs that are near each other in space tend to come out near each other. The only memory it
+     * allocates is one position to pass to the visitor, plus a stack once the tree is more than 128
+     * levels deep.
+     * @param visitor
+     * @param resultOut
+     * @return
+     */
+    bool forEach(QKDTreeVisitor * visitor, QString * resultOut = 0) const;
 
     QKDTreeDistanceMetric * distanceMetric() const;
 
+    /**
+     * @brief setDistanceMetric replaces the distance metric used by queries. The old metric is
+     * deleted if the tree owned it. The built-in metrics of QKDTreeMetrics.h are inlined into the
+     * nearest neighbor searches; any other metric is called through its virtual methods.
+     * @param distanceMetric the new metric. If 0 euclidean distance squared is used.
+     * @param takeOwnership whether the tree should delete distanceMetric when it is done with it. Pass
+     * false to share one metric between several trees.
+     * @param resultOut
+     * @return false if distanceMetric can't measure positions of this tree's dimension, e.g. a
+     * QKDTreeWeightedEuclideanMetric without exactly one non-negative weight per dimension. The tree
+     * then keeps its current metric and does not take ownership of distanceMetric.
+     */
+    bool setDistanceMetric(QKDTreeDistanceMetric * distanceMetric, bool takeOwnership = true, QString * resultOut = 0);
+
     /**
      * @brief debugPrint does a breadth-first search of the tree, printing values as it goes.
      */
-    void debugPrint();
+    void debugPrint() const;
+
+private:
+    //QKDForest merges and searches its component trees directly
+    friend class QKDForest;
+    //QKDTreeNearestIterator keeps the state of its search and lets the tree advance it
+    friend class QKDTreeNearestIterator;
+
+    /*
+     * Nodes live in one contiguous array and refer to their children by index. The key of node i
+     * is stored at _coords[i * _dimension] through _coords[(i + 1) * _dimension - 1] and its value
+     * at _values[i]. Removed nodes stay in place as dead dividers until their subtree is rebuilt.
+     */
+    struct Node
+    {
+        quint32 left;
+        quint32 right;
+        qint32 dividingDimension;
+        quint32 size;
+        quint32 deadCount;
+        bool dead;
+    };
+
+    static const quint32 NO_NODE = 0xFFFFFFFF;
+
+    struct BuildRange;
+    class BatchNearestTask;
+    class SearchNodes;
+    struct SearchScratch;
+    struct JoinNodes;
+    class NearestJoin;
+    class NearestCandidates;
+    class NearestWithin;
+    class WithinDistance;
+    class BestBinCandidates;
+    class NearestStep;
+    struct Mapping;
+
+    static bool mappingIsConsistent(const Mapping& mapping, quint32 root, qint64 size, quint64 valuesLength,
+                                    int dimension);
+    void buildFromStorage(int threadCount);
+    void buildSubtree(quint32 * order, const BuildRange& whole);
+    bool removeMatching(const QVectorND& position, const QVariant * value, QString * resultOut);
+    void rebuildOnPath(const quint32 * path, int index);
+    void rebuildSubtree(quint32 subtreeRoot, quint32 parent, bool isLeft);
+    int splitRange(quint32 * order, const BuildRange& range, QThreadPool * pool, quint32 * scratch);
+
+    quint32 nearestWithin(const QVectorND& searchPos, qreal bound, qreal * distanceOut, qreal epsilon) const;
+    template <typename Metric>
+    quint32 nearestWithin(const Metric& metric, const QVectorND& searchPos, qreal bound, qreal * distanceOut,
+                          qreal epsilon) const;
+    void nearestCandidates(const QVectorND& searchPos, int k, qreal bound, QVector<QPair<qreal, quint32> > * output,
+                           qreal epsilon, SearchScratch * scratch = 0) const;
+    void bestBinCandidates(const QVectorND& searchPos, int k, int maxChecks,
+                           QVector<QPair<qreal, quint32> > * output) const;
+    template <typename Metric>
+    void bestBinCandidates(const Metric& metric, const QVectorND& searchPos, int k, int maxChecks,
+                           QVector<QPair<qreal, quint32> > * output) const;
+    bool nearestStep(const QVectorND& searchPos, QVector<QPair<qreal, quint64> > * queue, quint32 * indexOut,
+                     qreal * distanceOut) const;
+    template <typename Metric>
+    bool nearestStep(const Metric& metric, const QVectorND& searchPos, QVector<QPair<qreal, quint64> > * queue,
+                     quint32 * indexOut, qreal * distanceOut) const;
+    void nearestBatch(const QVector<QVectorND>& queries, QKDTreeNode * results, QAtomicInt * nextChunk,
+                      int chunkSize) const;
+    const Node& nodeAt(quint32 index) const;
+    quint32 slotCount() const;
+    quint32 nextLive(quint32 index) const;
+    void liveInOrder(QVector<quint32> * output) const;
+    const qreal * coordinates(quint32 index) const;
+    void loadPosition(quint32 index, QVectorND * output) const;
+    bool detachMapping(QString * resultOut);
 
 private:
     int _dimension;
     qint64 _size;
 
-    QKDTreeNode * _root;
+    QVector<Node> _nodes;
+    QVector<qreal> _coords;
+    QVector<QVariant> _values;
+    QVector<quint32> _freeNodes;
+    quint32 _root;
+
+    //Set while the arrays above are unused because the tree lives in a mapped file
+    Mapping * _mapping;
 
     bool _allowDuplicates;
+    qreal _balanceFactor;
     QKDTreeDistanceMetric * _distanceMetric;
+    bool _ownsDistanceMetric;
+
+    //Which built-in metric _distanceMetric is (a QKDTreeInternal::MetricKind), so searches can inline it
+    int _metricKind;
 };
 
 #endif // QKDTREE_H
@@ -8,17 +8,32 @@ QT += gui
 
 TARGET = QKDTree
 TEMPLATE = lib
+CONFIG += c++11
 
 DEFINES += QKDTREE_LIBRARY
 
 SOURCES += QKDTree.cpp \
     QKDTreeNode.cpp \
-    QKDTreeDistanceMetric.cpp
+    QKDTreeDistanceMetric.cpp \
+    QKDTreeVisitor.cpp \
+    QKDTreeNearestIterator.cpp \
+    QKDForest.cpp \
+    QKDForestIndex.cpp \
+    QKDSnapshotTree.cpp
 
 HEADERS += QKDTree.h\
         QKDTree_global.h \
     QKDTreeNode.h \
-    QKDTreeDistanceMetric.h
+    QKDTreeDistanceMetric.h \
+    QKDTreeVisitor.h \
+    QKDTreeNearestIterator.h \
+    QKDTreeT.h \
+    QKDTreeKernels.h \
+    QKDTreeMetrics.h \
+    QKDForest.h \
+    QKDForestIndex.h \
+    QKDSnapshotTree.h \
+    QKDTreeInternal.h
 
 unix:!symbian {
     maemo5 {
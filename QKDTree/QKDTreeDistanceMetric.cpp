@@ -1,8 +1,7 @@
 #include "QKDTreeDistanceMetric.h"
 
 #include <QtGlobal>
-#include <QtDebug>
-#include <cmath>
+#include <typeinfo>
 
 QKDTreeDistanceMetric::QKDTreeDistanceMetric()
 {
@@ -12,13 +11,32 @@ QKDTreeDistanceMetric::~QKDTreeDistanceMetric()
 {
 }
 
-qreal QKDTreeDistanceMetric::distance(const QKDTreeNode *const a, const QKDTreeNode *const b)
+qreal QKDTreeDistanceMetric::distance(const QKDTreeNode *const a, const QKDTreeNode *const b) const
 {
     return this->distance(a->position(), b->position());
 }
 
 //virtual - this one returns euclidean distance
-qreal QKDTreeDistanceMetric::distance(const QVectorND &a, const QVectorND &b)
+qreal QKDTreeDistanceMetric::distance(const QVectorND &a, const QVectorND &b) const
 {
     return (a - b).lengthSquared();
 }
+
+//virtual
+qreal QKDTreeDistanceMetric::axisDistance(int dimension, qreal delta) const
+{
+    Q_UNUSED(dimension)
+    return delta * delta;
+}
+
+//virtual
+qreal QKDTreeDistanceMetric::accumulate(qreal sum, qreal axisDistance) const
+{
+    return sum + axisDistance;
+}
+
+//virtual
+bool QKDTreeDistanceMetric::hasAxisDistance() const
+{
+    return typeid(*this) == typeid(QKDTreeDistanceMetric);
+}
@@ -15,17 +15,63 @@ public:
     QKDTreeDistanceMetric();
     virtual ~QKDTreeDistanceMetric();
 
-    qreal distance(const QKDTreeNode * const a, const QKDTreeNode * const b);
+    qreal distance(const QKDTreeNode * const a, const QKDTreeNode * const b) const;
 
     /**
      * @brief distance This method returns the distance between two positions in the tree.
      * To use a custom distance metric, create an inheriting class that overrides this method and
-     * pass the child class to your tree using QKDTree::setDistanceMetric
+     * pass the child class to your tree using QKDTree::setDistanceMetric.
+     * Queries may run on several threads at once (see QKDTree::nearestNodes), so implementations
+     * must not modify shared state.
      * @param a
      * @param b
      * @return
      */
-    virtual qreal distance(const QVectorND& a, const QVectorND& b);
+    virtual qreal distance(const QVectorND& a, const QVectorND& b) const;
+
+    /**
+     * @brief distance is the signature custom metrics overrode before queries became const. It is
+     * final so that such an override fails to compile rather than silently hiding the const distance()
+     * above and leaving the tree with euclidean distance. Make the override const instead.
+     * @param a
+     * @param b
+     * @return the const distance()
+     */
+    virtual qreal distance(const QVectorND& a, const QVectorND& b) final
+    {
+        return static_cast<const QKDTreeDistanceMetric *>(this)->distance(a, b);
+    }
+
+    /**
+     * @brief axisDistance returns the distance contributed by a single axis: a lower bound on the
+     * distance between any two positions whose coordinates in the given dimension differ by delta.
+     * The tree uses it to decide whether the far side of a splitting plane can be skipped, so it is
+     * only consulted when hasAxisDistance() returns true. This base implementation returns delta
+     * squared.
+     * @param dimension
+     * @param delta
+     * @return
+     */
+    virtual qreal axisDistance(int dimension, qreal delta) const;
+
+    /**
+     * @brief accumulate combines the distance over some axes with the axisDistance() of one more, such
+     * that folding every axis into 0.0 yields distance(). This base implementation adds them.
+     * @param sum
+     * @param axisDistance
+     * @return
+     */
+    virtual qreal accumulate(qreal sum, qreal axisDistance) const;
+
+    /**
+     * @brief hasAxisDistance returns true if axisDistance() and accumulate() describe this metric.
+     * It is true for this class itself and false for subclasses, since a subclass that only overrides
+     * distance() inherits bounds that don't fit it. Subclasses that override axisDistance() and
+     * accumulate() should override this to return true; the tree then never has to build a position
+     * just to measure the distance to a splitting plane.
+     * @return
+     */
+    virtual bool hasAxisDistance() const;
 };
 
 #endif // QKDTREEDISTANCEMETRIC_H
@@ -0,0 +1,741 @@
+#ifndef QKDTREEINTERNAL_H
+#define QKDTREEINTERNAL_H
+
+/*
+ * Shared by the library's own sources. Not part of the public interface, so don't include it from
+ * any of the public headers.
+ */
+
+#include "QKDTreeMetrics.h"
+#include "QKDTreeNode.h"
+#include "QKDTreeVisitor.h"
+#include "QVectorND.h"
+
+#include <QAtomicInt>
+#include <QList>
+#include <QPair>
+#include <QQueue>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QStack>
+#include <QString>
+#include <QThreadPool>
+#include <QVector>
+#include <QtGlobal>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <typeinfo>
+
+//Defined in QKDTree.cpp
+extern const QString ERR_STRING_BAD_DIM;
+extern const QString ERR_STRING_BAD_FOREST_DIM;
+extern const QString ERR_STRING_BAD_INDEX_DIM;
+extern const QString ERR_STRING_BAD_OUTPTR;
+extern const QString ERR_STRING_BAD_EPSILON;
+extern const QString ERR_STRING_BAD_NODE;
+extern const QString ERR_STRING_BAD_VISITOR;
+extern const QString ERR_STRING_BAD_TREE;
+
+//Collects visited key/value pairs into a list of nodes
+class QKDTreeNodeCollector : public QKDTreeVisitor
+{
+public:
+    QKDTreeNodeCollector(QList<QKDTreeNode> * output) : _output(output)
+    {
+    }
+
+    void visit(const QVectorND &position, const QVariant &value)
+    {
+        _output->append(QKDTreeNode(position, value));
+    }
+
+private:
+    QList<QKDTreeNode> * _output;
+};
+
+namespace QKDTreeInternal
+{
+//Orders point indices by a single coordinate, breaking ties by index so the order is total
+class CoordinateLess
+{
+public:
+    CoordinateLess(const qreal * coords, int dimension, int dim) :
+        _coords(coords), _dimension(dimension), _dim(dim)
+    {
+    }
+
+    bool operator()(quint32 a, quint32 b) const
+    {
+        const qreal valA = _coords[qint64(a) * _dimension + _dim];
+        const qreal valB = _coords[qint64(b) * _dimension + _dim];
+        if (valA != valB)
+            return valA < valB;
+        return a < b;
+    }
+
+private:
+    const qreal * _coords;
+    int _dimension;
+    int _dim;
+};
+
+//The gap between the intervals [minA, maxA] and [minB, maxB] along one axis, 0.0 if they overlap
+inline qreal intervalGap(qreal minA, qreal maxA, qreal minB, qreal maxB)
+{
+    if (maxA < minB)
+        return minB - maxA;
+    else if (maxB < minA)
+        return minA - maxB;
+    return 0.0;
+}
+
+//Lets the searches inline one of the built-in metric policies
+template <typename Policy>
+class PolicyMetric
+{
+public:
+    PolicyMetric(const Policy& policy, int dimension) : _policy(policy), _dimension(dimension)
+    {
+    }
+
+    qreal distance(const qreal * position, const QVectorND& searchPos) const
+    {
+        return QKDTreeMetrics::distance(_policy, position, searchPos.constData(), _dimension);
+    }
+
+    qreal planeDistance(const qreal * position, const QVectorND& searchPos, int divDim) const
+    {
+        return _policy.axisDistance(divDim, searchPos[divDim] - position[divDim]);
+    }
+
+    qreal keyDistance(const qreal * position, const qreal * searchPos) const
+    {
+        return QKDTreeMetrics::distance(_policy, position, searchPos, _dimension);
+    }
+
+    qreal boxDistance(const qreal * mins, const qreal * maxs, const qreal * searchMins, const qreal * searchMaxs) const
+    {
+        qreal toRet = 0.0;
+        for (int i = 0; i < _dimension; i++)
+            toRet = _policy.accumulate(toRet, _policy.axisDistance(i, intervalGap(mins[i], maxs[i], searchMins[i],
+                                                                                  searchMaxs[i])));
+        return toRet;
+    }
+
+private:
+    const Policy& _policy;
+    int _dimension;
+};
+
+//Calls any other metric through its virtual methods, copying keys into the caller's scratch vectors
+class VirtualMetric
+{
+public:
+    VirtualMetric(const QKDTreeDistanceMetric * metric, QVectorND * position, QVectorND * plane) :
+        _metric(metric), _position(position), _plane(plane), _hasAxisDistance(metric->hasAxisDistance())
+    {
+    }
+
+    qreal distance(const qreal * position, const QVectorND& searchPos) const
+    {
+        std::copy(position, position + _position->dimension(), _position->data());
+        return _metric->distance(*_position, searchPos);
+    }
+
+    qreal planeDistance(const qreal * position, const QVectorND& searchPos, int divDim) const
+    {
+        if (_hasAxisDistance)
+            return _metric->axisDistance(divDim, searchPos[divDim] - position[divDim]);
+
+        //Without a per-axis bound, measure from the key to the nearest point on the search position's side
+        std::copy(position, position + _position->dimension(), _position->data());
+        std::copy(position, position + _plane->dimension(), _plane->data());
+        (*_plane)[divDim] = searchPos[divDim];
+        return _metric->distance(*_plane, *_position);
+    }
+
+    qreal keyDistance(const qreal * position, const qreal * searchPos) const
+    {
+        std::copy(position, position + _position->dimension(), _position->data());
+        std::copy(searchPos, searchPos + _plane->dimension(), _plane->data());
+        return _metric->distance(*_position, *_plane);
+    }
+
+    qreal boxDistance(const qreal * mins, const qreal * maxs, const qreal * searchMins, const qreal * searchMaxs) const
+    {
+        const int dimension = _position->dimension();
+        if (_hasAxisDistance)
+        {
+            qreal toRet = 0.0;
+            for (int i = 0; i < dimension; i++)
+                toRet = _metric->accumulate(toRet, _metric->axisDistance(i, intervalGap(mins[i], maxs[i],
+                                                                                        searchMins[i], searchMaxs[i])));
+            return toRet;
+        }
+
+        //As with planeDistance, measure between the nearest two points of the boxes
+        for (int i = 0; i < dimension; i++)
+        {
+            (*_position)[i] = qBound(mins[i], searchMins[i], maxs[i]);
+            (*_plane)[i] = qBound(searchMins[i], (*_position)[i], searchMaxs[i]);
+        }
+        return _metric->distance(*_position, *_plane);
+    }
+
+private:
+    const QKDTreeDistanceMetric * _metric;
+    QVectorND * _position;
+    QVectorND * _plane;
+    bool _hasAxisDistance;
+};
+
+//The built-in metrics (see QKDTreeMetrics.h) that searches dispatch to statically
+enum MetricKind
+{
+    MetricCustom,
+    MetricSquaredEuclidean,
+    MetricManhattan,
+    MetricChebyshev,
+    MetricWeightedEuclidean
+};
+
+//Only the exact classes, since a subclass may have overridden distance()
+inline MetricKind metricKind(const QKDTreeDistanceMetric * metric)
+{
+    const std::type_info& type = typeid(*metric);
+    if (type == typeid(QKDTreeDistanceMetric) || type == typeid(QKDTreeSquaredEuclideanMetric))
+        return MetricSquaredEuclidean;
+    else if (type == typeid(QKDTreeManhattanMetric))
+        return MetricManhattan;
+    else if (type == typeid(QKDTreeChebyshevMetric))
+        return MetricChebyshev;
+    else if (type == typeid(QKDTreeWeightedEuclideanMetric))
+        return MetricWeightedEuclidean;
+    return MetricCustom;
+}
+
+/*
+ * Checks that metric can measure positions of the given dimension. Only the weighted metric has
+ * anything to check: it needs one non-negative weight per dimension.
+ */
+inline bool metricFits(const QKDTreeDistanceMetric * metric, int dimension, QString * resultOut)
+{
+    const QKDTreeWeightedEuclideanMetric * weighted = dynamic_cast<const QKDTreeWeightedEuclideanMetric *>(metric);
+    if (weighted == 0)
+        return true;
+
+    const QVector<qreal>& weights = weighted->policy().weights;
+    if (weights.size() != dimension)
+    {
+        if (resultOut)
+            *resultOut = "Need exactly one weight per dimension";
+        return false;
+    }
+    for (int i = 0; i < weights.size(); i++)
+    {
+        if (!(weights.at(i) >= 0.0))
+        {
+            if (resultOut)
+                *resultOut = "Weights must not be negative";
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * The metric a container constructed with metric should use: metric itself if it fits, otherwise a
+ * new default one. A metric that doesn't fit is deleted with a warning naming owner and the reason.
+ */
+inline QKDTreeDistanceMetric * metricOrDefault(QKDTreeDistanceMetric * metric, int dimension, const char * owner)
+{
+    QString reason;
+    if (metric && !metricFits(metric, dimension, &reason))
+    {
+        qWarning("%s: distance metric rejected (%s), using euclidean distance squared instead", owner,
+                 qPrintable(reason));
+        delete metric;
+        metric = 0;
+    }
+    if (metric == 0)
+        metric = new QKDTreeDistanceMetric();
+    return metric;
+}
+
+//Scratch vectors for VirtualMetric
+struct MetricScratch
+{
+    QVectorND position;
+    QVectorND plane;
+};
+
+/*
+ * This thread's MetricScratch, sized for dimension, so that searches which must not allocate per
+ * query can still run custom metrics. Only for searches that never call back into user code while
+ * the scratch is in use, since a nested search on the same thread would share it.
+ */
+inline MetricScratch * threadMetricScratch(int dimension)
+{
+    static thread_local MetricScratch scratch;
+    if (scratch.position.dimension() != dimension)
+    {
+        scratch.position = QVectorND(dimension);
+        scratch.plane = QVectorND(dimension);
+    }
+    return &scratch;
+}
+
+/*
+ * Calls func(adapter) with a PolicyMetric for the built-in metrics and a VirtualMetric for the rest.
+ * The VirtualMetric uses scratch if one is given, and vectors of its own otherwise.
+ */
+template <typename Func>
+void dispatchMetric(MetricKind kind, const QKDTreeDistanceMetric * metric, int dimension, const Func& func,
+                    MetricScratch * scratch = 0)
+{
+    switch (kind)
+    {
+    case MetricSquaredEuclidean:
+    {
+        const QKDTreeMetrics::SquaredEuclidean policy;
+        func(PolicyMetric<QKDTreeMetrics::SquaredEuclidean>(policy, dimension));
+        break;
+    }
+    case MetricManhattan:
+    {
+        const QKDTreeMetrics::Manhattan policy;
+        func(PolicyMetric<QKDTreeMetrics::Manhattan>(policy, dimension));
+        break;
+    }
+    case MetricChebyshev:
+    {
+        const QKDTreeMetrics::Chebyshev policy;
+        func(PolicyMetric<QKDTreeMetrics::Chebyshev>(policy, dimension));
+        break;
+    }
+    case MetricWeightedEuclidean:
+    {
+        const QKDTreeMetrics::WeightedEuclidean& policy =
+                static_cast<const QKDTreeWeightedEuclideanMetric *>(metric)->policy();
+        func(PolicyMetric<QKDTreeMetrics::WeightedEuclidean>(policy, dimension));
+        break;
+    }
+    default:
+    {
+        if (scratch)
+        {
+            func(VirtualMetric(metric, &scratch->position, &scratch->plane));
+            break;
+        }
+        QVectorND position(dimension);
+        QVectorND plane(dimension);
+        func(VirtualMetric(metric, &position, &plane));
+        break;
+    }
+    }
+}
+
+//Ranges smaller than this are not worth splitting across threads
+const int PARALLEL_MIN = 1 << 15;
+
+//Runs func(i) for each i claimed from a shared counter until all count calls have been made
+template <typename Func>
+class ParallelForTask : public QRunnable
+{
+public:
+    ParallelForTask(const Func * func, int count, QAtomicInt * next, QSemaphore * finished) :
+        _func(func), _count(count), _next(next), _finished(finished)
+    {
+    }
+
+    static void work(const Func& func, int count, QAtomicInt * next)
+    {
+        while (true)
+        {
+            const int i = next->fetchAndAddRelaxed(1);
+            if (i >= count)
+                break;
+            func(i);
+        }
+    }
+
+    void run()
+    {
+        ParallelForTask::work(*_func, _count, _next);
+        _finished->release();
+    }
+
+private:
+    const Func * _func;
+    int _count;
+    QAtomicInt * _next;
+    QSemaphore * _finished;
+};
+
+//Calls func(0) through func(count - 1) on the pool's threads and this one. Serial if pool is 0.
+template <typename Func>
+void parallelFor(QThreadPool * pool, int count, const Func& func)
+{
+    if (pool == 0 || count <= 1)
+    {
+        for (int i = 0; i < count; i++)
+            func(i);
+        return;
+    }
+
+    QAtomicInt next(0);
+    QSemaphore finished;
+    const int helpers = qMin(count - 1, pool->maxThreadCount());
+    for (int i = 0; i < helpers; i++)
+        pool->start(new ParallelForTask<Func>(&func, count, &next, &finished));
+
+    ParallelForTask<Func>::work(func, count, &next);
+    finished.acquire(helpers);
+}
+
+//Like parallelFor, but only takes threads that are free right now, so it can't deadlock when called from a pool thread
+template <typename Func>
+void parallelForIdle(QThreadPool * pool, int count, const Func& func)
+{
+    QAtomicInt next(0);
+    QSemaphore finished;
+    int started = 0;
+    const int wanted = qMin(count, pool->maxThreadCount()) - 1;
+    for (int i = 0; i < wanted; i++)
+    {
+        ParallelForTask<Func> * task = new ParallelForTask<Func>(&func, count, &next, &finished);
+        if (!pool->tryStart(task))
+        {
+            delete task;
+            break;
+        }
+        started++;
+    }
+
+    ParallelForTask<Func>::work(func, count, &next);
+    finished.acquire(started);
+}
+
+/*
+ * Partitions [begin, end) so that the elements satisfying pred come first and returns the end of
+ * that group. Each thread counts and then scatters one block through scratch, so the relative order
+ * within each group is kept.
+ */
+template <typename Pred>
+quint32 * parallelPartition(QThreadPool * pool, quint32 * begin, quint32 * end, const Pred& pred, quint32 * scratch)
+{
+    const int count = end - begin;
+    if (pool == 0 || count < PARALLEL_MIN)
+        return std::partition(begin, end, pred);
+
+    const int blocks = pool->maxThreadCount() + 1;
+    QVector<int> trueCounts(blocks);
+    parallelFor(pool, blocks, [&](int b) {
+        int trues = 0;
+        for (quint32 * it = begin + qint64(count) * b / blocks; it != begin + qint64(count) * (b + 1) / blocks; it++)
+            trues += pred(*it) ? 1 : 0;
+        trueCounts[b] = trues;
+    });
+
+    int totalTrue = 0;
+    for (int b = 0; b < blocks; b++)
+        totalTrue += trueCounts[b];
+
+    parallelFor(pool, blocks, [&](int b) {
+        const int blockBegin = qint64(count) * b / blocks;
+        const int blockEnd = qint64(count) * (b + 1) / blocks;
+        int trueOut = 0;
+        for (int i = 0; i < b; i++)
+            trueOut += trueCounts[i];
+        int falseOut = totalTrue + blockBegin - trueOut;
+
+        for (int i = blockBegin; i < blockEnd; i++)
+        {
+            if (pred(begin[i]))
+                scratch[trueOut++] = begin[i];
+            else
+                scratch[falseOut++] = begin[i];
+        }
+    });
+
+    parallelFor(pool, blocks, [&](int b) {
+        std::copy(scratch + qint64(count) * b / blocks, scratch + qint64(count) * (b + 1) / blocks,
+                  begin + qint64(count) * b / blocks);
+    });
+
+    return begin + totalTrue;
+}
+
+/*
+ * Like std::nth_element: afterwards everything before nth is less than it and everything after is
+ * greater. Large ranges are narrowed down by quickselect with parallel partitions first. less must be
+ * a total order, so the element that ends up at nth does not depend on how we got there.
+ */
+template <typename Less>
+void parallelSelect(QThreadPool * pool, quint32 * begin, quint32 * nth, quint32 * end, const Less& less,
+                    quint32 * scratch)
+{
+    while (pool != 0 && end - begin >= PARALLEL_MIN)
+    {
+        //Median of three as the pivot, parked at the front while we partition the rest
+        quint32 * a = begin;
+        quint32 * b = begin + (end - begin) / 2;
+        quint32 * c = end - 1;
+        if (less(*b, *a))
+            std::swap(a, b);
+        if (less(*c, *b))
+            b = less(*c, *a) ? a : c;
+        std::swap(*begin, *b);
+
+        const quint32 pivotIndex = *begin;
+        quint32 * split = parallelPartition(pool, begin + 1, end, [&](quint32 x) { return less(x, pivotIndex); },
+                                            scratch);
+        quint32 * const pivot = split - 1;
+        std::swap(*begin, *pivot);
+
+        if (pivot == nth)
+            return;
+        else if (nth < pivot)
+            end = pivot;
+        else
+            begin = pivot + 1;
+    }
+    std::nth_element(begin, nth, end, less);
+}
+
+/*
+ * Sorts with the pool's threads: each block is sorted on its own, then neighbouring blocks are
+ * merged pairwise through scratch until one run is left.
+ */
+template <typename Less>
+void parallelSort(QThreadPool * pool, quint32 * begin, quint32 * end, const Less& less, quint32 * scratch)
+{
+    const int count = end - begin;
+    if (pool == 0 || count < PARALLEL_MIN)
+    {
+        std::sort(begin, end, less);
+        return;
+    }
+
+    const int blocks = pool->maxThreadCount() + 1;
+    parallelFor(pool, blocks, [&](int b) {
+        std::sort(begin + qint64(count) * b / blocks, begin + qint64(count) * (b + 1) / blocks, less);
+    });
+
+    quint32 * from = begin;
+    quint32 * to = scratch;
+    for (int width = 1; width < blocks; width *= 2)
+    {
+        const int pairs = (blocks + 2 * width - 1) / (2 * width);
+        parallelFor(pool, pairs, [&](int p) {
+            const int first = qint64(count) * (2 * p * width) / blocks;
+            const int middle = qint64(count) * qMin(blocks, (2 * p + 1) * width) / blocks;
+            const int last = qint64(count) * qMin(blocks, (2 * p + 2) * width) / blocks;
+            std::merge(from + first, from + middle, from + middle, from + last, to + first, less);
+        });
+        std::swap(from, to);
+    }
+
+    if (from != begin)
+        std::copy(from, from + count, begin);
+}
+
+/*
+ * Picks the dividing key of [begin, end) along divDim and returns where it ended up. It is the
+ * median, except that everything equal to the median along divDim has to go left of it, or lookups
+ * that descend left on <= will miss it: the ties are gathered right after the median and the last of
+ * them (in index order) divides. coords holds dimension coordinates per index. Serial if pool is 0.
+ */
+inline quint32 * splitAtMedian(QThreadPool * pool, const qreal * coords, int dimension, int divDim, quint32 * begin,
+                               quint32 * end, quint32 * scratch)
+{
+    quint32 * const mid = begin + (end - begin) / 2;
+    parallelSelect(pool, begin, mid, end, CoordinateLess(coords, dimension, divDim), scratch);
+
+    const qreal medianVal = coords[qint64(*mid) * dimension + divDim];
+    quint32 * const tiesEnd = parallelPartition(pool, mid + 1, end, [=](quint32 index) {
+        return coords[qint64(index) * dimension + divDim] == medianVal;
+    }, scratch);
+    std::swap(*std::max_element(mid, tiesEnd), *(tiesEnd - 1));
+    return tiesEnd - 1;
+}
+
+/*
+ * The searches below walk any binary kd-tree through a Nodes adapter, which has to provide
+ *
+ *   typedef ... Index;
+ *   Index root() const;
+ *   bool isNull(Index node) const;
+ *   const qreal * coordinates(Index node) const;
+ *   int dividingDimension(Index node) const;
+ *   bool isDead(Index node) const;
+ *   Index left(Index node) const;
+ *   Index right(Index node) const;
+ *
+ * Keys equal to a node's along its dividing dimension are in its left subtree.
+ */
+
+//Buffers that one thread can carry from one nearestCandidates() call to the next
+template <typename Index>
+struct SearchScratch
+{
+    QQueue<Index> descend;
+    QStack<Index> unwindChecks;
+
+    //The results of the previous search, which give the next one a bound before it has looked at anything
+    QVector<Index> previous;
+};
+
+/*
+ * Collects up to k live nodes nearer than bound to searchPos into output, sorted nearest first.
+ * With a positive epsilon the search is approximate, as documented for QKDTree::nearestNode().
+ *
+ * scratch may be 0. Searches that pass the same scratch reuse its buffers, and each one starts out
+ * bounded by how far the previous search's results are from it, which prunes most of the tree right
+ * away when consecutive searches are close together.
+ */
+template <typename Nodes, typename Metric>
+void nearestCandidates(const Nodes& nodes, const Metric& metric, const QVectorND& searchPos, int k, qreal bound,
+                       qreal epsilon, QVector<QPair<qreal, typename Nodes::Index> > * output,
+                       SearchScratch<typename Nodes::Index> * scratch)
+{
+    typedef typename Nodes::Index Index;
+    const qreal * search = searchPos.constData();
+
+    SearchScratch<Index> local;
+    SearchScratch<Index>& buffers = scratch ? *scratch : local;
+    QQueue<Index>& descend = buffers.descend;
+    QStack<Index>& unwindChecks = buffers.unwindChecks;
+
+    //Any k live keys are together at least as far away as the k nearest, so the last results bound these
+    if (buffers.previous.size() >= k)
+    {
+        qreal previousBound = 0.0;
+        for (int i = 0; i < buffers.previous.size(); i++)
+            previousBound = qMax(previousBound, metric.distance(nodes.coordinates(buffers.previous.at(i)), searchPos));
+        bound = qMin(bound, std::nextafter(previousBound, std::numeric_limits<qreal>::max()));
+    }
+
+    if (!nodes.isNull(nodes.root()))
+        descend.enqueue(nodes.root());
+
+    //Approximate searches only look past a plane that is a good deal nearer than the k-th best
+    const qreal shrink = 1.0 / ((1.0 + epsilon) * (1.0 + epsilon));
+
+    //Max-heap of the k best so far, so the worst of them is always at the front
+    QVector<QPair<qreal, Index> >& best = *output;
+    best.clear();
+    best.reserve(k);
+
+    while (!descend.isEmpty() || !unwindChecks.isEmpty())
+    {
+        if (!descend.isEmpty())
+        {
+            const Index current = descend.dequeue();
+            unwindChecks.push(current);
+
+            const int divDim = nodes.dividingDimension(current);
+            const Index next = (search[divDim] <= nodes.coordinates(current)[divDim]) ? nodes.left(current)
+                                                                                     : nodes.right(current);
+            if (!nodes.isNull(next))
+                descend.enqueue(next);
+        }
+        else
+        {
+            //Every node is checked exactly once, on the way back up
+            const Index current = unwindChecks.pop();
+            const int divDim = nodes.dividingDimension(current);
+            const qreal * pos = nodes.coordinates(current);
+            const bool dead = nodes.isDead(current);
+            const qreal dist = dead ? 0.0 : metric.distance(pos, searchPos);
+            if (dead)
+            {
+                //Removed nodes still divide space, but can't be results
+            }
+            else if (dist >= bound)
+            {
+                //Can't beat what the caller already has
+            }
+            else if (best.size() < k)
+            {
+                best.append(qMakePair(dist, current));
+                std::push_heap(best.begin(), best.end());
+            }
+            else if (dist < best.first().first)
+            {
+                std::pop_heap(best.begin(), best.end());
+                best.last() = qMakePair(dist, current);
+                std::push_heap(best.begin(), best.end());
+            }
+
+            //Until we have k candidates every branch within bound could hold one of them
+            const qreal threshold = (best.size() == k) ? best.first().first * shrink : bound;
+            if (metric.planeDistance(pos, searchPos, divDim) > threshold)
+                continue;
+
+            //Search the other side of the dividing node
+            const Index other = (search[divDim] <= pos[divDim]) ? nodes.right(current) : nodes.left(current);
+            if (!nodes.isNull(other))
+                descend.enqueue(other);
+        }
+    }
+
+    std::sort_heap(best.begin(), best.end());
+
+    if (scratch)
+    {
+        buffers.previous.resize(best.size());
+        for (int i = 0; i < best.size(); i++)
+            buffers.previous[i] = best.at(i).second;
+    }
+}
+
+//Calls visit(node) for every live node within radius of center
+template <typename Nodes, typename Metric, typename Visit>
+void withinDistance(const Nodes& nodes, const Metric& metric, const QVectorND& center, qreal radius,
+                    const Visit& visit)
+{
+    typedef typename Nodes::Index Index;
+    const qreal * search = center.constData();
+
+    QQueue<Index> descend;
+    QStack<Index> unwindChecks;
+
+    if (!nodes.isNull(nodes.root()))
+        descend.enqueue(nodes.root());
+
+    while (!descend.isEmpty() || !unwindChecks.isEmpty())
+    {
+        if (!descend.isEmpty())
+        {
+            const Index current = descend.dequeue();
+            unwindChecks.push(current);
+
+            const int divDim = nodes.dividingDimension(current);
+            const Index next = (search[divDim] <= nodes.coordinates(current)[divDim]) ? nodes.left(current)
+                                                                                     : nodes.right(current);
+            if (!nodes.isNull(next))
+                descend.enqueue(next);
+        }
+        else
+        {
+            const Index current = unwindChecks.pop();
+            const int divDim = nodes.dividingDimension(current);
+            const qreal * pos = nodes.coordinates(current);
+            if (!nodes.isDead(current) && metric.distance(pos, center) <= radius)
+                visit(current);
+
+            //The far side can only hold matches if the dividing hyperplane is within radius
+            if (metric.planeDistance(pos, center, divDim) > radius)
+                continue;
+
+            const Index other = (search[divDim] <= pos[divDim]) ? nodes.right(current) : nodes.left(current);
+            if (!nodes.isNull(other))
+                descend.enqueue(other);
+        }
+    }
+}
+}
+
+#endif // QKDTREEINTERNAL_H
@@ -0,0 +1,220 @@
+#ifndef QKDTREEKERNELS_H
+#define QKDTREEKERNELS_H
+
+#include <QtGlobal>
+
+#if !defined(QKDTREE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#  define QKDTREE_USE_SSE2
+#  include <emmintrin.h>
+#  if defined(__AVX__)
+#    define QKDTREE_USE_AVX
+#    include <immintrin.h>
+#  endif
+#endif
+
+/*
+ * Brute-force kernels used by QKDTreeT to scan a leaf bucket. Buckets store their coordinates
+ * structure-of-arrays: coordinate d of slot j lives at soa[d * stride + j]. stride must be a multiple
+ * of QKDTreeKernels::LANES and the output arrays must have room for stride entries, because the SIMD
+ * paths work on whole registers and may compute (and write) garbage past count.
+ *
+ * Define QKDTREE_NO_SIMD to force the portable scalar versions.
+ */
+namespace QKDTreeKernels
+{
+const int LANES = 8;
+
+/**
+ * @brief squaredDistances writes the squared euclidean distance from query to each of the first
+ * count slots of a bucket into out.
+ */
+template <int Dim, typename Scalar>
+inline void squaredDistances(const Scalar * soa, int stride, int count, const Scalar * query, qreal * out)
+{
+    Q_UNUSED(stride)
+    for (int j = 0; j < count; j++)
+        out[j] = 0.0;
+
+    for (int d = 0; d < Dim; d++)
+    {
+        const Scalar * coords = soa + d * stride;
+        const qreal q = query[d];
+        for (int j = 0; j < count; j++)
+        {
+            const qreal delta = qreal(coords[j]) - q;
+            out[j] += delta * delta;
+        }
+    }
+}
+
+template <int Dim>
+inline void squaredDistances(const double * soa, int stride, int count, const double * query, double * out)
+{
+#if defined(QKDTREE_USE_AVX)
+    for (int j = 0; j < count; j += 4)
+    {
+        __m256d acc = _mm256_setzero_pd();
+        for (int d = 0; d < Dim; d++)
+        {
+            const __m256d delta = _mm256_sub_pd(_mm256_loadu_pd(soa + d * stride + j), _mm256_set1_pd(query[d]));
+            acc = _mm256_add_pd(acc, _mm256_mul_pd(delta, delta));
+        }
+        _mm256_storeu_pd(out + j, acc);
+    }
+#elif defined(QKDTREE_USE_SSE2)
+    for (int j = 0; j < count; j += 2)
+    {
+        __m128d acc = _mm_setzero_pd();
+        for (int d = 0; d < Dim; d++)
+        {
+            const __m128d delta = _mm_sub_pd(_mm_loadu_pd(soa + d * stride + j), _mm_set1_pd(query[d]));
+            acc = _mm_add_pd(acc, _mm_mul_pd(delta, delta));
+        }
+        _mm_storeu_pd(out + j, acc);
+    }
+#else
+    squaredDistances<Dim, double>(soa, stride, count, query, out);
+#endif
+}
+
+/*
+ * Keys stored as float are widened to double before they are subtracted, so distances come out exactly
+ * as QKDTreeT::distance() computes them. Only the loads are single precision, which halves the memory
+ * traffic of a scan.
+ */
+template <int Dim>
+inline void squaredDistances(const float * soa, int stride, int count, const float * query, double * out)
+{
+#if defined(QKDTREE_USE_AVX)
+    for (int j = 0; j < count; j += 8)
+    {
+        __m256d accLow = _mm256_setzero_pd();
+        __m256d accHigh = _mm256_setzero_pd();
+        for (int d = 0; d < Dim; d++)
+        {
+            const float * coords = soa + d * stride + j;
+            const __m256d q = _mm256_set1_pd(query[d]);
+            const __m256d deltaLow = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(coords)), q);
+            const __m256d deltaHigh = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(coords + 4)), q);
+            accLow = _mm256_add_pd(accLow, _mm256_mul_pd(deltaLow, deltaLow));
+            accHigh = _mm256_add_pd(accHigh, _mm256_mul_pd(deltaHigh, deltaHigh));
+        }
+        _mm256_storeu_pd(out + j, accLow);
+        _mm256_storeu_pd(out + j + 4, accHigh);
+    }
+#elif defined(QKDTREE_USE_SSE2)
+    for (int j = 0; j < count; j += 4)
+    {
+        __m128d accLow = _mm_setzero_pd();
+        __m128d accHigh = _mm_setzero_pd();
+        for (int d = 0; d < Dim; d++)
+        {
+            const __m128 coords = _mm_loadu_ps(soa + d * stride + j);
+            const __m128d q = _mm_set1_pd(query[d]);
+            const __m128d deltaLow = _mm_sub_pd(_mm_cvtps_pd(coords), q);
+            const __m128d deltaHigh = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(coords, coords)), q);
+            accLow = _mm_add_pd(accLow, _mm_mul_pd(deltaLow, deltaLow));
+            accHigh = _mm_add_pd(accHigh, _mm_mul_pd(deltaHigh, deltaHigh));
+        }
+        _mm_storeu_pd(out + j, accLow);
+        _mm_storeu_pd(out + j + 2, accHigh);
+    }
+#else
+    squaredDistances<Dim, float>(soa, stride, count, query, out);
+#endif
+}
+
+/**
+ * @brief insideBox sets out[j] to 1 if slot j lies within [min, max] (inclusive) and 0 otherwise,
+ * for each of the first count slots of a bucket.
+ */
+template <int Dim, typename Scalar>
+inline void insideBox(const Scalar * soa, int stride, int count, const Scalar * min, const Scalar * max, quint8 * out)
+{
+    Q_UNUSED(stride)
+    for (int j = 0; j < count; j++)
+        out[j] = 1;
+
+    for (int d = 0; d < Dim; d++)
+    {
+        const Scalar * coords = soa + d * stride;
+        for (int j = 0; j < count; j++)
+            out[j] &= quint8(coords[j] >= min[d] && coords[j] <= max[d]);
+    }
+}
+
+template <int Dim>
+inline void insideBox(const double * soa, int stride, int count, const double * min, const double * max, quint8 * out)
+{
+#if defined(QKDTREE_USE_AVX)
+    for (int j = 0; j < count; j += 4)
+    {
+        __m256d mask = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        for (int d = 0; d < Dim; d++)
+        {
+            const __m256d coords = _mm256_loadu_pd(soa + d * stride + j);
+            mask = _mm256_and_pd(mask, _mm256_cmp_pd(coords, _mm256_set1_pd(min[d]), _CMP_GE_OQ));
+            mask = _mm256_and_pd(mask, _mm256_cmp_pd(coords, _mm256_set1_pd(max[d]), _CMP_LE_OQ));
+        }
+        const int bits = _mm256_movemask_pd(mask);
+        for (int lane = 0; lane < 4; lane++)
+            out[j + lane] = quint8((bits >> lane) & 1);
+    }
+#elif defined(QKDTREE_USE_SSE2)
+    for (int j = 0; j < count; j += 2)
+    {
+        __m128d mask = _mm_castsi128_pd(_mm_set1_epi32(-1));
+        for (int d = 0; d < Dim; d++)
+        {
+            const __m128d coords = _mm_loadu_pd(soa + d * stride + j);
+            mask = _mm_and_pd(mask, _mm_cmpge_pd(coords, _mm_set1_pd(min[d])));
+            mask = _mm_and_pd(mask, _mm_cmple_pd(coords, _mm_set1_pd(max[d])));
+        }
+        const int bits = _mm_movemask_pd(mask);
+        out[j] = quint8(bits & 1);
+        out[j + 1] = quint8((bits >> 1) & 1);
+    }
+#else
+    insideBox<Dim, double>(soa, stride, count, min, max, out);
+#endif
+}
+
+//Comparisons are exact in any precision, so float keys are tested twice as many at a time
+template <int Dim>
+inline void insideBox(const float * soa, int stride, int count, const float * min, const float * max, quint8 * out)
+{
+#if defined(QKDTREE_USE_AVX)
+    for (int j = 0; j < count; j += 8)
+    {
+        __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int d = 0; d < Dim; d++)
+        {
+            const __m256 coords = _mm256_loadu_ps(soa + d * stride + j);
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(coords, _mm256_set1_ps(min[d]), _CMP_GE_OQ));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(coords, _mm256_set1_ps(max[d]), _CMP_LE_OQ));
+        }
+        const int bits = _mm256_movemask_ps(mask);
+        for (int lane = 0; lane < 8; lane++)
+            out[j + lane] = quint8((bits >> lane) & 1);
+    }
+#elif defined(QKDTREE_USE_SSE2)
+    for (int j = 0; j < count; j += 4)
+    {
+        __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int d = 0; d < Dim; d++)
+        {
+            const __m128 coords = _mm_loadu_ps(soa + d * stride + j);
+            mask = _mm_and_ps(mask, _mm_cmpge_ps(coords, _mm_set1_ps(min[d])));
+            mask = _mm_and_ps(mask, _mm_cmple_ps(coords, _mm_set1_ps(max[d])));
+        }
+        const int bits = _mm_movemask_ps(mask);
+        for (int lane = 0; lane < 4; lane++)
+            out[j + lane] = quint8((bits >> lane) & 1);
+    }
+#else
+    insideBox<Dim, float>(soa, stride, count, min, max, out);
+#endif
+}
+}
+
+#endif // QKDTREEKERNELS_H
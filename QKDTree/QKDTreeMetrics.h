@@ -0,0 +1,159 @@
+#ifndef QKDTREEMETRICS_H
+#define QKDTREEMETRICS_H
+
+#include "QKDTreeDistanceMetric.h"
+
+#include <QVector>
+#include <QtGlobal>
+
+/*
+ * Built-in distance metrics, written as policies that QKDTree can inline into its searches instead
+ * of calling a virtual method for every node it visits. A policy has two methods:
+ *
+ *   qreal axisDistance(int dimension, qreal delta) const;
+ *   qreal accumulate(qreal sum, qreal axisDistance) const;
+ *
+ * The distance between two positions is every axis's axisDistance() folded together with
+ * accumulate(), starting from 0.0, and axisDistance() alone is the distance to a splitting plane.
+ *
+ * To use one with a tree, pass the matching QKDTreePolicyMetric (e.g. new QKDTreeManhattanMetric())
+ * to QKDTree::setDistanceMetric.
+ */
+namespace QKDTreeMetrics
+{
+/**
+ * @brief The SquaredEuclidean struct is the default metric, the sum of squared differences.
+ */
+struct SquaredEuclidean
+{
+    qreal axisDistance(int dimension, qreal delta) const
+    {
+        Q_UNUSED(dimension)
+        return delta * delta;
+    }
+
+    qreal accumulate(qreal sum, qreal axisDistance) const
+    {
+        return sum + axisDistance;
+    }
+};
+
+/**
+ * @brief The Manhattan struct is the sum of absolute differences.
+ */
+struct Manhattan
+{
+    qreal axisDistance(int dimension, qreal delta) const
+    {
+        Q_UNUSED(dimension)
+        return qAbs(delta);
+    }
+
+    qreal accumulate(qreal sum, qreal axisDistance) const
+    {
+        return sum + axisDistance;
+    }
+};
+
+/**
+ * @brief The Chebyshev struct is the largest absolute difference along any one axis.
+ */
+struct Chebyshev
+{
+    qreal axisDistance(int dimension, qreal delta) const
+    {
+        Q_UNUSED(dimension)
+        return qAbs(delta);
+    }
+
+    qreal accumulate(qreal sum, qreal axisDistance) const
+    {
+        return qMax(sum, axisDistance);
+    }
+};
+
+/**
+ * @brief The WeightedEuclidean struct is the sum of squared differences, each scaled by the weight of
+ * its axis. There must be one non-negative weight per dimension of the tree; the trees check that when
+ * they are given the metric.
+ */
+struct WeightedEuclidean
+{
+    explicit WeightedEuclidean(const QVector<qreal>& weights) : weights(weights)
+    {
+    }
+
+    qreal axisDistance(int dimension, qreal delta) const
+    {
+        return weights.at(dimension) * delta * delta;
+    }
+
+    qreal accumulate(qreal sum, qreal axisDistance) const
+    {
+        return sum + axisDistance;
+    }
+
+    QVector<qreal> weights;
+};
+
+/**
+ * @brief distance folds the axis distances between a and b, both dimension coordinates long.
+ */
+template <typename Policy>
+inline qreal distance(const Policy& policy, const qreal * a, const qreal * b, int dimension)
+{
+    qreal toRet = 0.0;
+    for (int i = 0; i < dimension; i++)
+        toRet = policy.accumulate(toRet, policy.axisDistance(i, a[i] - b[i]));
+    return toRet;
+}
+}
+
+/**
+ * @brief The QKDTreePolicyMetric class wraps one of the policies in QKDTreeMetrics so it can be handed
+ * to a tree like any other QKDTreeDistanceMetric. QKDTree recognizes the built-in ones and searches
+ * with the policy directly; everything else sees an ordinary virtual metric.
+ */
+template <typename Policy>
+class QKDTreePolicyMetric : public QKDTreeDistanceMetric
+{
+public:
+    QKDTreePolicyMetric(const Policy& policy = Policy()) : _policy(policy)
+    {
+    }
+
+    const Policy& policy() const
+    {
+        return _policy;
+    }
+
+    qreal distance(const QVectorND& a, const QVectorND& b) const
+    {
+        return QKDTreeMetrics::distance(_policy, a.constData(), b.constData(), a.dimension());
+    }
+
+    qreal axisDistance(int dimension, qreal delta) const
+    {
+        return _policy.axisDistance(dimension, delta);
+    }
+
+    qreal accumulate(qreal sum, qreal axisDistance) const
+    {
+        return _policy.accumulate(sum, axisDistance);
+    }
+
+    bool hasAxisDistance() const
+    {
+        return true;
+    }
+
+private:
+    Policy _policy;
+};
+
+typedef QKDTreePolicyMetric<QKDTreeMetrics::SquaredEuclidean> QKDTreeSquaredEuclideanMetric;
+typedef QKDTreePolicyMetric<QKDTreeMetrics::Manhattan> QKDTreeManhattanMetric;
+typedef QKDTreePolicyMetric<QKDTreeMetrics::Chebyshev> QKDTreeChebyshevMetric;
+typedef QKDTreePolicyMetric<QKDTreeMetrics::WeightedEuclidean> QKDTreeWeightedEuclideanMetric;
+
+#endif // QKDTREEMETRICS_H
@@ -0,0 +1,64 @@
+#include "QKDTreeNearestIterator.h"
+
+#include "QKDTree.h"
+#include "QKDTreeInternal.h"
+
+QKDTreeNearestIterator::QKDTreeNearestIterator(const QKDTree *tree, const QVectorND &position) :
+    _tree(tree), _position(position), _count(0)
+{
+    if (_tree && _tree->_root != QKDTree::NO_NODE && position.dimension() == _tree->dimension())
+        _queue.append(qMakePair(qreal(0.0), quint64(_tree->_root) << 1));
+}
+
+bool QKDTreeNearestIterator::next(QKDTreeNode *output, qreal *distanceOut, QString *resultOut)
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+
+    quint32 index;
+    if (!this->nextIndex(&index, distanceOut, resultOut))
+        return false;
+
+    *output = QKDTreeNode(QVectorND(_tree->keyAt(index), _tree->dimension()), _tree->valueAt(index));
+    return true;
+}
+
+bool QKDTreeNearestIterator::nextIndex(quint32 *indexOut, qreal *distanceOut, QString *resultOut)
+{
+    if (indexOut == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_OUTPTR;
+        return false;
+    }
+    else if (_tree == 0)
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_TREE;
+        return false;
+    }
+    else if (_position.dimension() != _tree->dimension())
+    {
+        if (resultOut)
+            *resultOut = ERR_STRING_BAD_DIM;
+        return false;
+    }
+    else if (!_tree->nearestStep(_position, &_queue, indexOut, distanceOut))
+    {
+        if (resultOut)
+            *resultOut = "No more nodes";
+        return false;
+    }
+
+    _count++;
+    return true;
+}
+
+qint64 QKDTreeNearestIterator::count() const
+{
+    return _count;
+}
@@ -0,0 +1,75 @@
+#ifndef QKDTREENEARESTITERATOR_H
+#define QKDTREENEARESTITERATOR_H
+
+#include "QKDTree_global.h"
+
+#include "QKDTreeNode.h"
+#include "QVectorND.h"
+
+#include <QPair>
+#include <QVector>
+
+class QKDTree;
+
+/**
+ * @brief The QKDTreeNearestIterator class hands out the key/value pairs of a QKDTree one at a time,
+ * nearest to a search position first. It is for callers that can't say up front how many neighbors
+ * they need, e.g. because they skip the ones that fail some filter.
+ *
+ * It runs an incremental nearest neighbor search (Hjaltason and Samet). One priority queue holds both
+ * subtrees, keyed on a lower bound of the distance to anything in them, and keys, keyed on their exact
+ * distance. A key is handed out as soon as it reaches the front of the queue, since nothing behind it
+ * can be nearer. Each call to next() only expands as much of the tree as it takes to settle one more
+ * key, so the work done grows with the number of neighbors consumed rather than with a k picked in
+ * advance.
+ *
+ * Distances are measured with the tree's distance metric. The tree must outlive the iterator and must
+ * not be changed while the iterator is in use.
+ */
+class QKDTREESHARED_EXPORT QKDTreeNearestIterator
+{
+public:
+    /**
+     * @brief QKDTreeNearestIterator constructs an iterator over the pairs of tree, from nearest to
+     * farthest from position. Nothing is searched until the first call to next().
+     * @param tree
+     * @param position
+     */
+    QKDTreeNearestIterator(const QKDTree * tree, const QVectorND& position);
+
+    /**
+     * @brief next finds the nearest key/value pair that hasn't been handed out yet.
+     * @param output
+     * @param distanceOut if not 0, receives the distance from the pair's key to the search position
+     * @param resultOut
+     * @return false once every pair has been handed out, or if the search position doesn't have the
+     * tree's dimension
+     */
+    bool next(QKDTreeNode * output, qreal * distanceOut = 0, QString * resultOut = 0);
+
+    /**
+     * @brief nextIndex is next() without the copy: it returns the slot the pair lives in, to pass to
+     * QKDTree::keyAt() and QKDTree::valueAt().
+     * @param indexOut
+     * @param distanceOut
+     * @param resultOut
+     * @return
+     */
+    bool nextIndex(quint32 * indexOut, qreal * distanceOut = 0, QString * resultOut = 0);
+
+    /**
+     * @brief count returns the number of pairs handed out so far.
+     * @return
+     */
+    qint64 count() const;
+
+private:
+    const QKDTree * _tree;
+    QVectorND _position;
+
+    //Min-heap on distance. Subtrees are stored as (root index) * 2 and keys as (slot index) * 2 + 1.
+    QVector<QPair<qreal, quint64> > _queue;
+    qint64 _count;
+};
+
+#endif // QKDTREENEARESTITERATOR_H
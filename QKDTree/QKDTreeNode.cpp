@@ -3,7 +3,7 @@
 #include <QtDebug>
 
 QKDTreeNode::QKDTreeNode(const QVectorND &position, const QVariant &value) :
-    _position(position), _value(value), _left(0), _right(0), _dividingDimension(0)
+    _position(position), _value(value)
 {
 }
 
@@ -25,39 +25,3 @@ void QKDTreeNode::setValue(const QVariant &nVal)
 {
     _value = nVal;
 }
-
-//private
-QKDTreeNode *QKDTreeNode::left() const
-{
-    return _left;
-}
-
-//private
-QKDTreeNode *QKDTreeNode::right() const
-{
-    return _right;
-}
-
-//private
-void QKDTreeNode::setLeft(QKDTreeNode *nLeft)
-{
-    _left = nLeft;
-}
-
-//private
-void QKDTreeNode::setRight(QKDTreeNode *nRight)
-{
-    _right = nRight;
-}
-
-//private
-int QKDTreeNode::dividingDimension() const
-{
-    return _dividingDimension;
-}
-
-//private
-void QKDTreeNode::setDividingDimension(int nDiv)
-{
-    _dividingDimension = nDiv;
-}
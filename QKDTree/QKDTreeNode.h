@@ -3,11 +3,14 @@
 
 #include "QVectorND.h"
 
-#include "QKDTree_global.h"
+#include <QVariant>
 
-//forward definition so that we can make QKDTree a "friend" class of QKDTreeNode
-class QKDTree;
+#include "QKDTree_global.h"
 
+/**
+ * @brief The QKDTreeNode class is a key/value pair as passed into and out of QKDTree. The tree keeps
+ * its own contiguous copy of the data, so nodes are never linked into the tree itself.
+ */
 class QKDTREESHARED_EXPORT QKDTreeNode
 {
 public:
@@ -19,24 +22,9 @@ public:
     const QVariant& value() const;
     void setValue(const QVariant& nVal);
 
-private:
-    QKDTreeNode * left() const;
-    QKDTreeNode *right() const;
-    void setLeft(QKDTreeNode * nLeft);
-    void setRight(QKDTreeNode * nRight);
-
-    int dividingDimension() const;
-    void setDividingDimension(int nDiv);
-
 private:
     QVectorND _position;
     QVariant _value;
-
-    QKDTreeNode * _left;
-    QKDTreeNode * _right;
-    int _dividingDimension;
-
-    friend class QKDTree;
 };
 
 #endif // QKDTREENODE_H
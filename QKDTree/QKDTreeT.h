@@ -0,0 +1,1059 @@
+#ifndef QKDTREET_H
+#define QKDTREET_H
+
+#include "QVectorN.h"
+#include "QKDTreeKernels.h"
+
+#include <QPair>
+#include <QString>
+#include <QVarLengthArray>
+#include <QVariant>
+#include <QVector>
+#include <algorithm>
+#include <limits>
+
+/**
+ * @brief The QKDTreeT class is a kd-tree whose dimension is fixed at compile time. It stores the
+ * same key/value pairs as QKDTree and answers the same queries, but its keys are QVectorN, so
+ * coordinate access, distance computation and the choice of dividing dimension all compile down to
+ * inline, unrolled code. Distances are squared euclidean.
+ *
+ * Inner nodes only hold a splitting plane. Key/value pairs live in leaf buckets of up to bucketSize()
+ * entries whose coordinates are stored structure-of-arrays, so the bottom of every search is a
+ * brute-force scan done with SIMD (see QKDTreeKernels.h) instead of a chain of unpredictable
+ * branches and cache misses.
+ *
+ * Scalar may be float to store keys in single precision: trees take half the memory and bucket scans
+ * read half as many bytes, while distances are still summed in qreal.
+ *
+ * Payload is the type of the values. It defaults to QVariant like QKDTree, but a plain type such as
+ * quint32 (an entity ID, say) keeps values small and cheap to copy. nearestIndex() and nearestIndices()
+ * skip the copy altogether and hand back slots to read through keyAt() and valueAt().
+ *
+ * Use QKDTree when the dimension is only known at runtime or a custom distance metric is needed.
+ */
+template <int Dim, typename Scalar = qreal, typename Payload = QVariant>
+class QKDTreeT
+{
+public:
+    typedef QVectorN<Dim, Scalar> Position;
+
+    /**
+     * @brief The Entry struct is a key/value pair as passed out of the tree, like QKDTreeNode.
+     */
+    struct Entry
+    {
+        Position position;
+        Payload value;
+    };
+
+    /**
+     * @brief QKDTreeT constructs an empty tree.
+     * @param allowDuplicates whether or not you can add multiple nodes with the same key
+     * @param bucketSize the maximum number of key/value pairs per leaf. Somewhere between 8 and 64
+     * is usually best.
+     */
+    explicit QKDTreeT(bool allowDuplicates = false, int bucketSize = 16);
+
+    static constexpr int dimension()
+    {
+        return Dim;
+    }
+
+    qint64 size() const;
+    int depth() const;
+    int bucketSize() const;
+
+    bool add(const Position& position, const Payload& value, QString * resultOut = 0);
+
+    /**
+     * @brief build replaces the contents of the tree with the given key/value pairs, splitting
+     * each subtree on its median as QKDTree::build does. O(nlogn) time.
+     * @param positions
+     * @param values must have the same length as positions
+     * @param resultOut
+     * @return
+     */
+    bool build(const QVector<Position>& positions, const QVector<Payload>& values, QString * resultOut = 0);
+    void clear();
+
+    bool nearestNode(const Position& position, Entry * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief nearestNodes finds the k nodes nearest to position, sorted from nearest to farthest.
+     * @param position
+     * @param k
+     * @param output
+     * @param resultOut
+     * @return
+     */
+    bool nearestNodes(const Position& position, int k, QVector<Entry> * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief nearestIndex finds the key/value pair nearest to position without copying it out. Instead
+     * it returns the slot the pair lives in; pass that to keyAt() and valueAt(). Slots stay valid until
+     * the tree is next changed.
+     * @param position
+     * @param indexOut
+     * @param distanceOut if not 0, receives the distance to the nearest key
+     * @param resultOut
+     * @return
+     */
+    bool nearestIndex(const Position& position, quint32 * indexOut, qreal * distanceOut = 0,
+                      QString * resultOut = 0) const;
+
+    /**
+     * @brief nearestIndices finds the slots of the k key/value pairs nearest to position, sorted from
+     * nearest to farthest, like nearestNodes() but without copying any of them.
+     * @param position
+     * @param k
+     * @param output
+     * @param resultOut
+     * @return
+     */
+    bool nearestIndices(const Position& position, int k, QVector<quint32> * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief keyAt returns the key in the given slot. Keys are only stored in the leaf buckets, so this
+     * gathers a copy of it from there.
+     * @param index a slot returned by nearestIndex() or nearestIndices()
+     * @return
+     */
+    Position keyAt(quint32 index) const;
+
+    /**
+     * @brief valueAt returns the value in the given slot.
+     * @param index a slot returned by nearestIndex() or nearestIndices()
+     * @return
+     */
+    const Payload& valueAt(quint32 index) const;
+
+    /**
+     * @brief withinDistance calls visitor(position, value) for every key/value pair whose squared
+     * distance to center is at most radius.
+     * @param center
+     * @param radius
+     * @param visitor
+     */
+    template <typename Visitor>
+    void withinDistance(const Position& center, qreal radius, Visitor&& visitor) const;
+    bool withinDistance(const Position& center, qreal radius, QVector<Entry> * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief rangeQuery calls visitor(position, value) for every key/value pair inside the
+     * axis-aligned box spanning min to max (inclusive).
+     * @param min
+     * @param max
+     * @param visitor
+     */
+    template <typename Visitor>
+    void rangeQuery(const Position& min, const Position& max, Visitor&& visitor) const;
+    bool rangeQuery(const Position& min, const Position& max, QVector<Entry> * output, QString * resultOut = 0) const;
+
+    bool containsKey(const Position& position) const;
+    bool value(const Position& positionKey, Payload * output, QString * resultOut = 0) const;
+
+    /**
+     * @brief distance returns the squared euclidean distance between two positions.
+     * @param a
+     * @param b
+     * @return
+     */
+    static qreal distance(const Position& a, const Position& b);
+
+private:
+    /*
+     * Children are indices into _nodes. Leaves have no children and point at a chain of buckets;
+     * a chain only grows past one bucket when more than bucketSize() identical keys are stored. Each
+     * bucket holds _stride slots: Dim coordinate arrays followed in _bucketEntries by the index of
+     * each slot's value in _values. The bucket coordinates are the only copy of the keys;
+     * _entryLocations maps each index back to its bucket slot, as bucket * _stride + slot.
+     */
+    struct Node
+    {
+        quint32 left;
+        quint32 right;
+        qint32 dividingDimension;
+        quint32 bucket;
+        Scalar split;
+    };
+
+    static const quint32 NO_NODE = 0xFFFFFFFF;
+
+    static constexpr int nextDimension(int dim)
+    {
+        return (dim + 1 == Dim) ? 0 : dim + 1;
+    }
+
+    quint32 newNode();
+    quint32 newBucket();
+    void freeBuckets(quint32 bucket);
+    void appendToLeaf(quint32 node, quint32 entry, const Position& position);
+    void collectLeaf(quint32 node, QVector<quint32> * entriesOut, QVector<Position> * keysOut) const;
+    bool splitRange(quint32 * begin, quint32 * end, int dim, const Position * keys, quint32 ** splitPoint,
+                    Scalar * splitValue) const;
+    void buildSubtree(QVector<quint32> * items, const Position * keys, const quint32 * entries, quint32 node,
+                      int divDim);
+    Position bucketKey(quint32 bucket, int slot) const;
+    bool bucketKeyEquals(quint32 bucket, int slot, const Position& position) const;
+
+    quint32 findNearest(const Position& position, qreal * distanceOut) const;
+    void findNearest(const Position& position, int k, QVarLengthArray<QPair<qreal, quint32>, 64> * best) const;
+
+    template <typename Func>
+    void scanLeaf(const Node& leaf, const Position& position, qreal * distances, Func&& func) const;
+    quint32 findLeaf(const Position& position) const;
+    quint32 find(const Position& position) const;
+
+private:
+    QVector<Node> _nodes;
+    QVector<Payload> _values;
+    QVector<quint64> _entryLocations;
+    quint32 _root;
+
+    int _bucketSize;
+    int _stride;
+    QVector<Scalar> _bucketCoords;
+    QVector<quint32> _bucketEntries;
+    QVector<quint32> _bucketCounts;
+    QVector<quint32> _bucketNext;
+    QVector<quint32> _freeBuckets;
+
+    bool _allowDuplicates;
+};
+
+template <int Dim, typename Scalar, typename Payload>
+const quint32 QKDTreeT<Dim, Scalar, Payload>::NO_NODE;
+
+template <int Dim, typename Scalar, typename Payload>
+QKDTreeT<Dim, Scalar, Payload>::QKDTreeT(bool allowDuplicates, int bucketSize) :
+    _root(NO_NODE), _allowDuplicates(allowDuplicates)
+{
+    _bucketSize = qMax(1, bucketSize);
+    _stride = (_bucketSize + QKDTreeKernels::LANES - 1) / QKDTreeKernels::LANES * QKDTreeKernels::LANES;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+qint64 QKDTreeT<Dim, Scalar, Payload>::size() const
+{
+    return _values.size();
+}
+
+template <int Dim, typename Scalar, typename Payload>
+int QKDTreeT<Dim, Scalar, Payload>::depth() const
+{
+    if (_root == NO_NODE)
+        return 0;
+
+    QVarLengthArray<QPair<quint32, int>, 64> toVisit;
+    toVisit.append(qMakePair(_root, 1));
+
+    int toRet = 0;
+    while (!toVisit.isEmpty())
+    {
+        const QPair<quint32, int> current = toVisit.last();
+        toVisit.removeLast();
+
+        const Node& node = _nodes.at(current.first);
+        toRet = qMax(toRet, current.second);
+        if (node.left != NO_NODE)
+            toVisit.append(qMakePair(node.left, current.second + 1));
+        if (node.right != NO_NODE)
+            toVisit.append(qMakePair(node.right, current.second + 1));
+    }
+    return toRet;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+int QKDTreeT<Dim, Scalar, Payload>::bucketSize() const
+{
+    return _bucketSize;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::add(const Position &position, const Payload &value, QString *resultOut)
+{
+    if (_values.size() >= int(NO_NODE >> 1))
+    {
+        if (resultOut)
+            *resultOut = "Tree is full";
+        return false;
+    }
+
+    if (_root == NO_NODE)
+    {
+        _root = this->newNode();
+        _nodes[_root].bucket = this->newBucket();
+    }
+
+    const quint32 leaf = this->findLeaf(position);
+    if (!_allowDuplicates)
+    {
+        for (quint32 b = _nodes.at(leaf).bucket; b != NO_NODE; b = _bucketNext.at(b))
+        {
+            for (quint32 j = 0; j < _bucketCounts.at(b); j++)
+            {
+                if (this->bucketKeyEquals(b, j, position))
+                {
+                    if (resultOut)
+                        *resultOut = "Cannot add duplicate";
+                    return false;
+                }
+            }
+        }
+    }
+
+    const quint32 entry = _values.size();
+    _values.append(value);
+    _entryLocations.append(0);
+
+    const quint32 bucket = _nodes.at(leaf).bucket;
+    if (_bucketNext.at(bucket) == NO_NODE && _bucketCounts.at(bucket) < quint32(_bucketSize))
+    {
+        this->appendToLeaf(leaf, entry, position);
+        return true;
+    }
+
+    //The leaf is full, so split it (or chain another bucket if its keys are all the same). Its keys
+    //are copied out first, since the freed buckets get reused while the new leaves are filled.
+    QVector<quint32> entries;
+    QVector<Position> keys;
+    this->collectLeaf(leaf, &entries, &keys);
+    entries.append(entry);
+    keys.append(position);
+    this->freeBuckets(bucket);
+    _nodes[leaf].bucket = NO_NODE;
+
+    QVector<quint32> items(entries.size());
+    for (int i = 0; i < items.size(); i++)
+        items[i] = i;
+    this->buildSubtree(&items, keys.constData(), entries.constData(), leaf, _nodes.at(leaf).dividingDimension);
+    return true;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::build(const QVector<Position> &positions, const QVector<Payload> &values, QString *resultOut)
+{
+    if (positions.size() != values.size())
+    {
+        if (resultOut)
+            *resultOut = "Number of positions does not match number of values";
+        return false;
+    }
+    else if (positions.size() >= int(NO_NODE >> 1))
+    {
+        if (resultOut)
+            *resultOut = "Too many positions";
+        return false;
+    }
+
+    this->clear();
+    _values = values;
+
+    QVector<quint32> order(positions.size());
+    for (int i = 0; i < order.size(); i++)
+        order[i] = i;
+
+    //Maps the index of each kept position to the index of its value, if removing duplicates moved it
+    QVector<quint32> entryOf;
+
+    //Keep only the first occurrence of each key, just like repeated calls to add() would
+    if (!_allowDuplicates && order.size() > 1)
+    {
+        std::sort(order.begin(), order.end(), [&](quint32 a, quint32 b) {
+            const Position& posA = positions.at(a);
+            const Position& posB = positions.at(b);
+            for (int i = 0; i < Dim; i++)
+            {
+                if (posA[i] != posB[i])
+                    return posA[i] < posB[i];
+            }
+            return a < b;
+        });
+
+        int kept = 1;
+        for (int i = 1; i < order.size(); i++)
+        {
+            if (positions.at(order[i]) != positions.at(order[kept - 1]))
+                order[kept++] = order[i];
+        }
+        order.resize(kept);
+
+        std::sort(order.begin(), order.end());
+        entryOf.resize(positions.size());
+        for (int i = 0; i < order.size(); i++)
+        {
+            _values[i] = values.at(order[i]);
+            entryOf[order[i]] = i;
+        }
+        _values.resize(order.size());
+    }
+
+    if (order.isEmpty())
+        return true;
+
+    _entryLocations.resize(order.size());
+    _root = this->newNode();
+    this->buildSubtree(&order, positions.constData(), entryOf.isEmpty() ? 0 : entryOf.constData(), _root, 0);
+    return true;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+void QKDTreeT<Dim, Scalar, Payload>::clear()
+{
+    _nodes.clear();
+    _values.clear();
+    _entryLocations.clear();
+    _bucketCoords.clear();
+    _bucketEntries.clear();
+    _bucketCounts.clear();
+    _bucketNext.clear();
+    _freeBuckets.clear();
+    _root = NO_NODE;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::nearestNode(const Position &position, Entry *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = "You didn't provide a pointer for output.";
+        return false;
+    }
+    else if (_values.isEmpty())
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    const quint32 nearest = this->findNearest(position, 0);
+    output->position = this->keyAt(nearest);
+    output->value = _values.at(nearest);
+    return true;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::nearestNodes(const Position &position, int k, QVector<Entry> *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = "You didn't provide a pointer for output.";
+        return false;
+    }
+    else if (k <= 0)
+    {
+        if (resultOut)
+            *resultOut = "k must be positive";
+        return false;
+    }
+    else if (_values.isEmpty())
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    QVarLengthArray<QPair<qreal, quint32>, 64> best;
+    this->findNearest(position, k, &best);
+
+    output->resize(best.size());
+    for (int i = 0; i < best.size(); i++)
+    {
+        (*output)[i].position = this->keyAt(best[i].second);
+        (*output)[i].value = _values.at(best[i].second);
+    }
+    return true;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::nearestIndex(const Position &position, quint32 *indexOut, qreal *distanceOut,
+                                                  QString *resultOut) const
+{
+    if (indexOut == 0)
+    {
+        if (resultOut)
+            *resultOut = "You didn't provide a pointer for output.";
+        return false;
+    }
+    else if (_values.isEmpty())
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    *indexOut = this->findNearest(position, distanceOut);
+    return true;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::nearestIndices(const Position &position, int k, QVector<quint32> *output,
+                                                    QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = "You didn't provide a pointer for output.";
+        return false;
+    }
+    else if (k <= 0)
+    {
+        if (resultOut)
+            *resultOut = "k must be positive";
+        return false;
+    }
+    else if (_values.isEmpty())
+    {
+        if (resultOut)
+            *resultOut = "Tree is empty";
+        return false;
+    }
+
+    QVarLengthArray<QPair<qreal, quint32>, 64> best;
+    this->findNearest(position, k, &best);
+
+    output->resize(best.size());
+    for (int i = 0; i < best.size(); i++)
+        (*output)[i] = best[i].second;
+    return true;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+typename QKDTreeT<Dim, Scalar, Payload>::Position QKDTreeT<Dim, Scalar, Payload>::keyAt(quint32 index) const
+{
+    const quint64 location = _entryLocations.at(index);
+    return this->bucketKey(quint32(location / _stride), int(location % _stride));
+}
+
+template <int Dim, typename Scalar, typename Payload>
+const Payload &QKDTreeT<Dim, Scalar, Payload>::valueAt(quint32 index) const
+{
+    return _values.at(index);
+}
+
+template <int Dim, typename Scalar, typename Payload>
+template <typename Visitor>
+void QKDTreeT<Dim, Scalar, Payload>::withinDistance(const Position &center, qreal radius, Visitor &&visitor) const
+{
+    QVarLengthArray<quint32, 64> unwindChecks;
+    QVarLengthArray<qreal, 64> distances(_stride);
+
+    quint32 current = _root;
+    while (true)
+    {
+        while (current != NO_NODE)
+        {
+            const Node& node = _nodes.at(current);
+            if (node.bucket != NO_NODE)
+            {
+                this->scanLeaf(node, center, distances.data(), [&](quint32 entry, qreal dist) {
+                    if (dist <= radius)
+                        visitor(this->keyAt(entry), _values.at(entry));
+                });
+                break;
+            }
+
+            unwindChecks.append(current);
+            current = (center[node.dividingDimension] <= node.split) ? node.left : node.right;
+        }
+
+        if (unwindChecks.isEmpty())
+            break;
+
+        const Node& node = _nodes.at(unwindChecks.last());
+        unwindChecks.removeLast();
+
+        const qreal planeDelta = qreal(center[node.dividingDimension]) - qreal(node.split);
+        if (planeDelta * planeDelta <= radius)
+            current = (center[node.dividingDimension] <= node.split) ? node.right : node.left;
+        else
+            current = NO_NODE;
+    }
+}
+
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::withinDistance(const Position &center, qreal radius, QVector<Entry> *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = "You didn't provide a pointer for output.";
+        return false;
+    }
+
+    output->clear();
+    this->withinDistance(center, radius, [output](const Position& position, const Payload& value) {
+        const Entry entry = {position, value};
+        output->append(entry);
+    });
+    return true;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+template <typename Visitor>
+void QKDTreeT<Dim, Scalar, Payload>::rangeQuery(const Position &min, const Position &max, Visitor &&visitor) const
+{
+    if (_root == NO_NODE)
+        return;
+
+    QVarLengthArray<quint32, 64> toVisit;
+    QVarLengthArray<quint8, 64> inside(_stride);
+    toVisit.append(_root);
+
+    while (!toVisit.isEmpty())
+    {
+        const Node& node = _nodes.at(toVisit.last());
+        toVisit.removeLast();
+
+        if (node.bucket != NO_NODE)
+        {
+            for (quint32 b = node.bucket; b != NO_NODE; b = _bucketNext.at(b))
+            {
+                const int count = _bucketCounts.at(b);
+                const quint32 * entries = _bucketEntries.constData() + qint64(b) * _stride;
+                QKDTreeKernels::insideBox<Dim>(_bucketCoords.constData() + qint64(b) * Dim * _stride, _stride, count,
+                                               min.constData(), max.constData(), inside.data());
+                for (int j = 0; j < count; j++)
+                {
+                    if (inside[j])
+                        visitor(this->bucketKey(b, j), _values.at(entries[j]));
+                }
+            }
+            continue;
+        }
+
+        //Only go down the sides of the hyperplane that the box overlaps
+        const int divDim = node.dividingDimension;
+        if (min[divDim] <= node.split)
+            toVisit.append(node.left);
+        if (max[divDim] > node.split)
+            toVisit.append(node.right);
+    }
+}
+
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::rangeQuery(const Position &min, const Position &max, QVector<Entry> *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = "You didn't provide a pointer for output.";
+        return false;
+    }
+
+    output->clear();
+    this->rangeQuery(min, max, [output](const Position& position, const Payload& value) {
+        const Entry entry = {position, value};
+        output->append(entry);
+    });
+    return true;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::containsKey(const Position &position) const
+{
+    return this->find(position) != NO_NODE;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::value(const Position &positionKey, Payload *output, QString *resultOut) const
+{
+    if (output == 0)
+    {
+        if (resultOut)
+            *resultOut = "You didn't provide a pointer for output.";
+        return false;
+    }
+
+    const quint32 index = this->find(positionKey);
+    if (index == NO_NODE)
+    {
+        if (resultOut)
+            *resultOut = "Key not found";
+        return false;
+    }
+
+    *output = _values.at(index);
+    return true;
+}
+
+template <int Dim, typename Scalar, typename Payload>
+qreal QKDTreeT<Dim, Scalar, Payload>::distance(const Position &a, const Position &b)
+{
+    qreal toRet = 0.0;
+    for (int i = 0; i < Dim; i++)
+    {
+        const qreal delta = qreal(a[i]) - qreal(b[i]);
+        toRet += delta * delta;
+    }
+    return toRet;
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+quint32 QKDTreeT<Dim, Scalar, Payload>::newNode()
+{
+    const Node node = {NO_NODE, NO_NODE, 0, NO_NODE, Scalar(0)};
+    _nodes.append(node);
+    return _nodes.size() - 1;
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+quint32 QKDTreeT<Dim, Scalar, Payload>::newBucket()
+{
+    if (!_freeBuckets.isEmpty())
+    {
+        const quint32 toRet = _freeBuckets.last();
+        _freeBuckets.removeLast();
+        _bucketCounts[toRet] = 0;
+        _bucketNext[toRet] = NO_NODE;
+        return toRet;
+    }
+
+    //Padding slots stay zero so the SIMD kernels never read uninitialized memory
+    _bucketCoords.resize(_bucketCoords.size() + Dim * _stride);
+    _bucketEntries.resize(_bucketEntries.size() + _stride);
+    _bucketCounts.append(0);
+    _bucketNext.append(NO_NODE);
+    return _bucketCounts.size() - 1;
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+void QKDTreeT<Dim, Scalar, Payload>::freeBuckets(quint32 bucket)
+{
+    while (bucket != NO_NODE)
+    {
+        _freeBuckets.append(bucket);
+        bucket = _bucketNext.at(bucket);
+    }
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+void QKDTreeT<Dim, Scalar, Payload>::appendToLeaf(quint32 node, quint32 entry, const Position &position)
+{
+    quint32 bucket = _nodes.at(node).bucket;
+    while (_bucketCounts.at(bucket) >= quint32(_bucketSize))
+    {
+        if (_bucketNext.at(bucket) == NO_NODE)
+        {
+            const quint32 chained = this->newBucket();
+            _bucketNext[bucket] = chained;
+        }
+        bucket = _bucketNext.at(bucket);
+    }
+
+    const quint32 slot = _bucketCounts[bucket]++;
+    Scalar * coords = _bucketCoords.data() + qint64(bucket) * Dim * _stride;
+    for (int d = 0; d < Dim; d++)
+        coords[d * _stride + slot] = position[d];
+    _bucketEntries[qint64(bucket) * _stride + slot] = entry;
+    _entryLocations[entry] = quint64(bucket) * _stride + slot;
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+void QKDTreeT<Dim, Scalar, Payload>::collectLeaf(quint32 node, QVector<quint32> *entriesOut,
+                                                 QVector<Position> *keysOut) const
+{
+    for (quint32 b = _nodes.at(node).bucket; b != NO_NODE; b = _bucketNext.at(b))
+    {
+        const quint32 * entries = _bucketEntries.constData() + qint64(b) * _stride;
+        for (quint32 j = 0; j < _bucketCounts.at(b); j++)
+        {
+            entriesOut->append(entries[j]);
+            keysOut->append(this->bucketKey(b, j));
+        }
+    }
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::splitRange(quint32 *begin, quint32 *end, int dim, const Position *keys,
+                                                quint32 **splitPoint, Scalar *splitValue) const
+{
+    //Median by coordinate, ties broken by index so the choice doesn't depend on input order
+    quint32 * const mid = begin + (end - begin) / 2;
+    std::nth_element(begin, mid, end, [=](quint32 a, quint32 b) {
+        if (keys[a][dim] != keys[b][dim])
+            return keys[a][dim] < keys[b][dim];
+        return a < b;
+    });
+
+    //Everything <= the median goes left, as long as that leaves something on the right
+    const Scalar median = keys[*mid][dim];
+    quint32 * point = std::partition(begin, end, [=](quint32 a) { return keys[a][dim] <= median; });
+    if (point != end)
+    {
+        *splitPoint = point;
+        *splitValue = median;
+        return true;
+    }
+
+    //Otherwise the median is the largest value, so split just below it
+    point = std::partition(begin, end, [=](quint32 a) { return keys[a][dim] < median; });
+    if (point == begin)
+        return false;
+
+    Scalar below = keys[*begin][dim];
+    for (quint32 * it = begin; it != point; it++)
+        below = qMax(below, keys[*it][dim]);
+
+    *splitPoint = point;
+    *splitValue = below;
+    return true;
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+void QKDTreeT<Dim, Scalar, Payload>::buildSubtree(QVector<quint32> *items, const Position *keys,
+                                                  const quint32 *entries, quint32 node, int divDim)
+{
+    //items index keys; entries maps them to indices into _values, or is 0 if they already are those
+    struct BuildRange
+    {
+        int begin;
+        int end;
+        int divDim;
+        quint32 node;
+    };
+
+    QVarLengthArray<BuildRange, 64> toBuild;
+    const BuildRange whole = {0, items->size(), divDim, node};
+    toBuild.append(whole);
+
+    while (!toBuild.isEmpty())
+    {
+        const BuildRange range = toBuild.last();
+        toBuild.removeLast();
+
+        quint32 * const begin = items->data() + range.begin;
+        quint32 * const end = items->data() + range.end;
+
+        //Try each dimension in turn; only identical keys can't be split at all
+        bool split = false;
+        if (range.end - range.begin > _bucketSize)
+        {
+            for (int i = 0; i < Dim && !split; i++)
+            {
+                const int dim = (range.divDim + i) % Dim;
+                quint32 * splitPoint = 0;
+                Scalar splitValue = Scalar(0);
+                if (!this->splitRange(begin, end, dim, keys, &splitPoint, &splitValue))
+                    continue;
+
+                const quint32 left = this->newNode();
+                const quint32 right = this->newNode();
+                Node& current = _nodes[range.node];
+                current.left = left;
+                current.right = right;
+                current.dividingDimension = dim;
+                current.split = splitValue;
+
+                const int splitIndex = splitPoint - items->data();
+                const BuildRange leftRange = {range.begin, splitIndex, nextDimension(dim), left};
+                const BuildRange rightRange = {splitIndex, range.end, nextDimension(dim), right};
+                toBuild.append(leftRange);
+                toBuild.append(rightRange);
+                split = true;
+            }
+        }
+
+        if (split)
+            continue;
+
+        _nodes[range.node].dividingDimension = range.divDim;
+        _nodes[range.node].bucket = this->newBucket();
+        for (quint32 * it = begin; it != end; it++)
+            this->appendToLeaf(range.node, entries ? entries[*it] : *it, keys[*it]);
+    }
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+quint32 QKDTreeT<Dim, Scalar, Payload>::findNearest(const Position &position, qreal *distanceOut) const
+{
+    QVarLengthArray<quint32, 64> unwindChecks;
+    QVarLengthArray<qreal, 64> distances(_stride);
+
+    quint32 bestSoFar = NO_NODE;
+    qreal bestDistSoFar = std::numeric_limits<qreal>::max();
+
+    quint32 current = _root;
+    while (true)
+    {
+        //Descend towards the search position, remembering the path for the unwind phase
+        while (current != NO_NODE)
+        {
+            const Node& node = _nodes.at(current);
+            if (node.bucket != NO_NODE)
+            {
+                this->scanLeaf(node, position, distances.data(), [&](quint32 entry, qreal dist) {
+                    if (dist < bestDistSoFar)
+                    {
+                        bestSoFar = entry;
+                        bestDistSoFar = dist;
+                    }
+                });
+                break;
+            }
+
+            unwindChecks.append(current);
+            current = (position[node.dividingDimension] <= node.split) ? node.left : node.right;
+        }
+
+        if (unwindChecks.isEmpty())
+            break;
+
+        const Node& node = _nodes.at(unwindChecks.last());
+        unwindChecks.removeLast();
+
+        //Only search the other side of the dividing hyperplane if it is close enough
+        const qreal planeDelta = qreal(position[node.dividingDimension]) - qreal(node.split);
+        if (planeDelta * planeDelta <= bestDistSoFar)
+            current = (position[node.dividingDimension] <= node.split) ? node.right : node.left;
+        else
+            current = NO_NODE;
+    }
+
+    if (distanceOut)
+        *distanceOut = bestDistSoFar;
+    return bestSoFar;
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+void QKDTreeT<Dim, Scalar, Payload>::findNearest(const Position &position, int k,
+                                                 QVarLengthArray<QPair<qreal, quint32>, 64> *best) const
+{
+    QVarLengthArray<quint32, 64> unwindChecks;
+    QVarLengthArray<qreal, 64> distances(_stride);
+
+    //Max-heap of the k best so far, so the worst of them is always at the front
+    best->clear();
+
+    quint32 current = _root;
+    while (true)
+    {
+        while (current != NO_NODE)
+        {
+            const Node& node = _nodes.at(current);
+            if (node.bucket != NO_NODE)
+            {
+                this->scanLeaf(node, position, distances.data(), [&](quint32 entry, qreal dist) {
+                    if (best->size() < k)
+                    {
+                        best->append(qMakePair(dist, entry));
+                        std::push_heap(best->begin(), best->end());
+                    }
+                    else if (dist < best->first().first)
+                    {
+                        std::pop_heap(best->begin(), best->end());
+                        best->last() = qMakePair(dist, entry);
+                        std::push_heap(best->begin(), best->end());
+                    }
+                });
+                break;
+            }
+
+            unwindChecks.append(current);
+            current = (position[node.dividingDimension] <= node.split) ? node.left : node.right;
+        }
+
+        if (unwindChecks.isEmpty())
+            break;
+
+        const Node& node = _nodes.at(unwindChecks.last());
+        unwindChecks.removeLast();
+
+        const qreal planeDelta = qreal(position[node.dividingDimension]) - qreal(node.split);
+        if (best->size() < k || planeDelta * planeDelta <= best->first().first)
+            current = (position[node.dividingDimension] <= node.split) ? node.right : node.left;
+        else
+            current = NO_NODE;
+    }
+
+    std::sort_heap(best->begin(), best->end());
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+template <typename Func>
+void QKDTreeT<Dim, Scalar, Payload>::scanLeaf(const Node &leaf, const Position &position, qreal *distances, Func &&func) const
+{
+    for (quint32 b = leaf.bucket; b != NO_NODE; b = _bucketNext.at(b))
+    {
+        const int count = _bucketCounts.at(b);
+        QKDTreeKernels::squaredDistances<Dim>(_bucketCoords.constData() + qint64(b) * Dim * _stride, _stride, count,
+                                              position.constData(), distances);
+
+        const quint32 * entries = _bucketEntries.constData() + qint64(b) * _stride;
+        for (int j = 0; j < count; j++)
+            func(entries[j], distances[j]);
+    }
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+quint32 QKDTreeT<Dim, Scalar, Payload>::findLeaf(const Position &position) const
+{
+    quint32 current = _root;
+    while (true)
+    {
+        const Node& node = _nodes.at(current);
+        if (node.bucket != NO_NODE)
+            return current;
+        current = (position[node.dividingDimension] <= node.split) ? node.left : node.right;
+    }
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+quint32 QKDTreeT<Dim, Scalar, Payload>::find(const Position &position) const
+{
+    if (_root == NO_NODE)
+        return NO_NODE;
+
+    for (quint32 b = _nodes.at(this->findLeaf(position)).bucket; b != NO_NODE; b = _bucketNext.at(b))
+    {
+        const quint32 * entries = _bucketEntries.constData() + qint64(b) * _stride;
+        for (quint32 j = 0; j < _bucketCounts.at(b); j++)
+        {
+            if (this->bucketKeyEquals(b, j, position))
+                return entries[j];
+        }
+    }
+    return NO_NODE;
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+typename QKDTreeT<Dim, Scalar, Payload>::Position QKDTreeT<Dim, Scalar, Payload>::bucketKey(quint32 bucket,
+                                                                                           int slot) const
+{
+    const Scalar * coords = _bucketCoords.constData() + qint64(bucket) * Dim * _stride + slot;
+    Position toRet;
+    for (int d = 0; d < Dim; d++)
+        toRet[d] = coords[d * _stride];
+    return toRet;
+}
+
+//private
+template <int Dim, typename Scalar, typename Payload>
+bool QKDTreeT<Dim, Scalar, Payload>::bucketKeyEquals(quint32 bucket, int slot, const Position &position) const
+{
+    const Scalar * coords = _bucketCoords.constData() + qint64(bucket) * Dim * _stride + slot;
+    for (int d = 0; d < Dim; d++)
+    {
+        if (coords[d * _stride] != position[d])
+            return false;
+    }
+    return true;
+}
+
+#endif // QKDTREET_H
@@ -0,0 +1,9 @@
+#include "QKDTreeVisitor.h"
+
+QKDTreeVisitor::QKDTreeVisitor()
+{
+}
+
+QKDTreeVisitor::~QKDTreeVisitor()
+{
+}
@@ -0,0 +1,29 @@
+#ifndef QKDTREEVISITOR_H
+#define QKDTREEVISITOR_H
+
+#include "QVectorND.h"
+
+#include <QVariant>
+
+#include "QKDTree_global.h"
+
+/**
+ * @brief The QKDTreeVisitor class is called back by QKDTree queries that can match many key/value
+ * pairs, so callers can consume matches as they are found instead of collecting them in a list.
+ */
+class QKDTREESHARED_EXPORT QKDTreeVisitor
+{
+public:
+    QKDTreeVisitor();
+    virtual ~QKDTreeVisitor();
+
+    /**
+     * @brief visit is called once for every key/value pair matching the query. The references are
+     * only valid for the duration of the call.
+     * @param position
+     * @param value
+     */
+    virtual void visit(const QVectorND& position, const QVariant& value) = 0;
+};
+
+#endif // QKDTREEVISITOR_H
@@ -0,0 +1,200 @@
+#ifndef QVECTORN_H
+#define QVECTORN_H
+
+#include <QPointF>
+#include <QtDebug>
+#include <array>
+#include <cmath>
+
+#include "QVectorND.h"
+
+/**
+ * @brief The QVectorN class is a fixed-dimension counterpart to QVectorND. Its size is known at
+ * compile time and it is backed by a std::array, so it never allocates and every operation can be
+ * inlined and unrolled. Indexing is only checked in debug builds.
+ */
+template <int Dim, typename Scalar = qreal>
+class QVectorN
+{
+    static_assert(Dim > 0, "QVectorN needs at least one dimension");
+
+public:
+    QVectorN()
+    {
+        _data.fill(Scalar(0));
+    }
+
+    QVectorN(const QPointF& point)
+    {
+        static_assert(Dim == 2, "Only 2-dimensional vectors can be built from a QPointF");
+        _data[0] = Scalar(point.x());
+        _data[1] = Scalar(point.y());
+    }
+
+    explicit QVectorN(const Scalar * values)
+    {
+        for (int i = 0; i < Dim; i++)
+            _data[i] = values[i];
+    }
+
+    /**
+     * @brief QVectorN copies the first Dim components of a QVectorND. Missing components are zero.
+     * @param other
+     */
+    explicit QVectorN(const QVectorND& other)
+    {
+        for (int i = 0; i < Dim; i++)
+            _data[i] = (i < other.dimension()) ? Scalar(other[i]) : Scalar(0);
+    }
+
+    static constexpr int dimension()
+    {
+        return Dim;
+    }
+
+    QVectorND toVectorND() const
+    {
+        QVectorND toRet(Dim);
+        for (int i = 0; i < Dim; i++)
+            toRet[i] = _data[i];
+        return toRet;
+    }
+
+    bool isNull() const
+    {
+        for (int i = 0; i < Dim; i++)
+        {
+            if (_data[i] != Scalar(0))
+                return false;
+        }
+        return true;
+    }
+
+    qreal length() const
+    {
+        return std::sqrt(this->lengthSquared());
+    }
+
+    qreal lengthSquared() const
+    {
+        qreal toRet = 0.0;
+        for (int i = 0; i < Dim; i++)
+            toRet += qreal(_data[i]) * qreal(_data[i]);
+        return toRet;
+    }
+
+    void setVal(int index, Scalar value)
+    {
+        Q_ASSERT(index >= 0 && index < Dim);
+        _data[index] = value;
+    }
+
+    Scalar val(int index) const
+    {
+        Q_ASSERT(index >= 0 && index < Dim);
+        return _data[index];
+    }
+
+    Scalar * data()
+    {
+        return _data.data();
+    }
+
+    const Scalar * constData() const
+    {
+        return _data.data();
+    }
+
+    QVectorN& operator*= (Scalar factor)
+    {
+        for (int i = 0; i < Dim; i++)
+            _data[i] *= factor;
+        return *this;
+    }
+
+    QVectorN& operator+= (const QVectorN& other)
+    {
+        for (int i = 0; i < Dim; i++)
+            _data[i] += other._data[i];
+        return *this;
+    }
+
+    QVectorN& operator-= (const QVectorN& other)
+    {
+        for (int i = 0; i < Dim; i++)
+            _data[i] -= other._data[i];
+        return *this;
+    }
+
+    QVectorN& operator/= (Scalar divisor)
+    {
+        for (int i = 0; i < Dim; i++)
+            _data[i] /= divisor;
+        return *this;
+    }
+
+    bool operator==(const QVectorN& other) const
+    {
+        for (int i = 0; i < Dim; i++)
+        {
+            if (_data[i] != other._data[i])
+                return false;
+        }
+        return true;
+    }
+
+    bool operator!=(const QVectorN& other) const
+    {
+        return !(other == *this);
+    }
+
+    Scalar& operator[](int index)
+    {
+        Q_ASSERT(index >= 0 && index < Dim);
+        return _data[index];
+    }
+
+    Scalar operator[](int index) const
+    {
+        Q_ASSERT(index >= 0 && index < Dim);
+        return _data[index];
+    }
+
+private:
+    std::array<Scalar, Dim> _data;
+};
+
+//non-members
+template <int Dim, typename Scalar>
+inline const QVectorN<Dim, Scalar> operator-(const QVectorN<Dim, Scalar>& v1, const QVectorN<Dim, Scalar>& v2)
+{
+    QVectorN<Dim, Scalar> toRet = v1;
+    toRet -= v2;
+    return toRet;
+}
+
+template <int Dim, typename Scalar>
+inline const QVectorN<Dim, Scalar> operator+(const QVectorN<Dim, Scalar>& v1, const QVectorN<Dim, Scalar>& v2)
+{
+    QVectorN<Dim, Scalar> toRet = v1;
+    toRet += v2;
+    return toRet;
+}
+
+template <int Dim, typename Scalar>
+QDebug operator<<(QDebug dbg, const QVectorN<Dim, Scalar>& vec)
+{
+    dbg.nospace() << "(";
+    for(int i = 0; i < Dim; i++)
+    {
+        dbg.nospace() << vec[i];
+        if (i < Dim - 1)
+            dbg.nospace() << ",";
+    }
+
+    dbg.nospace() << ")";
+
+    return dbg.space();
+}
+
+#endif // QVECTORN_H
@@ -16,6 +16,13 @@ QVectorND::QVectorND(const QList<qreal> &values)
         _data.append(values[i]);
 }
 
+QVectorND::QVectorND(const qreal *values, int dimensions) :_dimensions(dimensions)
+{
+    _data.resize(_dimensions);
+    for (int i = 0; i < _dimensions; i++)
+        _data[i] = values[i];
+}
+
 QVectorND::QVectorND(const QPoint &point)
 {
     _dimensions = 2;
@@ -144,6 +151,16 @@ const QVector<qreal> &QVectorND::values() const
     return _data;
 }
 
+qreal *QVectorND::data()
+{
+    return _data.data();
+}
+
+const qreal *QVectorND::constData() const
+{
+    return _data.constData();
+}
+
 QVectorND &QVectorND::operator *=(qreal factor)
 {
     for (int i = 0; i < _dimensions; i++)
@@ -17,6 +17,7 @@ class QVECTORNDSHARED_EXPORT QVectorND
 public:
     QVectorND(int dimensions=2);
     QVectorND(const QList<qreal>& values);
+    QVectorND(const qreal * values, int dimensions);
     QVectorND(const QPoint& point);
     QVectorND(const QPointF& point);
     QVectorND(const QVector2D& vec);
@@ -37,6 +38,8 @@ public:
     void setVal(int index, qreal value);
     qreal val(int index) const;
     const QVector<qreal> &values() const;
+    qreal * data();
+    const qreal * constData() const;
 
 
     QVectorND& operator*= (qreal factor);
@@ -6,6 +6,7 @@
 
 TARGET = QVectorND
 TEMPLATE = lib
+CONFIG += c++11
 
 DEFINES += QVECTORND_LIBRARY
 
@@ -14,7 +15,8 @@ SOURCES += \
 
 HEADERS +=\
         QVectorND_global.h \
-    QVectorND.h
+    QVectorND.h \
+    QVectorN.h
 
 unix:!symbian {
     maemo5 {
@@ -9,6 +9,7 @@ QT       += testlib
 TARGET = tst_QKDTreeTests
 CONFIG   += console
 CONFIG   -= app_bundle
+CONFIG   += c++11
 
 TEMPLATE = app
 
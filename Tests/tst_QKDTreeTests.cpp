@@ -1,8 +1,172 @@
 #include "tst_QKDTreeTests.h"
 
 #include "QKDTree.h"
-
+#include "QKDForest.h"
+#include "QKDForestIndex.h"
+#include "QKDSnapshotTree.h"
+#include "QKDTreeMetrics.h"
+#include "QKDTreeNearestIterator.h"
+#include "QKDTreeT.h"
+
+#include <QBitArray>
+#include <QDir>
+#include <QFile>
+#include <QSet>
+#include <QThread>
+#include <QThreadPool>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <limits>
+#include <new>
+
+namespace
+{
+class CountingVisitor : public QKDTreeVisitor
+{
+public:
+    CountingVisitor() : count(0)
+    {
+    }
+
+    void visit(const QVectorND &position, const QVariant &value)
+    {
+        Q_UNUSED(position)
+        Q_UNUSED(value)
+        count++;
+    }
+
+    int count;
+};
+
+//Keeps every key/value pair it visits
+class RecordingVisitor : public QKDTreeVisitor
+{
+public:
+    void visit(const QVectorND &position, const QVariant &value)
+    {
+        positions.append(position);
+        values.append(value);
+    }
+
+    QList<QVectorND> positions;
+    QList<QVariant> values;
+};
+
+//Manhattan distance written so that it allocates nothing
+class ManhattanMetric : public QKDTreeDistanceMetric
+{
+public:
+    qreal distance(const QVectorND &a, const QVectorND &b) const
+    {
+        qreal toRet = 0.0;
+        for (int i = 0; i < a.dimension(); i++)
+            toRet += qAbs(a[i] - b[i]);
+        return toRet;
+    }
+};
+
+//The same metric as ManhattanMetric, but with per-axis bounds so the tree never builds plane positions
+class AxisManhattanMetric : public ManhattanMetric
+{
+public:
+    qreal axisDistance(int dimension, qreal delta) const
+    {
+        Q_UNUSED(dimension)
+        return qAbs(delta);
+    }
+
+    bool hasAxisDistance() const
+    {
+        return true;
+    }
+};
+
+//Squared euclidean distance that counts how many times distance() is called
+class CountingMetric : public QKDTreeDistanceMetric
+{
+public:
+    CountingMetric() : calls(0)
+    {
+    }
+
+    qreal distance(const QVectorND &a, const QVectorND &b) const
+    {
+        calls++;
+        return QKDTreeDistanceMetric::distance(a, b);
+    }
+
+    bool hasAxisDistance() const
+    {
+        return true;
+    }
+
+    mutable int calls;
+};
+
+//Checks that every snapshot it sees holds exactly the keys 0 .. size-1 that the writer adds in order
+class SnapshotReader : public QRunnable
+{
+public:
+    SnapshotReader(const QKDSnapshotTree * tree, int target, QAtomicInt * failures) :
+        _tree(tree), _target(target), _failures(failures)
+    {
+    }
+
+    void run()
+    {
+        qint64 lastSize = 0;
+        while (lastSize < _target)
+        {
+            const QKDTreeSnapshot snapshot = _tree->snapshot();
+            const qint64 size = snapshot.size();
+            if (size < lastSize)
+                _failures->ref();
+            lastSize = size;
+            if (size == 0)
+                continue;
+
+            QKDTreeNode nearest;
+            if (!snapshot.nearestNode(QPointF(size - 1, 0.1), &nearest) || nearest.value() != size - 1)
+                _failures->ref();
+            if (snapshot.containsKey(QVectorND(QPointF(size, 0))))
+                _failures->ref();
+        }
+    }
+
+private:
+    const QKDSnapshotTree * _tree;
+    int _target;
+    QAtomicInt * _failures;
+};
+}
+
+//Every allocation made through operator new, so tests can check that a code path makes none
+QAtomicInt allocationCount(0);
+
+void * operator new(std::size_t size)
+{
+    allocationCount.ref();
+    void * toRet = std::malloc(size ? size : 1);
+    if (toRet == 0)
+        throw std::bad_alloc();
+    return toRet;
+}
+
+void * operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void * pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void * pointer) noexcept
+{
+    std::free(pointer);
+}
 
 const uint size1 = 32000;
 const uint size2 = 64000;
@@ -93,6 +257,36 @@ void QKDTreeTests::valueTest()
     QVERIFY(!tree.value(QPointF(50,50), &val));
 }
 
+//private test
+void QKDTreeTests::addNodeTest()
+{
+    QKDTree tree(2);
+
+    //The tree copies the pair into its own storage and deletes the node
+    QVERIFY(tree.add(new QKDTreeNode(QVectorND(QPointF(1,2)), "a")));
+    QVERIFY(tree.add(new QKDTreeNode(QVectorND(QPointF(3,4)), "b")));
+
+    QKDTreeNode duplicate(QVectorND(QPointF(1,2)), "c");
+    QVERIFY(!tree.add(&duplicate));
+    QKDTreeNode wrongDimension(QVectorND(3));
+    QVERIFY(!tree.add(&wrongDimension));
+    QVERIFY(tree.size() == 2);
+
+    QVariant val;
+    QVERIFY(tree.value(QPointF(1,2), &val));
+    QVERIFY(val == "a");
+
+    QKDTreeNode nearest;
+    QVERIFY(tree.nearestNode(QPointF(4,4), &nearest));
+    QVERIFY(nearest.value() == "b");
+
+    tree.clear();
+    QVERIFY(tree.size() == 0);
+    QVERIFY(!tree.containsKey(QPointF(1,2)));
+    QVERIFY(tree.add(QPointF(1,2), "d"));
+    QVERIFY(tree.containsKey(QPointF(1,2)));
+}
+
 //private test
 void QKDTreeTests::bigNearestTest()
 {
@@ -145,6 +339,134 @@ void QKDTreeTests::bigNearestTest()
         QVERIFY(false);
 }
 
+//private test
+void QKDTreeTests::approximateNearestTest()
+{
+    const int dim = 4;
+    const int count = 5000;
+    const int k = 5;
+    QList<QVectorND> backupList;
+    QKDTree tree(dim);
+
+    for (int i = 0; i < count; i++)
+    {
+        backupList.append(_randomNDimensional(dim));
+        QVERIFY(tree.add(backupList.last(), i));
+    }
+
+    const QList<qreal> epsilons = QList<qreal>() << 0.0 << 0.1 << 0.5 << 2.0;
+    for (int i = 0; i < 300; i++)
+    {
+        const QVectorND pos = _randomNDimensional(dim);
+
+        QList<qreal> dists;
+        foreach(const QVectorND& vec, backupList)
+            dists.append(tree.distanceMetric()->distance(vec, pos));
+        std::sort(dists.begin(), dists.end());
+
+        foreach(qreal epsilon, epsilons)
+        {
+            //Distances are squared, so the allowance is too. A hair more covers rounding.
+            const qreal allowance = (1.0 + epsilon) * (1.0 + epsilon) * (1.0 + 1e-12);
+
+            QKDTreeNode nearest;
+            QVERIFY(tree.nearestNode(pos, &nearest, 0, epsilon));
+            const qreal treeDistance = tree.distanceMetric()->distance(nearest.position(), pos);
+            if (epsilon == 0.0)
+                QVERIFY(treeDistance == dists.first());
+            else
+                QVERIFY(treeDistance <= dists.first() * allowance);
+
+            QList<QKDTreeNode> nearestK;
+            QVERIFY(tree.nearestNodes(pos, k, &nearestK, 0, epsilon));
+            QVERIFY(nearestK.size() == k);
+            for (int j = 0; j < k; j++)
+            {
+                const qreal dist = tree.distanceMetric()->distance(nearestK[j].position(), pos);
+                if (epsilon == 0.0)
+                    QVERIFY(dist == dists[j]);
+                else
+                    QVERIFY(dist <= dists[j] * allowance);
+            }
+        }
+    }
+
+    QKDTreeNode nearest;
+    QList<QKDTreeNode> nearestK;
+    QVERIFY(!tree.nearestNode(backupList.first(), &nearest, 0, -0.5));
+    QVERIFY(!tree.nearestNodes(backupList.first(), k, &nearestK, 0, -0.5));
+}
+
+//private test
+void QKDTreeTests::bestBinTest()
+{
+    const int dim = 32;
+    const int count = 3000;
+    const int k = 5;
+    QList<QVectorND> backupList;
+    CountingMetric * metric = new CountingMetric();
+    QKDTree tree(dim, false, metric);
+
+    for (int i = 0; i < count; i++)
+    {
+        backupList.append(_randomNDimensional(dim));
+        QVERIFY(tree.add(backupList.last(), i));
+    }
+
+    const QList<int> budgets = QList<int>() << 1 << 16 << 256 << 0;
+    QList<int> hits;
+    for (int b = 0; b < budgets.size(); b++)
+        hits.append(0);
+
+    for (int i = 0; i < 50; i++)
+    {
+        const QVectorND pos = _randomNDimensional(dim);
+
+        QList<qreal> dists;
+        foreach(const QVectorND& vec, backupList)
+            dists.append(tree.distanceMetric()->distance(vec, pos));
+        std::sort(dists.begin(), dists.end());
+
+        for (int b = 0; b < budgets.size(); b++)
+        {
+            QList<QKDTreeNode> nearest;
+            metric->calls = 0;
+            QVERIFY(tree.bestBinNearestNodes(pos, k, budgets[b], &nearest));
+            if (budgets[b] > 0)
+                QVERIFY(metric->calls <= budgets[b]);
+            QVERIFY(nearest.size() == ((budgets[b] > 0) ? qMin(k, budgets[b]) : k));
+
+            //Whatever was found is sorted and no nearer than the true answers
+            for (int j = 0; j < nearest.size(); j++)
+            {
+                const qreal dist = tree.distanceMetric()->distance(nearest[j].position(), pos);
+                QVERIFY(dist >= dists[j]);
+                if (j > 0)
+                    QVERIFY(dist >= tree.distanceMetric()->distance(nearest[j - 1].position(), pos));
+                if (budgets[b] == 0)
+                    QVERIFY(dist == dists[j]);
+            }
+
+            if (!nearest.isEmpty() && tree.distanceMetric()->distance(nearest.first().position(), pos) == dists.first())
+                hits[b]++;
+        }
+
+        QKDTreeNode nearestNode;
+        QVERIFY(tree.bestBinNearestNode(pos, 0, &nearestNode));
+        QVERIFY(tree.distanceMetric()->distance(nearestNode.position(), pos) == dists.first());
+    }
+
+    //Bigger budgets find the true nearest neighbor more often
+    for (int b = 1; b < budgets.size(); b++)
+        QVERIFY(hits[b] >= hits[b - 1]);
+    QVERIFY(hits.last() == 50);
+
+    QList<QKDTreeNode> nearest;
+    QVERIFY(!tree.bestBinNearestNodes(backupList.first(), 0, 16, &nearest));
+    QVERIFY(!tree.bestBinNearestNodes(QVectorND(QPointF(1, 2)), k, 16, &nearest));
+    QVERIFY(!tree.bestBinNearestNodes(backupList.first(), k, 16, 0));
+}
+
 void QKDTreeTests::nearestPosByPosTest()
 {
     const int dim = 3;
@@ -192,148 +514,3332 @@ void QKDTreeTests::nearestPosByPosTest()
 }
 
 //private test
-void QKDTreeTests::benchmarkTreeAdd1()
+void QKDTreeTests::buildTest()
 {
-    QKDTree tree(2);
-    for (int i = 0; i < size1; i++)
+    const int dim = 3;
+    const int count = 5000;
+    QVector<QVectorND> positions;
+    QVector<QVariant> values;
+    for (int i = 0; i < count; i++)
     {
-        QVectorND pos = _randomNDimensional(2);
+        positions.append(_randomNDimensional(dim));
+        values.append(i);
+    }
 
-        tree.add(pos, i);
+    QKDTree tree(dim);
+    QVERIFY(tree.build(positions, values));
+    QVERIFY(tree.size() == count);
+    QVERIFY(tree.depth() <= std::ceil(std::log(count + 1.0) / std::log(2.0)) + 1);
+
+    for (int i = 0; i < count; i++)
+    {
+        QVariant val;
+        QVERIFY(tree.value(positions[i], &val));
+        QVERIFY(val == i);
     }
 
-    QBENCHMARK
+    for (int i = 0; i < count; i++)
     {
-        QVectorND pos = _randomNDimensional(2);
+        const QVectorND searchPoint = _randomNDimensional(dim);
 
-        tree.add(pos, "final");
+        QKDTreeNode nearest;
+        QVERIFY(tree.nearestNode(searchPoint, &nearest));
+        const qreal treeDist = tree.distanceMetric()->distance(nearest.position(), searchPoint);
+
+        qreal bestDist = std::numeric_limits<qreal>::max();
+        foreach(const QVectorND& candidate, positions)
+            bestDist = qMin(bestDist, tree.distanceMetric()->distance(candidate, searchPoint));
+
+        QVERIFY(treeDist == bestDist);
     }
+
+    //Incremental adds should still work on a bulk-loaded tree
+    const QVectorND extra = _randomNDimensional(dim);
+    QVERIFY(tree.add(extra, "extra"));
+    QVERIFY(tree.containsKey(extra));
 }
 
 //private test
-void QKDTreeTests::benchmarkTreeAdd2()
+void QKDTreeTests::buildSortedTest()
 {
-    QKDTree tree(2);
-    for (int i = 0; i < size2; i++)
+    const int count = 4096;
+    QVector<QVectorND> positions;
+    QVector<QVariant> values;
+    for (int i = 0; i < count; i++)
     {
-        QVectorND pos = _randomNDimensional(2);
-
-        tree.add(pos, i);
+        positions.append(QVectorND(QPointF(i, -i)));
+        values.append(i);
     }
 
-    QBENCHMARK
-    {
-        QVectorND pos = _randomNDimensional(2);
+    QKDTree tree(2);
+    QVERIFY(tree.build(positions, values));
+    QVERIFY(tree.size() == count);
+    QVERIFY(tree.depth() == 13);
 
-        tree.add(pos, "final");
-    }
+    for (int i = 0; i < count; i++)
+        QVERIFY(tree.containsKey(positions[i]));
+
+    QKDTree incremental(2);
+    for (int i = 0; i < count; i++)
+        incremental.add(positions[i], values[i]);
+    QVERIFY(incremental.depth() == count);
 }
 
 //private test
-void QKDTreeTests::benchmarkTreeNearest1()
+void QKDTreeTests::buildDuplicatesTest()
 {
-    QKDTree tree(2);
-    QList<QVectorND> results;
-
-    for (int i = 0; i < size1; i++)
+    QVector<QVectorND> positions;
+    QVector<QVariant> values;
+    for (int i = 0; i < 100; i++)
     {
-        QVectorND pos = _randomNDimensional(2);
-
-        tree.add(pos, i);
+        positions.append(QVectorND(QPointF(i % 10, 0)));
+        values.append(i);
     }
 
-    for (int i = 0; i < 1; i++)
-    {
-        QVectorND pos = _randomNDimensional(2);
+    QKDTree unique(2);
+    QVERIFY(unique.build(positions, values));
+    QVERIFY(unique.size() == 10);
 
-        QKDTreeNode nearestResult;
-        QBENCHMARK
-        {
-            tree.nearestNode(pos, &nearestResult);
-        }
+    //Like add(), the first occurrence of a key wins
+    QVariant val;
+    QVERIFY(unique.value(QPointF(3,0), &val));
+    QVERIFY(val == 3);
 
-        results.append(nearestResult.position());
-    }
+    QKDTree duplicates(2, true);
+    QVERIFY(duplicates.build(positions, values));
+    QVERIFY(duplicates.size() == 100);
+    for (int i = 0; i < 10; i++)
+        QVERIFY(duplicates.containsKey(QPointF(i, 0)));
+
+    values.removeLast();
+    QString result;
+    QVERIFY(!duplicates.build(positions, values, &result));
+    QVERIFY(!result.isEmpty());
 }
 
 //private test
-void QKDTreeTests::benchmarkTreeNearest2()
+void QKDTreeTests::parallelBuildTest()
 {
-    QKDTree tree(2);
-    QList<QVectorND> results;
-
-    for (int i = 0; i < size2; i++)
+    //Coarse coordinates so there are plenty of ties and duplicate keys
+    QVector<QVectorND> positions;
+    QVector<QVariant> values;
+    for (int i = 0; i < 150000; i++)
     {
-        QVectorND pos = _randomNDimensional(2);
-
-        tree.add(pos, i);
+        QVectorND pos = _randomNDimensional(3);
+        for (int j = 0; j < 3; j++)
+            pos[j] = std::floor(pos[j] / (RAND_MAX / 64));
+        positions.append(pos);
+        values.append(i);
     }
 
-    for (int i = 0; i < 1; i++)
+    for (int duplicates = 0; duplicates < 2; duplicates++)
     {
-        QVectorND pos = _randomNDimensional(2);
-
-        QKDTreeNode nearestResult;
-        QBENCHMARK
+        QKDTree serial(3, duplicates == 1);
+        QVERIFY(serial.build(positions, values));
+
+        QList<QKDTreeNode> serialOrder;
+        const QVectorND min(QList<qreal>() << -1 << -1 << -1);
+        const QVectorND max(QList<qreal>() << 100 << 100 << 100);
+        QVERIFY(serial.rangeQuery(min, max, &serialOrder));
+        QVERIFY(serialOrder.size() == serial.size());
+
+        //A range query walks the tree depth-first, so equal orders mean equal trees
+        const int threadCounts[] = {2, 3, 8, 0};
+        for (int t = 0; t < 4; t++)
         {
-            tree.nearestNode(pos, &nearestResult);
+            QKDTree parallel(3, duplicates == 1);
+            QVERIFY(parallel.build(positions, values, 0, threadCounts[t]));
+            QVERIFY(parallel.size() == serial.size());
+            QVERIFY(parallel.depth() == serial.depth());
+
+            QList<QKDTreeNode> parallelOrder;
+            QVERIFY(parallel.rangeQuery(min, max, &parallelOrder));
+            QVERIFY(parallelOrder.size() == serialOrder.size());
+            bool same = true;
+            for (int i = 0; i < serialOrder.size() && same; i++)
+            {
+                same = serialOrder[i].position() == parallelOrder[i].position()
+                        && serialOrder[i].value() == parallelOrder[i].value();
+            }
+            QVERIFY(same);
         }
-
-        results.append(nearestResult.position());
     }
 }
 
 //private test
-void QKDTreeTests::benchmarkListAdd1()
+void QKDTreeTests::nearestIndexTest()
 {
-    QList<QVectorND> list;
-
-    for (int i = 0; i < size1; i++)
+    const int dim = 3;
+    const int count = 5000;
+    QKDTree tree(dim);
+    QKDTree manhattan(dim, false, new ManhattanMetric());
+    QList<QVectorND> positions;
+    for (int i = 0; i < count; i++)
     {
-        QVectorND pos = _randomNDimensional(2);
-        list.append(pos);
+        positions.append(_randomNDimensional(dim));
+        QVERIFY(tree.add(positions.last(), i));
+        QVERIFY(manhattan.add(positions.last(), i));
     }
 
-    QBENCHMARK
+    QList<QVectorND> queries;
+    for (int i = 0; i < 200; i++)
+        queries.append(_randomNDimensional(dim));
+
+    const QList<const QKDTree *> trees = QList<const QKDTree *>() << &tree << &manhattan;
+    foreach(const QKDTree * current, trees)
     {
-        QVectorND pos = _randomNDimensional(2);
-        list.append(pos);
+        for (int q = 0; q < queries.size(); q++)
+        {
+            qreal bestDist = std::numeric_limits<qreal>::max();
+            for (int i = 0; i < count; i++)
+                bestDist = qMin(bestDist, current->distanceMetric()->distance(positions[i], queries[q]));
+
+            quint32 index;
+            qreal dist;
+            QVERIFY(current->nearestIndex(queries[q], &index, &dist));
+            QVERIFY(dist == bestDist);
+            const QVectorND key(current->keyAt(index), dim);
+            QVERIFY(current->distanceMetric()->distance(key, queries[q]) == bestDist);
+            QVERIFY(positions[current->valueAt(index).toInt()] == key);
+        }
+
+        //Once warmed up, queries make no allocations at all
+        quint32 index;
+        QVERIFY(current->nearestIndex(queries[0], &index));
+        const int before = allocationCount.load();
+        for (int q = 0; q < queries.size(); q++)
+            current->nearestIndex(queries[q], &index);
+        QVERIFY(allocationCount.load() == before);
     }
+
+    quint32 index;
+    QVERIFY(!tree.nearestIndex(QVectorND(QPointF(1, 2)), &index));
+    QVERIFY(!tree.nearestIndex(queries[0], 0));
+    QKDTree empty(dim);
+    QVERIFY(!empty.nearestIndex(queries[0], &index));
 }
 
 //private test
-void QKDTreeTests::benchmarkListAdd2()
+void QKDTreeTests::builtinMetricsTest()
 {
-    QList<QVectorND> list;
+    const int dim = 3;
+    const int count = 3000;
+    const int k = 5;
 
-    for (int i = 0; i < size2; i++)
+    QVector<qreal> weights;
+    weights << 1.0 << 4.0 << 0.25;
+
+    QList<QKDTree *> trees;
+    trees.append(new QKDTree(dim, false, new QKDTreeSquaredEuclideanMetric()));
+    trees.append(new QKDTree(dim, false, new QKDTreeManhattanMetric()));
+    trees.append(new QKDTree(dim, false, new QKDTreeChebyshevMetric()));
+    trees.append(new QKDTree(dim, false, new QKDTreeWeightedEuclideanMetric(QKDTreeMetrics::WeightedEuclidean(weights))));
+    trees.append(new QKDTree(dim, false, new ManhattanMetric()));
+    trees.append(new QKDTree(dim, false, new AxisManhattanMetric()));
+
+    QList<QVectorND> positions;
+    for (int i = 0; i < count; i++)
     {
-        QVectorND pos = _randomNDimensional(2);
-        list.append(pos);
+        positions.append(_randomNDimensional(dim));
+        foreach(QKDTree * tree, trees)
+            QVERIFY(tree->add(positions.last(), i));
     }
 
-    QBENCHMARK
+    QList<QVectorND> queries;
+    for (int i = 0; i < 100; i++)
+        queries.append(_randomNDimensional(dim));
+
+    foreach(QKDTree * tree, trees)
     {
-        QVectorND pos = _randomNDimensional(2);
-        list.append(pos);
+        const QKDTreeDistanceMetric * metric = tree->distanceMetric();
+        for (int q = 0; q < queries.size(); q++)
+        {
+            QList<qreal> dists;
+            for (int i = 0; i < count; i++)
+                dists.append(metric->distance(positions[i], queries[q]));
+            std::sort(dists.begin(), dists.end());
+
+            quint32 index;
+            qreal dist;
+            QVERIFY(tree->nearestIndex(queries[q], &index, &dist));
+            QVERIFY(dist == dists.first());
+
+            QList<QKDTreeNode> nearest;
+            QVERIFY(tree->nearestNodes(queries[q], k, &nearest));
+            QVERIFY(nearest.size() == k);
+            for (int i = 0; i < k; i++)
+                QVERIFY(metric->distance(nearest[i].position(), queries[q]) == dists[i]);
+
+            const qreal radius = dists[k];
+            QList<QKDTreeNode> within;
+            QVERIFY(tree->withinDistance(queries[q], radius, &within));
+            int expected = 0;
+            while (expected < count && dists[expected] <= radius)
+                expected++;
+            QVERIFY(within.size() == expected);
+        }
+
+        //Folding the axis distances gives back the whole distance
+        if (metric->hasAxisDistance())
+        {
+            const QVectorND& a = positions[0];
+            const QVectorND& b = positions[1];
+            qreal folded = 0.0;
+            for (int i = 0; i < dim; i++)
+                folded = metric->accumulate(folded, metric->axisDistance(i, a[i] - b[i]));
+            QVERIFY(folded == metric->distance(a, b));
+        }
+    }
+
+    //The built-in metrics are searched without allocating, just like the default one
+    for (int t = 0; t < 4; t++)
+    {
+        quint32 index;
+        QVERIFY(trees[t]->nearestIndex(queries[0], &index));
+        const int before = allocationCount.load();
+        for (int q = 0; q < queries.size(); q++)
+            trees[t]->nearestIndex(queries[q], &index);
+        QVERIFY(allocationCount.load() == before);
     }
+
+    //Weights that don't fit the tree are turned away and the old metric kept
+    QVector<qreal> tooFew;
+    tooFew << 1.0 << 2.0;
+    QVector<qreal> negative;
+    negative << 1.0 << -2.0 << 1.0;
+    QKDTreeWeightedEuclideanMetric tooFewMetric((QKDTreeMetrics::WeightedEuclidean(tooFew)));
+    QKDTreeWeightedEuclideanMetric negativeMetric((QKDTreeMetrics::WeightedEuclidean(negative)));
+    QString result;
+    QVERIFY(!trees[3]->setDistanceMetric(&tooFewMetric, false, &result));
+    QVERIFY(result == "Need exactly one weight per dimension");
+    QVERIFY(!trees[3]->setDistanceMetric(&negativeMetric, false, &result));
+    QVERIFY(result == "Weights must not be negative");
+    QVERIFY(trees[3]->distanceMetric() != &tooFewMetric && trees[3]->distanceMetric() != &negativeMetric);
+    quint32 index;
+    QVERIFY(trees[3]->nearestIndex(queries[0], &index));
+
+    //and the constructors fall back to the default metric, with a warning
+    QTest::ignoreMessage(QtWarningMsg, "QKDTree: distance metric rejected (Need exactly one weight per dimension), "
+                                       "using euclidean distance squared instead");
+    QKDTreeDistanceMetric * rejected = new QKDTreeWeightedEuclideanMetric(QKDTreeMetrics::WeightedEuclidean(tooFew));
+    QKDTree fallback(dim, false, rejected);
+    QVERIFY(fallback.distanceMetric() != rejected);
+    QVERIFY(dynamic_cast<QKDTreeWeightedEuclideanMetric *>(fallback.distanceMetric()) == 0);
+    QVERIFY(fallback.add(queries[0], 0));
+    QVERIFY(fallback.nearestIndex(queries[1], &index));
+
+    QTest::ignoreMessage(QtWarningMsg, "QKDForest: distance metric rejected (Weights must not be negative), "
+                                       "using euclidean distance squared instead");
+    rejected = new QKDTreeWeightedEuclideanMetric(QKDTreeMetrics::WeightedEuclidean(negative));
+    QKDForest fallbackForest(dim, false, rejected);
+    QVERIFY(fallbackForest.distanceMetric() != rejected);
+
+    QTest::ignoreMessage(QtWarningMsg, "QKDSnapshotTree: distance metric rejected (Need exactly one weight per "
+                                       "dimension), using euclidean distance squared instead");
+    rejected = new QKDTreeWeightedEuclideanMetric(QKDTreeMetrics::WeightedEuclidean(tooFew));
+    QKDSnapshotTree fallbackSnapshots(dim, false, rejected);
+    QVERIFY(fallbackSnapshots.distanceMetric() != rejected);
+
+    QKDTreeDistanceMetric * accepted = new QKDTreeWeightedEuclideanMetric(QKDTreeMetrics::WeightedEuclidean(weights));
+    QKDSnapshotTree weightedSnapshots(dim, false, accepted);
+    QVERIFY(weightedSnapshots.distanceMetric() == accepted);
+
+    qDeleteAll(trees);
 }
 
 //private test
-void QKDTreeTests::benchmarkListNearest1()
+void QKDTreeTests::nearestIteratorTest()
 {
-    QList<QVectorND> list;
-    QList<QVectorND> results;
+    const int dim = 3;
+    const int count = 2000;
 
-    for (int i = 0; i < size1; i++)
+    QKDTree empty(dim);
+    QKDTreeNearestIterator emptyIt(&empty, _randomNDimensional(dim));
+    QKDTreeNode node;
+    QString result;
+    QVERIFY(!emptyIt.next(&node, 0, &result));
+    QVERIFY(result == "No more nodes");
+
+    QKDTree tree(dim);
+    QKDTree manhattan(dim, false, new QKDTreeManhattanMetric());
+    QKDTree custom(dim, false, new ManhattanMetric());
+    QList<QVectorND> refList;
+    for (int i = 0; i < count; i++)
     {
-        QVectorND pos = _randomNDimensional(2);
-        list.append(pos);
+        refList.append(_randomNDimensional(dim));
+        QVERIFY(tree.add(refList.last(), i));
+        QVERIFY(manhattan.add(refList.last(), i));
+        QVERIFY(custom.add(refList.last(), i));
     }
 
-    for (int i = 0; i < 1; i++)
-    {
-        QVectorND pos = _randomNDimensional(2);
+    //Dead nodes still divide space but must never be handed out
+    for (int i = 0; i < count; i += 5)
+        QVERIFY(tree.remove(refList[i]));
+
+    QKDTreeNearestIterator badDim(&tree, _randomNDimensional(dim + 1));
+    QVERIFY(!badDim.next(&node, 0, &result));
+    QVERIFY(result == "Dimension of position does not match that of tree.");
+
+    QKDTree * trees[] = {&tree, &manhattan, &custom};
+    for (int t = 0; t < 3; t++)
+    {
+        const QKDTree * current = trees[t];
+        for (int q = 0; q < 20; q++)
+        {
+            const QVectorND searchPoint = _randomNDimensional(dim);
+
+            QVector<qreal> listDists;
+            for (int i = 0; i < count; i++)
+            {
+                if (current->containsKey(refList[i]))
+                    listDists.append(current->distanceMetric()->distance(refList[i], searchPoint));
+            }
+            std::sort(listDists.begin(), listDists.end());
+
+            //Every pair comes out exactly once, in order of distance
+            QKDTreeNearestIterator it(current, searchPoint);
+            QSet<int> seen;
+            qreal distance;
+            while (it.next(&node, &distance))
+            {
+                QVERIFY(distance == listDists[seen.size()]);
+                QVERIFY(current->distanceMetric()->distance(node.position(), searchPoint) == distance);
+                QVERIFY(!seen.contains(node.value().toInt()));
+                seen.insert(node.value().toInt());
+            }
+            QVERIFY(seen.size() == current->size());
+            QVERIFY(it.count() == current->size());
+            QVERIFY(!it.next(&node));
+
+            QList<QKDTreeNode> nearestK;
+            QVERIFY(current->nearestNodes(searchPoint, 10, &nearestK));
+            QKDTreeNearestIterator indexIt(current, searchPoint);
+            for (int j = 0; j < 10; j++)
+            {
+                quint32 index;
+                QVERIFY(indexIt.nextIndex(&index, &distance));
+                QVERIFY(distance == listDists[j]);
+                QVERIFY(QVectorND(current->keyAt(index), dim) == nearestK[j].position());
+            }
+        }
+    }
+
+    //Taking the first few neighbors of a big tree only computes a few distances
+    CountingMetric * metric = new CountingMetric();
+    QKDTree counted(2, false, metric);
+    for (int i = 0; i < 20000; i++)
+        QVERIFY(counted.add(_randomNDimensional(2), i));
+    QKDTreeNearestIterator lazy(&counted, _randomNDimensional(2));
+    for (int j = 0; j < 10; j++)
+        QVERIFY(lazy.next(&node));
+    QVERIFY(metric->calls < 500);
+}
+
+//private test
+void QKDTreeTests::nearestNodesTest()
+{
+    const int dim = 3;
+    const int count = 3000;
+    const int k = 10;
+    QList<QVectorND> refList;
+    QKDTree tree(dim);
+
+    for (int i = 0; i < count; i++)
+    {
+        const QVectorND pos = _randomNDimensional(dim);
+        refList.append(pos);
+        QVERIFY(tree.add(pos, i));
+    }
+
+    for (int i = 0; i < 500; i++)
+    {
+        const QVectorND searchPoint = _randomNDimensional(dim);
+
+        QList<QKDTreeNode> nearest;
+        QVERIFY(tree.nearestNodes(searchPoint, k, &nearest));
+        QVERIFY(nearest.size() == k);
+
+        QVector<qreal> listDists;
+        foreach(const QVectorND& candidate, refList)
+            listDists.append(tree.distanceMetric()->distance(candidate, searchPoint));
+        std::sort(listDists.begin(), listDists.end());
+
+        for (int j = 0; j < k; j++)
+            QVERIFY(tree.distanceMetric()->distance(nearest[j].position(), searchPoint) == listDists[j]);
+    }
+
+    //Asking for more than we have returns everything
+    QKDTree small(2);
+    small.add(QPointF(0,0), 1);
+    small.add(QPointF(5,5), 2);
+    small.add(QPointF(1,1), 3);
+
+    QList<QKDTreeNode> all;
+    QVERIFY(small.nearestNodes(QPointF(0,0), 10, &all));
+    QVERIFY(all.size() == 3);
+    QVERIFY(all[0].value() == 1);
+    QVERIFY(all[1].value() == 3);
+    QVERIFY(all[2].value() == 2);
+
+    QVERIFY(!small.nearestNodes(QPointF(0,0), 0, &all));
+}
+
+//private test
+void QKDTreeTests::batchNearestTest()
+{
+    const int dim = 3;
+    QKDTree tree(dim);
+    QVector<QVectorND> queries;
+    QVector<QKDTreeNode> results;
+
+    QString error;
+    queries.append(_randomNDimensional(dim));
+    QVERIFY(!tree.nearestNodes(queries, &results, &error));
+    QVERIFY(!error.isEmpty());
+
+    for (int i = 0; i < 3000; i++)
+        QVERIFY(tree.add(_randomNDimensional(dim), i));
+
+    queries.clear();
+    QVERIFY(tree.nearestNodes(queries, &results));
+    QVERIFY(results.isEmpty());
+
+    for (int i = 0; i < 5000; i++)
+        queries.append(_randomNDimensional(dim));
+
+    QVERIFY(!tree.nearestNodes(queries, 0));
+
+    //Same answers as one query at a time, in the same order, whatever the number of threads
+    QThreadPool pool;
+    for (int threads = 1; threads <= 4; threads *= 2)
+    {
+        pool.setMaxThreadCount(threads);
+        QVERIFY(tree.nearestNodes(queries, &results, 0, &pool));
+        QVERIFY(results.size() == queries.size());
+        for (int i = 0; i < queries.size(); i++)
+        {
+            QKDTreeNode nearest;
+            QVERIFY(tree.nearestNode(queries[i], &nearest));
+            QVERIFY(results[i].position() == nearest.position());
+            QVERIFY(results[i].value() == nearest.value());
+        }
+    }
+    QVERIFY(tree.nearestNodes(queries, &results));
+    QVERIFY(results.size() == queries.size());
+
+    queries.append(_randomNDimensional(2));
+    QVERIFY(!tree.nearestNodes(queries, &results, &error));
+}
+
+//private test
+void QKDTreeTests::knnGraphTest()
+{
+    const int k = 6;
+    QVector<qint64> offsets;
+    QVector<quint32> neighbors;
+    QVector<qreal> distances;
+    QString result;
+
+    QKDTree tree(2, true);
+    QVERIFY(!tree.knnGraph(0, &offsets, &neighbors, 0, &result));
+    QVERIFY(result == "k must be positive");
+    QVERIFY(!tree.knnGraph(k, 0, &neighbors));
+    QVERIFY(tree.knnGraph(k, &offsets, &neighbors));
+    QVERIFY(offsets.size() == 1 && neighbors.isEmpty());
+
+    QVERIFY(tree.add(_randomNDimensional(2), -1));
+    QVERIFY(tree.knnGraph(k, &offsets, &neighbors));
+    QVERIFY(offsets.size() == 2 && offsets[1] == 0);
+
+    //Removals leave dead and free slots behind, and copies of one key can crowd a key out of its own results
+    QList<QVectorND> refList;
+    for (int i = 0; i < 1500; i++)
+    {
+        refList.append(_randomNDimensional(2));
+        QVERIFY(tree.add(refList.last(), i));
+    }
+    for (int i = 0; i < 10; i++)
+        QVERIFY(tree.add(refList[0], 1500 + i));
+    for (int i = 1; i < 1500; i += 4)
+        QVERIFY(tree.remove(refList[i]));
+
+    QVERIFY(tree.knnGraph(k, &offsets, &neighbors, &distances));
+    QVERIFY(neighbors.size() == tree.size() * k);
+    QVERIFY(distances.size() == neighbors.size());
+    QVERIFY(offsets.last() == neighbors.size());
+
+    QBitArray live(offsets.size() - 1);
+    for (QKDTree::const_iterator it = tree.begin(); it != tree.end(); ++it)
+        live.setBit(it.index());
+
+    const QKDTreeDistanceMetric * metric = tree.distanceMetric();
+    for (int i = 0; i < live.size(); i++)
+    {
+        const qint64 rowLength = offsets[i + 1] - offsets[i];
+        if (!live.testBit(i))
+        {
+            QVERIFY(rowLength == 0);
+            continue;
+        }
+        QVERIFY(rowLength == k);
+
+        const QVectorND key(tree.keyAt(i), 2);
+        QVector<qreal> listDists;
+        for (QKDTree::const_iterator it = tree.begin(); it != tree.end(); ++it)
+        {
+            if (it.index() != quint32(i))
+                listDists.append(metric->distance(QVectorND(it.key(), 2), key));
+        }
+        std::sort(listDists.begin(), listDists.end());
+
+        for (qint64 j = offsets[i]; j < offsets[i + 1]; j++)
+        {
+            QVERIFY(neighbors[j] != quint32(i) && live.testBit(neighbors[j]));
+            QVERIFY(distances[j] == listDists[j - offsets[i]]);
+            QVERIFY(metric->distance(QVectorND(tree.keyAt(neighbors[j]), 2), key) == distances[j]);
+        }
+    }
+
+    //Splitting the work over threads doesn't change the answer
+    QThreadPool single;
+    single.setMaxThreadCount(1);
+    QVector<qint64> serialOffsets;
+    QVector<quint32> serialNeighbors;
+    QVERIFY(tree.knnGraph(k, &serialOffsets, &serialNeighbors, 0, 0, &single));
+    QVERIFY(serialOffsets == offsets);
+    QVERIFY(serialNeighbors == neighbors);
+
+    //With k or fewer other keys, each key is joined to all of them
+    QVERIFY(tree.knnGraph(5000, &offsets, &neighbors));
+    QVERIFY(neighbors.size() == tree.size() * (tree.size() - 1));
+}
+
+//private test
+void QKDTreeTests::nearestJoinTest()
+{
+    const int dim = 3;
+    QVector<quint32> nearest;
+    QVector<qreal> distances;
+    QString result;
+
+    QKDTree tree(dim, true);
+    QKDTree queries(dim, true);
+    QVERIFY(!tree.nearestJoin(queries, 0, &distances, &result));
+    QVERIFY(!tree.nearestJoin(QKDTree(dim + 1), &nearest, 0, &result));
+    QVERIFY(tree.nearestJoin(queries, &nearest, &distances));
+    QVERIFY(nearest.isEmpty() && distances.isEmpty());
+
+    QVERIFY(queries.add(_randomNDimensional(dim), -1));
+    QVERIFY(!tree.nearestJoin(queries, &nearest, 0, &result));
+    QVERIFY(result == "Tree is empty");
+
+    //Removals leave dead and free slots behind in both trees
+    QList<QVectorND> refList;
+    for (int i = 0; i < 2000; i++)
+    {
+        refList.append(_randomNDimensional(dim));
+        QVERIFY(tree.add(refList.last(), i));
+    }
+    for (int i = 0; i < 2000; i += 3)
+        QVERIFY(tree.remove(refList[i]));
+
+    QList<QVectorND> queryList;
+    for (int i = 0; i < 1500; i++)
+    {
+        queryList.append(_randomNDimensional(dim));
+        QVERIFY(queries.add(queryList.last(), i));
+    }
+    for (int i = 1; i < 1500; i += 5)
+        QVERIFY(queries.remove(queryList[i]));
+
+    //Built-in and custom metrics, with and without axis distances
+    QList<QKDTreeDistanceMetric *> metrics;
+    metrics << 0 << new QKDTreeManhattanMetric() << new ManhattanMetric() << new AxisManhattanMetric();
+    foreach(QKDTreeDistanceMetric * distanceMetric, metrics)
+    {
+        tree.setDistanceMetric(distanceMetric);
+        QVERIFY(tree.nearestJoin(queries, &nearest, &distances));
+        QVERIFY(distances.size() == nearest.size());
+
+        QBitArray live(nearest.size());
+        for (QKDTree::const_iterator it = queries.begin(); it != queries.end(); ++it)
+            live.setBit(it.index());
+
+        const QKDTreeDistanceMetric * metric = tree.distanceMetric();
+        for (int i = 0; i < nearest.size(); i++)
+        {
+            if (!live.testBit(i))
+            {
+                QVERIFY(nearest[i] == 0xFFFFFFFF && distances[i] == -1.0);
+                continue;
+            }
+
+            const QVectorND key(queries.keyAt(i), dim);
+            qreal bestDist = std::numeric_limits<qreal>::max();
+            for (QKDTree::const_iterator it = tree.begin(); it != tree.end(); ++it)
+                bestDist = qMin(bestDist, metric->distance(QVectorND(it.key(), dim), key));
+
+            QVERIFY(distances[i] == bestDist);
+            QVERIFY(metric->distance(QVectorND(tree.keyAt(nearest[i]), dim), key) == bestDist);
+        }
+    }
+
+    //Splitting the work over threads doesn't change the answer
+    QThreadPool single;
+    single.setMaxThreadCount(1);
+    QVector<quint32> serialNearest;
+    QVERIFY(tree.nearestJoin(queries, &serialNearest, 0, 0, &single));
+    QVERIFY(serialNearest == nearest);
+
+    //Every key is its own nearest neighbor
+    QVERIFY(queries.nearestJoin(queries, &nearest, &distances));
+    for (QKDTree::const_iterator it = queries.begin(); it != queries.end(); ++it)
+        QVERIFY(distances[it.index()] == 0.0);
+}
+
+//private test
+void QKDTreeTests::withinDistanceTest()
+{
+    const int dim = 3;
+    const int count = 3000;
+    QList<QVectorND> refList;
+    QKDTree tree(dim);
+
+    for (int i = 0; i < count; i++)
+    {
+        const QVectorND pos = _randomNDimensional(dim);
+        refList.append(pos);
+        QVERIFY(tree.add(pos, i));
+    }
+
+    //Squared distance, so this is a sphere of radius RAND_MAX / 10
+    const qreal radius = qreal(RAND_MAX) * RAND_MAX / 100.0;
+    for (int i = 0; i < 200; i++)
+    {
+        const QVectorND center = _randomNDimensional(dim);
+
+        QList<QKDTreeNode> found;
+        QVERIFY(tree.withinDistance(center, radius, &found));
+
+        int expected = 0;
+        foreach(const QVectorND& candidate, refList)
+        {
+            if (tree.distanceMetric()->distance(candidate, center) <= radius)
+                expected++;
+        }
+        QVERIFY(found.size() == expected);
+
+        foreach(const QKDTreeNode& node, found)
+            QVERIFY(tree.distanceMetric()->distance(node.position(), center) <= radius);
+
+        CountingVisitor visitor;
+        QVERIFY(tree.withinDistance(center, radius, &visitor));
+        QVERIFY(visitor.count == expected);
+    }
+
+    QKDTree small(2);
+    small.add(QPointF(0,0), 1);
+    small.add(QPointF(3,4), 2);
+    small.add(QPointF(6,8), 3);
+
+    QList<QKDTreeNode> found;
+    QVERIFY(small.withinDistance(QPointF(0,0), 25.0, &found));
+    QVERIFY(found.size() == 2);
+    QVERIFY(!small.withinDistance(QVectorND(3), 25.0, &found));
+}
+
+//private test
+void QKDTreeTests::rangeQueryTest()
+{
+    const int dim = 3;
+    const int count = 3000;
+    QList<QVectorND> refList;
+    QKDTree tree(dim);
+
+    for (int i = 0; i < count; i++)
+    {
+        const QVectorND pos = _randomNDimensional(dim);
+        refList.append(pos);
+        QVERIFY(tree.add(pos, i));
+    }
+
+    for (int i = 0; i < 200; i++)
+    {
+        QVectorND min = _randomNDimensional(dim);
+        QVectorND max = _randomNDimensional(dim);
+        for (int j = 0; j < dim; j++)
+        {
+            if (min[j] > max[j])
+                qSwap(min[j], max[j]);
+        }
+
+        int expected = 0;
+        foreach(const QVectorND& candidate, refList)
+        {
+            bool inside = true;
+            for (int j = 0; j < dim; j++)
+                inside = inside && candidate[j] >= min[j] && candidate[j] <= max[j];
+            if (inside)
+                expected++;
+        }
+
+        QList<QKDTreeNode> found;
+        QVERIFY(tree.rangeQuery(min, max, &found));
+        QVERIFY(found.size() == expected);
+
+        CountingVisitor visitor;
+        QVERIFY(tree.rangeQuery(min, max, &visitor));
+        QVERIFY(visitor.count == expected);
+    }
+
+    QKDTree flat(2);
+    for (int x = 0; x < 10; x++)
+    {
+        for (int y = 0; y < 10; y++)
+            flat.add(QPointF(x, y), x * 10 + y);
+    }
+
+    //Bounds are inclusive, and rects are normalized
+    QList<QKDTreeNode> found;
+    QVERIFY(flat.rangeQuery(QRectF(2, 3, 2, 4), &found));
+    QVERIFY(found.size() == 15);
+    QVERIFY(flat.rangeQuery(QRectF(4, 7, -2, -4), &found));
+    QVERIFY(found.size() == 15);
+    QVERIFY(flat.rangeQuery(QRectF(20, 20, 5, 5), &found));
+    QVERIFY(found.isEmpty());
+}
+
+//private test
+void QKDTreeTests::removeTest()
+{
+    const int dim = 3;
+    const int count = 3000;
+    QList<QVectorND> alive;
+    QList<QVectorND> removed;
+    QKDTree tree(dim);
+
+    for (int i = 0; i < count; i++)
+    {
+        const QVectorND pos = _randomNDimensional(dim);
+        if (tree.add(pos, i))
+            alive.append(pos);
+    }
+
+    QString error;
+    QVERIFY(!tree.remove(_randomNDimensional(dim), &error));
+    QVERIFY(!error.isEmpty());
+    QVERIFY(!tree.remove(_randomNDimensional(2)));
+
+    //Take out two thirds, which forces plenty of subtree rebuilds along the way
+    while (alive.size() > count / 3)
+    {
+        const QVectorND pos = alive.takeAt(qrand() % alive.size());
+        QVERIFY(tree.remove(pos));
+        removed.append(pos);
+    }
+    QVERIFY(tree.size() == alive.size());
+
+    foreach(const QVectorND& pos, removed)
+    {
+        QVariant val;
+        QVERIFY(!tree.containsKey(pos));
+        QVERIFY(!tree.value(pos, &val));
+    }
+    foreach(const QVectorND& pos, alive)
+        QVERIFY(tree.containsKey(pos));
+
+    for (int i = 0; i < 300; i++)
+    {
+        const QVectorND searchPoint = _randomNDimensional(dim);
+
+        qreal bestDist = std::numeric_limits<qreal>::max();
+        foreach(const QVectorND& candidate, alive)
+            bestDist = qMin(bestDist, tree.distanceMetric()->distance(candidate, searchPoint));
+
+        QKDTreeNode nearest;
+        QVERIFY(tree.nearestNode(searchPoint, &nearest));
+        QVERIFY(tree.distanceMetric()->distance(nearest.position(), searchPoint) == bestDist);
+
+        QList<QKDTreeNode> nearestK;
+        QVERIFY(tree.nearestNodes(searchPoint, 5, &nearestK));
+        QVERIFY(tree.distanceMetric()->distance(nearestK[0].position(), searchPoint) == bestDist);
+        foreach(const QKDTreeNode& node, nearestK)
+            QVERIFY(!removed.contains(node.position()));
+    }
+
+    //Churn: the tree has to stay shallow while points come and go
+    for (int i = 0; i < 20000; i++)
+    {
+        QVERIFY(tree.remove(alive.takeAt(qrand() % alive.size())));
+        const QVectorND pos = _randomNDimensional(dim);
+        if (tree.add(pos, i))
+            alive.append(pos);
+    }
+    QVERIFY(tree.size() == alive.size());
+    QVERIFY(tree.depth() < 64);
+
+    QList<QKDTreeNode> everything;
+    const QVectorND min(QList<qreal>() << 0 << 0 << 0);
+    const QVectorND max(QList<qreal>() << RAND_MAX << RAND_MAX << RAND_MAX);
+    QVERIFY(tree.rangeQuery(min, max, &everything));
+    QVERIFY(everything.size() == alive.size());
+
+    foreach(const QVectorND& pos, alive)
+        QVERIFY(tree.remove(pos));
+    QVERIFY(tree.size() == 0);
+    QVERIFY(tree.depth() == 0);
+    QKDTreeNode nearest;
+    QVERIFY(!tree.nearestNode(_randomNDimensional(dim), &nearest));
+    QVERIFY(tree.add(alive.first(), "back"));
+    QVERIFY(tree.containsKey(alive.first()));
+}
+
+//private test
+void QKDTreeTests::removeDuplicatesTest()
+{
+    QKDTree tree(2, true);
+    for (int i = 0; i < 50; i++)
+    {
+        QVERIFY(tree.add(QPointF(i % 5, 0), i));
+        QVERIFY(tree.add(QPointF(i % 5, 1), i));
+    }
+
+    //Removing by node only takes out the pair with that value
+    QKDTreeNode node(QVectorND(QPointF(2, 0)), 7);
+    QVERIFY(tree.remove(&node));
+    QVERIFY(!tree.remove(&node));
+    QVERIFY(tree.size() == 99);
+
+    QList<QKDTreeNode> found;
+    QVERIFY(tree.withinDistance(QPointF(2, 0), 0.0, &found));
+    QVERIFY(found.size() == 9);
+    foreach(const QKDTreeNode& other, found)
+        QVERIFY(other.value() != 7);
+
+    //Removing by key takes out every copy
+    QVERIFY(tree.remove(QPointF(2, 0)));
+    QVERIFY(!tree.containsKey(QPointF(2, 0)));
+    QVERIFY(tree.containsKey(QPointF(2, 1)));
+    QVERIFY(tree.size() == 90);
+    QVERIFY(tree.withinDistance(QPointF(2, 1), 0.0, &found));
+    QVERIFY(found.size() == 10);
+}
+
+//private test
+void QKDTreeTests::balancedAddTest()
+{
+    QKDTree tree(2);
+    QVERIFY(tree.balanceFactor() == 0.0);
+    tree.setBalanceFactor(0.5);
+    QVERIFY(tree.balanceFactor() == 0.0);
+    tree.setBalanceFactor(2.0);
+    QVERIFY(tree.balanceFactor() == 2.0);
+
+    //Sorted input would make a plain tree a linked list
+    const int count = 4096;
+    for (int i = 0; i < count; i++)
+    {
+        QVERIFY(tree.add(QPointF(i, -i), i));
+        QVERIFY(tree.depth() <= 2 * std::log2(qreal(i + 1)) + 1);
+    }
+    QVERIFY(tree.size() == count);
+    QVERIFY(!tree.add(QPointF(17, -17), "duplicate"));
+
+    for (int i = 0; i < count; i++)
+    {
+        QVariant val;
+        QVERIFY(tree.value(QPointF(i, -i), &val));
+        QVERIFY(val == i);
+    }
+
+    QKDTreeNode nearest;
+    QVERIFY(tree.nearestNode(QPointF(1000.3, -1000.1), &nearest));
+    QVERIFY(nearest.value() == 1000);
+
+    //Mixing in removals keeps the bookkeeping straight
+    for (int i = 0; i < count; i += 2)
+        QVERIFY(tree.remove(QPointF(i, -i)));
+    for (int i = count; i < 2 * count; i++)
+        QVERIFY(tree.add(QPointF(i, -i), i));
+    QVERIFY(tree.size() == count + count / 2);
+    QVERIFY(tree.depth() <= 2 * std::log2(qreal(2 * count)) + 1);
+    for (int i = 0; i < 2 * count; i++)
+        QVERIFY(tree.containsKey(QPointF(i, -i)) == (i >= count || i % 2 == 1));
+}
+
+//private test
+void QKDTreeTests::iterationTest()
+{
+    const int dim = 3;
+    const int count = 2000;
+    const QString path = QDir::tempPath() + "/qkdtree_iteration_test.qkd";
+
+    QKDTree tree(dim);
+    QVERIFY(tree.begin() == tree.end());
+    RecordingVisitor emptyVisitor;
+    QVERIFY(tree.forEach(&emptyVisitor));
+    QVERIFY(emptyVisitor.values.isEmpty());
+    QVERIFY(!tree.forEach(0));
+
+    //Removing enough to trigger rebuilds leaves both dead nodes and free slots behind
+    QList<QVectorND> positions;
+    for (int i = 0; i < count; i++)
+    {
+        positions.append(_randomNDimensional(dim));
+        QVERIFY(tree.add(positions.last(), i));
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (i % 3 != 0)
+            QVERIFY(tree.remove(positions[i]));
+    }
+    for (int i = count; i < count + 200; i++)
+    {
+        positions.append(_randomNDimensional(dim));
+        QVERIFY(tree.add(positions.last(), i));
+    }
+
+    QBitArray expected(positions.size(), true);
+    for (int i = 0; i < count; i++)
+    {
+        if (i % 3 != 0)
+            expected.clearBit(i);
+    }
+
+    QBitArray seen(positions.size());
+    int iterated = 0;
+    for (QKDTree::const_iterator it = tree.begin(); it != tree.end(); ++it)
+    {
+        const int i = (*it).toInt();
+        QVERIFY(expected.testBit(i) && !seen.testBit(i));
+        QVERIFY(QVectorND(it.key(), dim) == positions[i]);
+        QVERIFY(it.value() == i);
+        QVERIFY(tree.valueAt(it.index()) == i);
+        seen.setBit(i);
+        iterated++;
+    }
+    QVERIFY(iterated == tree.size());
+
+    int rangeFor = 0;
+    for (const QVariant& value : tree)
+        rangeFor += (value.toInt() >= 0);
+    QVERIFY(rangeFor == tree.size());
+    QVERIFY(std::distance(tree.constBegin(), tree.constEnd()) == tree.size());
+
+    //Walking keys touches nothing but the tree's own arrays
+    const int before = allocationCount.load();
+    qreal keySum = 0.0;
+    for (QKDTree::const_iterator it = tree.begin(); it != tree.end(); it++)
+        keySum += it.key()[0];
+    QVERIFY(allocationCount.load() == before);
+    QVERIFY(keySum > 0.0);
+
+    RecordingVisitor visitor;
+    QVERIFY(tree.forEach(&visitor));
+    QVERIFY(visitor.values.size() == tree.size());
+    seen.fill(false);
+    for (int j = 0; j < visitor.values.size(); j++)
+    {
+        const int i = visitor.values[j].toInt();
+        QVERIFY(expected.testBit(i) && !seen.testBit(i));
+        QVERIFY(visitor.positions[j] == positions[i]);
+        seen.setBit(i);
+    }
+
+    QVERIFY(tree.save(path));
+    QKDTree mapped(dim);
+    QVERIFY(mapped.openMapped(path));
+    iterated = 0;
+    for (QKDTree::const_iterator it = mapped.begin(); it != mapped.end(); ++it)
+    {
+        const int i = it.value().toInt();
+        QVERIFY(expected.testBit(i));
+        QVERIFY(QVectorND(it.key(), dim) == positions[i]);
+        iterated++;
+    }
+    QVERIFY(iterated == mapped.size());
+
+    RecordingVisitor mappedVisitor;
+    QVERIFY(mapped.forEach(&mappedVisitor));
+    QVERIFY(mappedVisitor.values == visitor.values);
+
+    mapped.clear();
+    QFile::remove(path);
+}
+
+//private test
+void QKDTreeTests::mappedTreeTest()
+{
+    const int dim = 3;
+    const int count = 3000;
+    const QString path = QDir::tempPath() + "/qkdtree_mapped_test.qkd";
+
+    QKDTree tree(dim);
+    QList<QVectorND> positions;
+    for (int i = 0; i < count; i++)
+    {
+        positions.append(_randomNDimensional(dim));
+        const QVariant value = (i % 2) ? QVariant(i) : QVariant(QString::number(i));
+        QVERIFY(tree.add(positions.last(), value));
+    }
+
+    //Dead nodes and free slots have to survive the trip too
+    for (int i = 0; i < count; i += 7)
+        QVERIFY(tree.remove(positions[i]));
+    QVERIFY(tree.save(path));
+
+    QKDTree mapped(dim);
+    QVERIFY(!mapped.isMapped());
+    QVERIFY(mapped.openMapped(path));
+    QVERIFY(mapped.isMapped());
+    QVERIFY(mapped.size() == tree.size());
+    QVERIFY(mapped.depth() == tree.depth());
+
+    for (int i = 0; i < count; i++)
+    {
+        QVERIFY(mapped.containsKey(positions[i]) == (i % 7 != 0));
+        QVariant expected;
+        QVariant val;
+        QVERIFY(tree.value(positions[i], &expected) == mapped.value(positions[i], &val));
+        QVERIFY(val == expected);
+    }
+
+    for (int q = 0; q < 100; q++)
+    {
+        const QVectorND searchPoint = _randomNDimensional(dim);
+
+        QKDTreeNode expected;
+        QKDTreeNode nearest;
+        QVERIFY(tree.nearestNode(searchPoint, &expected));
+        QVERIFY(mapped.nearestNode(searchPoint, &nearest));
+        QVERIFY(nearest.position() == expected.position());
+        QVERIFY(nearest.value() == expected.value());
+
+        QList<QKDTreeNode> expectedK;
+        QList<QKDTreeNode> nearestK;
+        QVERIFY(tree.nearestNodes(searchPoint, 5, &expectedK));
+        QVERIFY(mapped.nearestNodes(searchPoint, 5, &nearestK));
+        QVERIFY(nearestK.size() == expectedK.size());
+        for (int i = 0; i < nearestK.size(); i++)
+            QVERIFY(nearestK[i].value() == expectedK[i].value());
+
+        const qreal radius = tree.distanceMetric()->distance(searchPoint, expectedK.last().position());
+        QList<QKDTreeNode> expectedWithin;
+        QList<QKDTreeNode> within;
+        QVERIFY(tree.withinDistance(searchPoint, radius, &expectedWithin));
+        QVERIFY(mapped.withinDistance(searchPoint, radius, &within));
+        QVERIFY(within.size() == expectedWithin.size());
+    }
+
+    //Files that don't fit are turned away, leaving the tree as it was
+    QString result;
+    QKDTree wrongDimension(2);
+    QVERIFY(!wrongDimension.openMapped(path, &result));
+    QVERIFY(!result.isEmpty());
+    QVERIFY(!wrongDimension.isMapped());
+    QVERIFY(!mapped.openMapped(QDir::tempPath() + "/qkdtree_missing_file.qkd"));
+    QVERIFY(mapped.isMapped());
+
+    const QString damagedPath = QDir::tempPath() + "/qkdtree_damaged_test.qkd";
+    QFile damaged(damagedPath);
+    QVERIFY(damaged.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    damaged.write(QByteArray(4096, 'x'));
+    damaged.close();
+    QVERIFY(!mapped.openMapped(damagedPath));
+
+    //The nodes start at the first 64 byte boundary after the 104 byte header, 24 bytes apiece
+    QVERIFY(QFile::copy(path, damagedPath));
+    QVERIFY(damaged.open(QIODevice::ReadWrite));
+    QVERIFY(damaged.seek(128));
+    const QByteArray firstNode = damaged.read(24);
+    QVERIFY(firstNode.endsWith(QByteArray(3, 0)));
+    const quint32 badLink = quint32(count) + 5;
+    QVERIFY(damaged.seek(128));
+    damaged.write(reinterpret_cast<const char *>(&badLink), sizeof(badLink));
+    damaged.close();
+    QVERIFY(!mapped.openMapped(damagedPath, &result));
+    QVERIFY(result == "File is truncated or damaged");
+
+    QVERIFY(damaged.open(QIODevice::ReadWrite));
+    QVERIFY(damaged.seek(128));
+    damaged.write(firstNode);
+    const qint32 badDimension = dim;
+    QVERIFY(damaged.seek(128 + 8));
+    damaged.write(reinterpret_cast<const char *>(&badDimension), sizeof(badDimension));
+    damaged.close();
+    QVERIFY(!mapped.openMapped(damagedPath));
+
+    //An offset that wraps around when the section length is added to it
+    QVERIFY(QFile::remove(damagedPath));
+    QVERIFY(QFile::copy(path, damagedPath));
+    QVERIFY(damaged.open(QIODevice::ReadWrite));
+    const quint64 wrappingOffset = ~quint64(63);
+    QVERIFY(damaged.seek(56));
+    damaged.write(reinterpret_cast<const char *>(&wrappingOffset), sizeof(wrappingOffset));
+    damaged.close();
+    QVERIFY(!mapped.openMapped(damagedPath));
+
+    //A size the tree doesn't hold
+    QVERIFY(QFile::remove(damagedPath));
+    QVERIFY(QFile::copy(path, damagedPath));
+    QVERIFY(damaged.open(QIODevice::ReadWrite));
+    const qint64 badSize = tree.size() + 1;
+    QVERIFY(damaged.seek(48));
+    damaged.write(reinterpret_cast<const char *>(&badSize), sizeof(badSize));
+    damaged.close();
+    QVERIFY(!mapped.openMapped(damagedPath));
+
+    //A root that links back to itself
+    QVERIFY(QFile::remove(damagedPath));
+    QVERIFY(QFile::copy(path, damagedPath));
+    QVERIFY(damaged.open(QIODevice::ReadWrite));
+    QVERIFY(damaged.seek(36));
+    quint32 root = 0;
+    QVERIFY(damaged.read(reinterpret_cast<char *>(&root), sizeof(root)) == sizeof(root));
+    QVERIFY(damaged.seek(128 + qint64(root) * 24));
+    damaged.write(reinterpret_cast<const char *>(&root), sizeof(root));
+    damaged.close();
+    QVERIFY(!mapped.openMapped(damagedPath, &result));
+    QVERIFY(result == "File is truncated or damaged");
+    QVERIFY(mapped.isMapped());
+    QFile::remove(damagedPath);
+
+    //Changing a mapped tree copies it into memory first
+    const QVectorND extra = _randomNDimensional(dim);
+    QVERIFY(mapped.add(extra, "extra"));
+    QVERIFY(!mapped.isMapped());
+    QVERIFY(mapped.size() == tree.size() + 1);
+    QVERIFY(mapped.containsKey(extra));
+    QVERIFY(mapped.remove(positions[1]));
+    for (int i = 2; i < count; i++)
+        QVERIFY(mapped.containsKey(positions[i]) == (i % 7 != 0));
+
+    //Saving a mapped tree writes the same tree back out
+    QKDTree copy(dim);
+    QVERIFY(copy.openMapped(path));
+    const QString copyPath = QDir::tempPath() + "/qkdtree_mapped_copy.qkd";
+    QVERIFY(copy.save(copyPath));
+    QKDTree reloaded(dim);
+    QVERIFY(reloaded.openMapped(copyPath));
+    QVERIFY(reloaded.size() == tree.size());
+    QVariant val;
+    QVERIFY(reloaded.value(positions[2], &val));
+    QVERIFY(val == "2");
+
+    reloaded.clear();
+    copy.clear();
+    mapped.clear();
+    QFile::remove(copyPath);
+    QFile::remove(path);
+}
+
+//private test
+void QKDTreeTests::forestTest()
+{
+    const int dim = 3;
+    const int count = 1000;
+    QKDForest forest(dim, false, 0, 16);
+    QList<QVectorND> positions;
+
+    for (int i = 0; i < count; i++)
+    {
+        positions.append(_randomNDimensional(dim));
+        QVERIFY(forest.add(positions.last(), i));
+    }
+    QVERIFY(forest.size() == count);
+    QVERIFY(!forest.add(positions[5], "duplicate"));
+    QVERIFY(!forest.add(QPointF(1.0, 2.0), "wrong dimension"));
+    QVERIFY(forest.size() == count);
+
+    //1000 = 62 full buffers of 16 plus 8 buffered, and 62 = 0b111110
+    QVERIFY(forest.treeCount() == 5);
+
+    for (int i = 0; i < count; i++)
+    {
+        QVERIFY(forest.containsKey(positions[i]));
+        QVariant val;
+        QVERIFY(forest.value(positions[i], &val));
+        QVERIFY(val == i);
+    }
+    QVERIFY(!forest.containsKey(_randomNDimensional(dim)));
+
+    const int k = 7;
+    for (int q = 0; q < 100; q++)
+    {
+        const QVectorND searchPoint = _randomNDimensional(dim);
+
+        //Brute force
+        QList<QPair<qreal, int> > dists;
+        for (int i = 0; i < count; i++)
+            dists.append(qMakePair((searchPoint - positions[i]).lengthSquared(), i));
+        std::sort(dists.begin(), dists.end());
+
+        QKDTreeNode nearest;
+        QVERIFY(forest.nearestNode(searchPoint, &nearest));
+        QVERIFY(nearest.value() == dists[0].second);
+
+        QList<QKDTreeNode> nearestK;
+        QVERIFY(forest.nearestNodes(searchPoint, k, &nearestK));
+        QVERIFY(nearestK.size() == k);
+        for (int i = 0; i < k; i++)
+            QVERIFY(nearestK[i].value() == dists[i].second);
+
+        //A radius that takes in exactly the k+1 nearest (barring ties)
+        const qreal radius = dists[k].first;
+        QList<QKDTreeNode> within;
+        QVERIFY(forest.withinDistance(searchPoint, radius, &within));
+        int expected = 0;
+        while (expected < count && dists[expected].first <= radius)
+            expected++;
+        QVERIFY(within.size() == expected);
+    }
+
+    QList<QKDTreeNode> everything;
+    QVERIFY(forest.nearestNodes(positions[0], 2 * count, &everything));
+    QVERIFY(everything.size() == count);
+
+    forest.clear();
+    QVERIFY(forest.size() == 0);
+    QVERIFY(forest.treeCount() == 0);
+    QKDTreeNode nothing;
+    QVERIFY(!forest.nearestNode(positions[0], &nothing));
+
+    //With duplicates allowed every copy is kept
+    QKDForest dupForest(2, true, 0, 4);
+    for (int i = 0; i < 10; i++)
+        QVERIFY(dupForest.add(QPointF(1.0, 1.0), i));
+    QList<QKDTreeNode> dups;
+    QVERIFY(dupForest.withinDistance(QPointF(1.0, 1.0), 0.0, &dups));
+    QVERIFY(dups.size() == 10);
+}
+
+//private test
+void QKDTreeTests::forestIndexTest()
+{
+    const int dim = 32;
+    const int count = 2000;
+    const int k = 5;
+
+    //The last few points are held back as queries from the same clusters
+    QVector<QVectorND> positions = _clusteredNDimensional(dim, count + 50);
+    const QVector<QVectorND> queries = positions.mid(count);
+    positions.resize(count);
+    QVector<QVariant> values;
+    for (int i = 0; i < count; i++)
+        values.append(i);
+
+    QKDForestIndex index(dim, 4);
+    QVERIFY(index.treeCount() == 4);
+    QVERIFY(index.build(positions, values));
+    QVERIFY(index.size() == count);
+
+    QKDForestIndex sameSeed(dim, 4);
+    QVERIFY(sameSeed.build(positions, values));
+
+    const QList<int> budgets = QList<int>() << 8 << 64 << 512 << 0;
+    QList<int> hits;
+    for (int b = 0; b < budgets.size(); b++)
+        hits.append(0);
+
+    const QKDTreeDistanceMetric metric;
+    foreach(const QVectorND& pos, queries)
+    {
+        QList<qreal> dists;
+        foreach(const QVectorND& vec, positions)
+            dists.append(metric.distance(vec, pos));
+        std::sort(dists.begin(), dists.end());
+
+        for (int b = 0; b < budgets.size(); b++)
+        {
+            QList<QKDTreeNode> nearest;
+            QVERIFY(index.nearestNodes(pos, k, budgets[b], &nearest));
+            QVERIFY(nearest.size() == k);
+
+            //Whatever was found is sorted, no nearer than the true answers and exact without a budget
+            for (int j = 0; j < k; j++)
+            {
+                const qreal dist = metric.distance(nearest[j].position(), pos);
+                QVERIFY(positions[nearest[j].value().toInt()] == nearest[j].position());
+                QVERIFY(dist >= dists[j]);
+                if (j > 0)
+                    QVERIFY(dist >= metric.distance(nearest[j - 1].position(), pos));
+                if (budgets[b] == 0)
+                    QVERIFY(dist == dists[j]);
+            }
+
+            if (metric.distance(nearest.first().position(), pos) == dists.first())
+                hits[b]++;
+
+            QList<QKDTreeNode> again;
+            QVERIFY(sameSeed.nearestNodes(pos, k, budgets[b], &again));
+            for (int j = 0; j < k; j++)
+                QVERIFY(again[j].position() == nearest[j].position());
+        }
+
+        QKDTreeNode nearestNode;
+        QVERIFY(index.nearestNode(pos, 0, &nearestNode));
+        QVERIFY(metric.distance(nearestNode.position(), pos) == dists.first());
+    }
+
+    //Bigger budgets find the true nearest neighbor more often
+    for (int b = 1; b < budgets.size(); b++)
+        QVERIFY(hits[b] >= hits[b - 1]);
+    QVERIFY(hits.last() == queries.size());
+
+    QList<QKDTreeNode> nearest;
+    QVERIFY(!index.nearestNodes(QVectorND(QPointF(1, 2)), k, 64, &nearest));
+    QVERIFY(!index.nearestNodes(queries.first(), 0, 64, &nearest));
+    QVERIFY(!index.build(positions, values.mid(1)));
+
+    index.clear();
+    QVERIFY(index.size() == 0);
+    QVERIFY(!index.nearestNodes(queries.first(), k, 64, &nearest));
+}
+
+//private test
+void QKDTreeTests::snapshotTest()
+{
+    const int dim = 3;
+    const int count = 1000;
+    QKDSnapshotTree tree(dim);
+    const QKDTreeSnapshot empty = tree.snapshot();
+    QVERIFY(!empty.isNull());
+    QVERIFY(empty.size() == 0);
+    QVERIFY(QKDTreeSnapshot().isNull());
+    QVERIFY(!QKDTreeSnapshot().containsKey(QVectorND(QList<qreal>())));
+    QVariant nullValue;
+    QString nullResult;
+    QVERIFY(!QKDTreeSnapshot().value(QVectorND(QList<qreal>()), &nullValue, &nullResult));
+    QVERIFY(nullResult == "Tree is empty");
+
+    QList<QVectorND> positions;
+    for (int i = 0; i < count; i++)
+    {
+        positions.append(_randomNDimensional(dim));
+        QVERIFY(tree.add(positions.last(), i));
+    }
+    QVERIFY(!tree.add(positions[5], "duplicate"));
+    QVERIFY(!tree.add(QPointF(1.0, 2.0), "wrong dimension"));
+    QVERIFY(tree.size() == count);
+
+    const QKDTreeSnapshot full = tree.snapshot();
+    QVERIFY(full.version() == quint64(count));
+    QVERIFY(empty.size() == 0);
+
+    const int k = 5;
+    for (int q = 0; q < 100; q++)
+    {
+        const QVectorND searchPoint = _randomNDimensional(dim);
+
+        //Brute force
+        QList<QPair<qreal, int> > dists;
+        for (int i = 0; i < count; i++)
+            dists.append(qMakePair((searchPoint - positions[i]).lengthSquared(), i));
+        std::sort(dists.begin(), dists.end());
+
+        QKDTreeNode nearest;
+        QVERIFY(full.nearestNode(searchPoint, &nearest));
+        QVERIFY(nearest.value() == dists[0].second);
+
+        QList<QKDTreeNode> nearestK;
+        QVERIFY(full.nearestNodes(searchPoint, k, &nearestK));
+        QVERIFY(nearestK.size() == k);
+        for (int i = 0; i < k; i++)
+            QVERIFY(nearestK[i].value() == dists[i].second);
+
+        //A radius that takes in exactly the k+1 nearest (barring ties)
+        const qreal radius = dists[k].first;
+        QList<QKDTreeNode> within;
+        QVERIFY(full.withinDistance(searchPoint, radius, &within));
+        int expected = 0;
+        while (expected < count && dists[expected].first <= radius)
+            expected++;
+        QVERIFY(within.size() == expected);
+    }
+
+    //Removing from the tree leaves earlier snapshots alone
+    for (int i = 0; i < count; i += 2)
+        QVERIFY(tree.remove(positions[i]));
+    QVERIFY(!tree.remove(positions[0]));
+    const QKDTreeSnapshot half = tree.snapshot();
+    QVERIFY(half.size() == count / 2);
+    for (int i = 0; i < count; i++)
+    {
+        QVERIFY(full.containsKey(positions[i]));
+        QVERIFY(half.containsKey(positions[i]) == (i % 2 == 1));
+        QVariant val;
+        QVERIFY(full.value(positions[i], &val));
+        QVERIFY(val == i);
+    }
+
+    //Removing most of the tree rebuilds it from what is left
+    for (int i = 1; i < count - 10; i += 2)
+        QVERIFY(tree.remove(positions[i]));
+    QVERIFY(tree.size() == 5);
+    QList<QKDTreeNode> rest;
+    QVERIFY(tree.snapshot().withinDistance(positions[0], std::numeric_limits<qreal>::max(), &rest));
+    QVERIFY(rest.size() == 5);
+
+    //Sorted inserts stay correct (and shallow enough to free without deep recursion)
+    QKDSnapshotTree sorted(2);
+    for (int i = 0; i < 20000; i++)
+        QVERIFY(sorted.add(QPointF(i, -i), i));
+    for (int i = 0; i < 20000; i += 97)
+    {
+        QVariant val;
+        QVERIFY(sorted.snapshot().value(QVectorND(QPointF(i, -i)), &val));
+        QVERIFY(val == i);
+    }
+
+    //build() keeps the first occurrence of a key, like QKDTree::build()
+    QVector<QVectorND> buildPositions;
+    QVector<QVariant> buildValues;
+    for (int i = 0; i < 100; i++)
+    {
+        buildPositions.append(QVectorND(QPointF(i % 10, 0)));
+        buildValues.append(i);
+    }
+    QVERIFY(sorted.build(buildPositions, buildValues));
+    QVERIFY(sorted.size() == 10);
+    QVariant val;
+    QVERIFY(sorted.snapshot().value(QVectorND(QPointF(3, 0)), &val));
+    QVERIFY(val == 3);
+
+    sorted.clear();
+    QVERIFY(sorted.size() == 0);
+    QKDTreeNode nothing;
+    QVERIFY(!sorted.snapshot().nearestNode(QPointF(0, 0), &nothing));
+
+    //Copies of one key make a chain as long as their number, which must still be freed without deep recursion
+    const int copies = 50000;
+    QKDSnapshotTree duplicates(2, true);
+    QVector<QVectorND> copyPositions(copies, QVectorND(QPointF(1.0, 1.0)));
+    QVector<QVariant> copyValues;
+    for (int i = 0; i < copies; i++)
+        copyValues.append(i);
+    QVERIFY(duplicates.build(copyPositions, copyValues));
+    for (int i = 0; i < 100; i++)
+        QVERIFY(duplicates.add(QPointF(1.0, 1.0), copies + i));
+    QVERIFY(duplicates.size() == copies + 100);
+    QKDTreeSnapshot chain = duplicates.snapshot();
+    QVERIFY(chain.containsKey(QVectorND(QPointF(1.0, 1.0))));
+    duplicates.clear();
+    QVERIFY(chain.size() == copies + 100);
+    chain = QKDTreeSnapshot();
+}
+
+//private test
+void QKDTreeTests::snapshotConcurrentTest()
+{
+    const int count = 4000;
+    const int readers = 4;
+    QKDSnapshotTree tree(2);
+    QAtomicInt failures(0);
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(readers);
+    for (int i = 0; i < readers; i++)
+        pool.start(new SnapshotReader(&tree, count, &failures));
+
+    for (int i = 0; i < count; i++)
+        tree.add(QPointF(i, 0), i);
+    pool.waitForDone();
+
+    QVERIFY(failures.load() == 0);
+    QVERIFY(tree.size() == count);
+}
+
+//private test
+void QKDTreeTests::fixedDimensionTreeTest()
+{
+    typedef QKDTreeT<3> Tree;
+
+    const int count = 3000;
+    QVector<Tree::Position> refList;
+    QVector<QVariant> values;
+    Tree tree;
+
+    for (int i = 0; i < count; i++)
+    {
+        const Tree::Position pos(_randomNDimensional(3));
+        refList.append(pos);
+        values.append(i);
+        QVERIFY(tree.add(pos, i));
+    }
+    QVERIFY(tree.size() == count);
+    QVERIFY(!tree.add(refList[0], "duplicate"));
+
+    Tree built;
+    QVERIFY(built.build(refList, values));
+    QVERIFY(built.size() == count);
+    QVERIFY(built.depth() <= 13);
+
+    for (int i = 0; i < count; i++)
+    {
+        QVariant val;
+        QVERIFY(built.value(refList[i], &val));
+        QVERIFY(val == i);
+        QVERIFY(tree.containsKey(refList[i]));
+    }
+
+    for (int i = 0; i < 300; i++)
+    {
+        const Tree::Position searchPoint(_randomNDimensional(3));
+
+        QVector<qreal> listDists;
+        foreach(const Tree::Position& candidate, refList)
+            listDists.append(Tree::distance(candidate, searchPoint));
+        std::sort(listDists.begin(), listDists.end());
+
+        Tree::Entry nearest;
+        QVERIFY(tree.nearestNode(searchPoint, &nearest));
+        QVERIFY(Tree::distance(nearest.position, searchPoint) == listDists[0]);
+        QVERIFY(built.nearestNode(searchPoint, &nearest));
+        QVERIFY(Tree::distance(nearest.position, searchPoint) == listDists[0]);
+
+        QVector<Tree::Entry> nearestK;
+        QVERIFY(built.nearestNodes(searchPoint, 8, &nearestK));
+        QVERIFY(nearestK.size() == 8);
+        for (int j = 0; j < nearestK.size(); j++)
+            QVERIFY(Tree::distance(nearestK[j].position, searchPoint) == listDists[j]);
+
+        const qreal radius = listDists[20];
+        QVector<Tree::Entry> within;
+        QVERIFY(tree.withinDistance(searchPoint, radius, &within));
+        QVERIFY(within.size() == 21);
+
+        Tree::Position min = searchPoint;
+        Tree::Position max = searchPoint;
+        for (int j = 0; j < 3; j++)
+        {
+            min[j] -= RAND_MAX / 8;
+            max[j] += RAND_MAX / 8;
+        }
+
+        int expected = 0;
+        foreach(const Tree::Position& candidate, refList)
+        {
+            bool inside = true;
+            for (int j = 0; j < 3; j++)
+                inside = inside && candidate[j] >= min[j] && candidate[j] <= max[j];
+            if (inside)
+                expected++;
+        }
+
+        int found = 0;
+        built.rangeQuery(min, max, [&found](const Tree::Position&, const QVariant&) { found++; });
+        QVERIFY(found == expected);
+    }
+}
+
+//private test
+void QKDTreeTests::bucketTest()
+{
+    typedef QKDTreeT<2> Tree;
+
+    //The SIMD kernels have to agree with the plain formulas, padding and all
+    const int stride = 2 * QKDTreeKernels::LANES;
+    QVector<qreal> soa(2 * stride, 0.0);
+    for (int j = 0; j < 11; j++)
+    {
+        soa[j] = j;
+        soa[stride + j] = -2 * j;
+    }
+    const qreal query[2] = {3.0, 1.0};
+    const qreal min[2] = {2.0, -12.0};
+    const qreal max[2] = {7.0, -5.0};
+    QVector<qreal> distances(stride);
+    QVector<quint8> inside(stride);
+    QKDTreeKernels::squaredDistances<2>(soa.constData(), stride, 11, query, distances.data());
+    QKDTreeKernels::insideBox<2>(soa.constData(), stride, 11, min, max, inside.data());
+    for (int j = 0; j < 11; j++)
+    {
+        QVERIFY(distances[j] == (j - 3.0) * (j - 3.0) + (-2.0 * j - 1.0) * (-2.0 * j - 1.0));
+        QVERIFY(inside[j] == quint8(j >= 3 && j <= 6));
+    }
+
+    const int bucketSizes[] = {1, 3, 64};
+    for (int b = 0; b < 3; b++)
+    {
+        Tree tree(false, bucketSizes[b]);
+        Tree sorted(false, bucketSizes[b]);
+        Tree duplicates(true, bucketSizes[b]);
+        QVERIFY(tree.bucketSize() == bucketSizes[b]);
+
+        QVector<Tree::Position> refList;
+        for (int i = 0; i < 1000; i++)
+        {
+            const Tree::Position pos(_randomNDimensional(2));
+            refList.append(pos);
+            QVERIFY(tree.add(pos, i));
+
+            const qreal diagonal[2] = {qreal(i), qreal(-i)};
+            QVERIFY(sorted.add(Tree::Position(diagonal), i));
+        }
+        QVERIFY(!tree.add(refList[10], "duplicate"));
+        QVERIFY(sorted.size() == 1000);
+        const qreal offDiagonal[2] = {500.25, -499.5};
+        Tree::Entry nearestSorted;
+        QVERIFY(sorted.nearestNode(Tree::Position(offDiagonal), &nearestSorted));
+        QVERIFY(nearestSorted.value == 500);
+
+        //More identical keys than fit in a bucket
+        const Tree::Position same = refList[0];
+        for (int i = 0; i < 200; i++)
+            QVERIFY(duplicates.add(same, i));
+        QVERIFY(duplicates.add(refList[1], "other"));
+        QVERIFY(duplicates.size() == 201);
+        QVector<Tree::Entry> found;
+        QVERIFY(duplicates.withinDistance(same, 0.0, &found));
+        QVERIFY(found.size() == 200);
+        QVERIFY(duplicates.rangeQuery(same, same, &found));
+        QVERIFY(found.size() == 200);
+        QVERIFY(duplicates.containsKey(refList[1]));
+
+        for (int i = 0; i < 100; i++)
+        {
+            const Tree::Position searchPoint(_randomNDimensional(2));
+
+            qreal bestDist = std::numeric_limits<qreal>::max();
+            foreach(const Tree::Position& candidate, refList)
+                bestDist = qMin(bestDist, Tree::distance(candidate, searchPoint));
+
+            Tree::Entry nearest;
+            QVERIFY(tree.nearestNode(searchPoint, &nearest));
+            QVERIFY(Tree::distance(nearest.position, searchPoint) == bestDist);
+            QVERIFY(tree.containsKey(refList[i]));
+        }
+    }
+}
+
+//private test
+void QKDTreeTests::floatTreeTest()
+{
+    typedef QKDTreeT<3, float> Tree;
+    QVERIFY(sizeof(Tree::Position) == 3 * sizeof(float));
+
+    //Float keys go through their own kernels, which must still add up in double
+    const int stride = 2 * QKDTreeKernels::LANES;
+    QVector<float> soa(3 * stride, 0.0f);
+    for (int j = 0; j < 11; j++)
+    {
+        soa[j] = j + 0.1f;
+        soa[stride + j] = -2.0f * j;
+        soa[2 * stride + j] = 1.0f / (j + 1);
+    }
+    const float query[3] = {3.3f, 1.0f, 0.25f};
+    const float min[3] = {2.0f, -12.0f, 0.0f};
+    const float max[3] = {7.0f, -5.0f, 1.0f};
+    QVector<qreal> distances(stride);
+    QVector<quint8> inside(stride);
+    QKDTreeKernels::squaredDistances<3>(soa.constData(), stride, 11, query, distances.data());
+    QKDTreeKernels::insideBox<3>(soa.constData(), stride, 11, min, max, inside.data());
+    for (int j = 0; j < 11; j++)
+    {
+        qreal expected = 0.0;
+        for (int d = 0; d < 3; d++)
+        {
+            const qreal delta = qreal(soa[d * stride + j]) - qreal(query[d]);
+            expected += delta * delta;
+        }
+        QVERIFY(distances[j] == expected);
+        QVERIFY(inside[j] == quint8(j >= 3 && j <= 6));
+    }
+
+    const int count = 3000;
+    QVector<Tree::Position> refList;
+    QVector<QVariant> values;
+    Tree tree(true);
+    for (int i = 0; i < count; i++)
+    {
+        const Tree::Position pos(_randomNDimensional(3));
+        refList.append(pos);
+        values.append(i);
+        QVERIFY(tree.add(pos, i));
+    }
+
+    Tree built(true, 32);
+    QVERIFY(built.build(refList, values));
+    QVERIFY(built.size() == count);
+
+    for (int i = 0; i < 300; i++)
+    {
+        const Tree::Position searchPoint(_randomNDimensional(3));
+
+        QVector<qreal> listDists;
+        foreach(const Tree::Position& candidate, refList)
+            listDists.append(Tree::distance(candidate, searchPoint));
+        std::sort(listDists.begin(), listDists.end());
+
+        Tree::Entry nearest;
+        QVERIFY(tree.nearestNode(searchPoint, &nearest));
+        QVERIFY(Tree::distance(nearest.position, searchPoint) == listDists[0]);
+
+        QVector<Tree::Entry> nearestK;
+        QVERIFY(built.nearestNodes(searchPoint, 8, &nearestK));
+        QVERIFY(nearestK.size() == 8);
+        for (int j = 0; j < nearestK.size(); j++)
+            QVERIFY(Tree::distance(nearestK[j].position, searchPoint) == listDists[j]);
+
+        QVector<Tree::Entry> within;
+        QVERIFY(built.withinDistance(searchPoint, listDists[20], &within));
+        QVERIFY(within.size() == 21);
+
+        Tree::Position min = searchPoint;
+        Tree::Position max = searchPoint;
+        for (int j = 0; j < 3; j++)
+        {
+            min[j] -= RAND_MAX / 8;
+            max[j] += RAND_MAX / 8;
+        }
+
+        int expected = 0;
+        foreach(const Tree::Position& candidate, refList)
+        {
+            bool inside = true;
+            for (int j = 0; j < 3; j++)
+                inside = inside && candidate[j] >= min[j] && candidate[j] <= max[j];
+            if (inside)
+                expected++;
+        }
+
+        QVector<Tree::Entry> found;
+        QVERIFY(tree.rangeQuery(min, max, &found));
+        QVERIFY(found.size() == expected);
+    }
+}
+
+//private test
+void QKDTreeTests::payloadTest()
+{
+    typedef QKDTreeT<2, qreal, quint32> Tree;
+    QVERIFY(sizeof(Tree::Entry) == sizeof(Tree::Position) + sizeof(qreal));
+
+    const int count = 2000;
+    QVector<Tree::Position> refList;
+    QVector<quint32> ids;
+    Tree tree;
+    QString result;
+    quint32 index = 0;
+    QVERIFY(!tree.nearestIndex(Tree::Position(_randomNDimensional(2)), &index, 0, &result));
+    QVERIFY(result == "Tree is empty");
+
+    for (int i = 0; i < count; i++)
+    {
+        const Tree::Position pos(_randomNDimensional(2));
+        refList.append(pos);
+        ids.append(quint32(1000000 + i));
+        QVERIFY(tree.add(pos, ids.last()));
+    }
+
+    Tree built;
+    QVERIFY(built.build(refList, ids));
+
+    for (int i = 0; i < count; i += 10)
+    {
+        quint32 id = 0;
+        QVERIFY(built.value(refList[i], &id));
+        QVERIFY(id == ids[i]);
+    }
+
+    QVERIFY(!tree.nearestIndex(refList[0], 0, 0, &result));
+    QVector<quint32> indices;
+    QVERIFY(!tree.nearestIndices(refList[0], 0, &indices, &result));
+    QVERIFY(result == "k must be positive");
+
+    for (int i = 0; i < 200; i++)
+    {
+        const Tree::Position searchPoint(_randomNDimensional(2));
+
+        QVector<qreal> listDists;
+        foreach(const Tree::Position& candidate, refList)
+            listDists.append(Tree::distance(candidate, searchPoint));
+        std::sort(listDists.begin(), listDists.end());
+
+        qreal distance = -1.0;
+        QVERIFY(tree.nearestIndex(searchPoint, &index, &distance));
+        QVERIFY(distance == listDists[0]);
+        QVERIFY(Tree::distance(tree.keyAt(index), searchPoint) == distance);
+        QVERIFY(tree.valueAt(index) == ids[refList.indexOf(tree.keyAt(index))]);
+
+        Tree::Entry nearest;
+        QVERIFY(tree.nearestNode(searchPoint, &nearest));
+        QVERIFY(nearest.position == tree.keyAt(index));
+        QVERIFY(nearest.value == tree.valueAt(index));
+
+        QVector<Tree::Entry> nearestK;
+        QVERIFY(built.nearestNodes(searchPoint, 6, &nearestK));
+        QVERIFY(built.nearestIndices(searchPoint, 6, &indices));
+        QVERIFY(indices.size() == 6);
+        for (int j = 0; j < indices.size(); j++)
+        {
+            QVERIFY(Tree::distance(built.keyAt(indices[j]), searchPoint) == listDists[j]);
+            QVERIFY(built.keyAt(indices[j]) == nearestK[j].position);
+            QVERIFY(built.valueAt(indices[j]) == nearestK[j].value);
+        }
+
+        quint64 idSum = 0;
+        int within = 0;
+        built.withinDistance(searchPoint, listDists[9], [&](const Tree::Position&, const quint32& id) {
+            idSum += id;
+            within++;
+        });
+        QVERIFY(within == 10);
+
+        quint64 expectedSum = 0;
+        QVERIFY(built.nearestIndices(searchPoint, 10, &indices));
+        for (int j = 0; j < indices.size(); j++)
+            expectedSum += built.valueAt(indices[j]);
+        QVERIFY(idSum == expectedSum);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeAdd1()
+{
+    QKDTree tree(2);
+    for (int i = 0; i < size1; i++)
+    {
+        QVectorND pos = _randomNDimensional(2);
+
+        tree.add(pos, i);
+    }
+
+    QBENCHMARK
+    {
+        QVectorND pos = _randomNDimensional(2);
+
+        tree.add(pos, "final");
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeAdd2()
+{
+    QKDTree tree(2);
+    for (int i = 0; i < size2; i++)
+    {
+        QVectorND pos = _randomNDimensional(2);
+
+        tree.add(pos, i);
+    }
+
+    QBENCHMARK
+    {
+        QVectorND pos = _randomNDimensional(2);
+
+        tree.add(pos, "final");
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeAddAll1()
+{
+    QVector<QVectorND> positions;
+    for (uint i = 0; i < size1; i++)
+        positions.append(_randomNDimensional(2));
+
+    QBENCHMARK
+    {
+        QKDTree tree(2);
+        for (int i = 0; i < positions.size(); i++)
+            tree.add(positions[i], i);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeAddAll2()
+{
+    QVector<QVectorND> positions;
+    for (uint i = 0; i < size2; i++)
+        positions.append(_randomNDimensional(2));
+
+    QBENCHMARK
+    {
+        QKDTree tree(2);
+        for (int i = 0; i < positions.size(); i++)
+            tree.add(positions[i], i);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeBuild1()
+{
+    QVector<QVectorND> positions;
+    QVector<QVariant> values;
+    for (uint i = 0; i < size1; i++)
+    {
+        positions.append(_randomNDimensional(2));
+        values.append(i);
+    }
+
+    QBENCHMARK
+    {
+        QKDTree tree(2);
+        tree.build(positions, values);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeBuild2()
+{
+    QVector<QVectorND> positions;
+    QVector<QVariant> values;
+    for (uint i = 0; i < size2; i++)
+    {
+        positions.append(_randomNDimensional(2));
+        values.append(i);
+    }
+
+    QBENCHMARK
+    {
+        QKDTree tree(2);
+        tree.build(positions, values);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeParallelBuild_data()
+{
+    QTest::addColumn<int>("threads");
+    for (int threads = 1; threads < QThread::idealThreadCount(); threads *= 2)
+        QTest::newRow(QByteArray::number(threads).constData()) << threads;
+    QTest::newRow(QByteArray::number(QThread::idealThreadCount()).constData()) << QThread::idealThreadCount();
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeParallelBuild()
+{
+    QFETCH(int, threads);
+
+    //Big enough for the threads to have something to do
+    QVector<QVectorND> positions;
+    QVector<QVariant> values;
+    for (uint i = 0; i < size2 * 16; i++)
+    {
+        positions.append(_randomNDimensional(3));
+        values.append(i);
+    }
+
+    QBENCHMARK
+    {
+        QKDTree tree(3);
+        tree.build(positions, values, 0, threads);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeOpenMapped1()
+{
+    QVector<QVectorND> positions;
+    QVector<QVariant> values;
+    for (uint i = 0; i < size1; i++)
+    {
+        positions.append(_randomNDimensional(2));
+        values.append(i);
+    }
+
+    const QString path = QDir::tempPath() + "/qkdtree_benchmark.qkd";
+    QKDTree tree(2);
+    tree.build(positions, values);
+    tree.save(path);
+
+    QKDTree mapped(2);
+    QBENCHMARK
+    {
+        mapped.openMapped(path);
+    }
+
+    mapped.clear();
+    QFile::remove(path);
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeOpenMapped2()
+{
+    QVector<QVectorND> positions;
+    QVector<QVariant> values;
+    for (uint i = 0; i < size2; i++)
+    {
+        positions.append(_randomNDimensional(2));
+        values.append(i);
+    }
+
+    const QString path = QDir::tempPath() + "/qkdtree_benchmark.qkd";
+    QKDTree tree(2);
+    tree.build(positions, values);
+    tree.save(path);
+
+    QKDTree mapped(2);
+    QBENCHMARK
+    {
+        mapped.openMapped(path);
+    }
+
+    mapped.clear();
+    QFile::remove(path);
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeNearest1()
+{
+    QKDTree tree(2);
+    QList<QVectorND> results;
+
+    for (int i = 0; i < size1; i++)
+    {
+        QVectorND pos = _randomNDimensional(2);
+
+        tree.add(pos, i);
+    }
+
+    for (int i = 0; i < 1; i++)
+    {
+        QVectorND pos = _randomNDimensional(2);
+
+        QKDTreeNode nearestResult;
+        QBENCHMARK
+        {
+            tree.nearestNode(pos, &nearestResult);
+        }
+
+        results.append(nearestResult.position());
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeNearest2()
+{
+    QKDTree tree(2);
+    QList<QVectorND> results;
+
+    for (int i = 0; i < size2; i++)
+    {
+        QVectorND pos = _randomNDimensional(2);
+
+        tree.add(pos, i);
+    }
+
+    for (int i = 0; i < 1; i++)
+    {
+        QVectorND pos = _randomNDimensional(2);
+
+        QKDTreeNode nearestResult;
+        QBENCHMARK
+        {
+            tree.nearestNode(pos, &nearestResult);
+        }
+
+        results.append(nearestResult.position());
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeNearestIndex1()
+{
+    QKDTree tree(2);
+    for (uint i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QVectorND pos = _randomNDimensional(2);
+    quint32 index;
+    const int before = allocationCount.load();
+    QBENCHMARK
+    {
+        tree.nearestIndex(pos, &index);
+    }
+    QVERIFY(allocationCount.load() == before);
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeNearestIndex2()
+{
+    QKDTree tree(2);
+    for (uint i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QVectorND pos = _randomNDimensional(2);
+    quint32 index;
+    const int before = allocationCount.load();
+    QBENCHMARK
+    {
+        tree.nearestIndex(pos, &index);
+    }
+    QVERIFY(allocationCount.load() == before);
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeManhattanNearest1()
+{
+    QKDTree tree(2, false, new QKDTreeManhattanMetric());
+    for (uint i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QVectorND pos = _randomNDimensional(2);
+    QKDTreeNode nearestResult;
+    QBENCHMARK
+    {
+        tree.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeManhattanNearest2()
+{
+    QKDTree tree(2, false, new QKDTreeManhattanMetric());
+    for (uint i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QVectorND pos = _randomNDimensional(2);
+    QKDTreeNode nearestResult;
+    QBENCHMARK
+    {
+        tree.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeApproximateNearest1_data()
+{
+    QTest::addColumn<qreal>("epsilon");
+    QTest::newRow("0") << 0.0;
+    QTest::newRow("0.05") << 0.05;
+    QTest::newRow("0.1") << 0.1;
+    QTest::newRow("0.25") << 0.25;
+    QTest::newRow("0.5") << 0.5;
+    QTest::newRow("1") << 1.0;
+    QTest::newRow("2") << 2.0;
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeApproximateNearest1()
+{
+    QFETCH(qreal, epsilon);
+
+    //4d like bigNearestTest, where exact searches have to look past plenty of planes
+    const int dim = 4;
+    QKDTree tree(dim);
+    QList<QVectorND> backupList;
+    for (uint i = 0; i < size1; i++)
+    {
+        backupList.append(_randomNDimensional(dim));
+        tree.add(backupList.last(), i);
+    }
+
+    QList<QVectorND> queries;
+    for (int i = 0; i < 100; i++)
+        queries.append(_randomNDimensional(dim));
+
+    QList<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        results.clear();
+        foreach(const QVectorND& pos, queries)
+        {
+            QKDTreeNode nearestResult;
+            tree.nearestNode(pos, &nearestResult, 0, epsilon);
+            results.append(nearestResult);
+        }
+    }
+
+    //The other half of the trade: how far the answers were from the brute-force ones
+    qreal ratioSum = 0.0;
+    int exact = 0;
+    for (int i = 0; i < queries.size(); i++)
+    {
+        qreal backupDist = std::numeric_limits<qreal>::max();
+        foreach(const QVectorND& vec, backupList)
+            backupDist = qMin(backupDist, tree.distanceMetric()->distance(vec, queries[i]));
+
+        const qreal treeDistance = tree.distanceMetric()->distance(results[i].position(), queries[i]);
+        QVERIFY(treeDistance <= backupDist * (1.0 + epsilon) * (1.0 + epsilon) * (1.0 + 1e-12));
+        ratioSum += (backupDist > 0.0) ? std::sqrt(treeDistance / backupDist) : 1.0;
+        if (treeDistance == backupDist)
+            exact++;
+    }
+    if (_verbose())
+        qDebug() << "epsilon" << epsilon << "exact" << exact << "of" << queries.size()
+                 << "mean distance ratio" << ratioSum / queries.size();
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeApproximateNearest2_data()
+{
+    this->benchmarkTreeApproximateNearest1_data();
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeApproximateNearest2()
+{
+    QFETCH(qreal, epsilon);
+
+    //4d like bigNearestTest, where exact searches have to look past plenty of planes
+    const int dim = 4;
+    QKDTree tree(dim);
+    QList<QVectorND> backupList;
+    for (uint i = 0; i < size2; i++)
+    {
+        backupList.append(_randomNDimensional(dim));
+        tree.add(backupList.last(), i);
+    }
+
+    QList<QVectorND> queries;
+    for (int i = 0; i < 100; i++)
+        queries.append(_randomNDimensional(dim));
+
+    QList<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        results.clear();
+        foreach(const QVectorND& pos, queries)
+        {
+            QKDTreeNode nearestResult;
+            tree.nearestNode(pos, &nearestResult, 0, epsilon);
+            results.append(nearestResult);
+        }
+    }
+
+    //The other half of the trade: how far the answers were from the brute-force ones
+    qreal ratioSum = 0.0;
+    int exact = 0;
+    for (int i = 0; i < queries.size(); i++)
+    {
+        qreal backupDist = std::numeric_limits<qreal>::max();
+        foreach(const QVectorND& vec, backupList)
+            backupDist = qMin(backupDist, tree.distanceMetric()->distance(vec, queries[i]));
+
+        const qreal treeDistance = tree.distanceMetric()->distance(results[i].position(), queries[i]);
+        QVERIFY(treeDistance <= backupDist * (1.0 + epsilon) * (1.0 + epsilon) * (1.0 + 1e-12));
+        ratioSum += (backupDist > 0.0) ? std::sqrt(treeDistance / backupDist) : 1.0;
+        if (treeDistance == backupDist)
+            exact++;
+    }
+    if (_verbose())
+        qDebug() << "epsilon" << epsilon << "exact" << exact << "of" << queries.size()
+                 << "mean distance ratio" << ratioSum / queries.size();
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeBestBin1_data()
+{
+    QTest::addColumn<int>("maxChecks");
+    QTest::newRow("16") << 16;
+    QTest::newRow("64") << 64;
+    QTest::newRow("256") << 256;
+    QTest::newRow("1024") << 1024;
+    QTest::newRow("4096") << 4096;
+    QTest::newRow("unlimited") << 0;
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeBestBin1()
+{
+    QFETCH(int, maxChecks);
+
+    //Image-descriptor-like dimensionality, where exact searches visit most of the tree
+    const int dim = 32;
+    QKDTree tree(dim);
+    QList<QVectorND> backupList;
+    for (uint i = 0; i < size1; i++)
+    {
+        backupList.append(_randomNDimensional(dim));
+        tree.add(backupList.last(), i);
+    }
+
+    QList<QVectorND> queries;
+    for (int i = 0; i < 20; i++)
+        queries.append(_randomNDimensional(dim));
+
+    QList<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        results.clear();
+        foreach(const QVectorND& pos, queries)
+        {
+            QKDTreeNode nearestResult;
+            tree.bestBinNearestNode(pos, maxChecks, &nearestResult);
+            results.append(nearestResult);
+        }
+    }
+
+    int exact = 0;
+    for (int i = 0; i < queries.size(); i++)
+    {
+        qreal backupDist = std::numeric_limits<qreal>::max();
+        foreach(const QVectorND& vec, backupList)
+            backupDist = qMin(backupDist, tree.distanceMetric()->distance(vec, queries[i]));
+        if (tree.distanceMetric()->distance(results[i].position(), queries[i]) == backupDist)
+            exact++;
+    }
+    if (_verbose())
+        qDebug() << "maxChecks" << maxChecks << "found the true nearest neighbor for" << exact << "of" << queries.size();
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeBestBin2_data()
+{
+    this->benchmarkTreeBestBin1_data();
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeBestBin2()
+{
+    QFETCH(int, maxChecks);
+
+    //Image-descriptor-like dimensionality, where exact searches visit most of the tree
+    const int dim = 32;
+    QKDTree tree(dim);
+    QList<QVectorND> backupList;
+    for (uint i = 0; i < size2; i++)
+    {
+        backupList.append(_randomNDimensional(dim));
+        tree.add(backupList.last(), i);
+    }
+
+    QList<QVectorND> queries;
+    for (int i = 0; i < 20; i++)
+        queries.append(_randomNDimensional(dim));
+
+    QList<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        results.clear();
+        foreach(const QVectorND& pos, queries)
+        {
+            QKDTreeNode nearestResult;
+            tree.bestBinNearestNode(pos, maxChecks, &nearestResult);
+            results.append(nearestResult);
+        }
+    }
+
+    int exact = 0;
+    for (int i = 0; i < queries.size(); i++)
+    {
+        qreal backupDist = std::numeric_limits<qreal>::max();
+        foreach(const QVectorND& vec, backupList)
+            backupDist = qMin(backupDist, tree.distanceMetric()->distance(vec, queries[i]));
+        if (tree.distanceMetric()->distance(results[i].position(), queries[i]) == backupDist)
+            exact++;
+    }
+    if (_verbose())
+        qDebug() << "maxChecks" << maxChecks << "found the true nearest neighbor for" << exact << "of" << queries.size();
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeNearestK1()
+{
+    QKDTree tree(2);
+
+    for (uint i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QVectorND pos = _randomNDimensional(2);
+    QList<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        tree.nearestNodes(pos, 16, &results);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeNearestK2()
+{
+    QKDTree tree(2);
+
+    for (uint i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QVectorND pos = _randomNDimensional(2);
+    QList<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        tree.nearestNodes(pos, 16, &results);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeNearestIterator1()
+{
+    QKDTree tree(2);
+
+    for (uint i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QVectorND pos = _randomNDimensional(2);
+    QKDTreeNode result;
+    QBENCHMARK
+    {
+        QKDTreeNearestIterator it(&tree, pos);
+        for (int j = 0; j < 16; j++)
+            it.next(&result);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeNearestIterator2()
+{
+    QKDTree tree(2);
+
+    for (uint i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QVectorND pos = _randomNDimensional(2);
+    QKDTreeNode result;
+    QBENCHMARK
+    {
+        QKDTreeNearestIterator it(&tree, pos);
+        for (int j = 0; j < 16; j++)
+            it.next(&result);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeBatchNearest1()
+{
+    QKDTree tree(2);
+    for (uint i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    QVector<QVectorND> queries;
+    for (uint i = 0; i < size1; i++)
+        queries.append(_randomNDimensional(2));
+
+    QVector<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        tree.nearestNodes(queries, &results);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeBatchNearest2()
+{
+    QKDTree tree(2);
+    for (uint i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    QVector<QVectorND> queries;
+    for (uint i = 0; i < size2; i++)
+        queries.append(_randomNDimensional(2));
+
+    QVector<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        tree.nearestNodes(queries, &results);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeKnnGraph1()
+{
+    QKDTree tree(2);
+    for (int i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    QVector<qint64> offsets;
+    QVector<quint32> neighbors;
+    QBENCHMARK
+    {
+        tree.knnGraph(8, &offsets, &neighbors);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeKnnGraph2()
+{
+    QKDTree tree(2);
+    for (int i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    QVector<qint64> offsets;
+    QVector<quint32> neighbors;
+    QBENCHMARK
+    {
+        tree.knnGraph(8, &offsets, &neighbors);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeKnnNaive1()
+{
+    //The same graph as benchmarkTreeKnnGraph1, one nearestNodes() call per key in insertion order
+    QList<QVectorND> positions;
+    QKDTree tree(2);
+    for (int i = 0; i < size1; i++)
+    {
+        positions.append(_randomNDimensional(2));
+        tree.add(positions.last(), i);
+    }
+
+    QList<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        for (int i = 0; i < positions.size(); i++)
+            tree.nearestNodes(positions.at(i), 9, &results);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeKnnNaive2()
+{
+    QList<QVectorND> positions;
+    QKDTree tree(2);
+    for (int i = 0; i < size2; i++)
+    {
+        positions.append(_randomNDimensional(2));
+        tree.add(positions.last(), i);
+    }
+
+    QList<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        for (int i = 0; i < positions.size(); i++)
+            tree.nearestNodes(positions.at(i), 9, &results);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeNearestJoin1()
+{
+    QKDTree tree(2);
+    QKDTree queries(2);
+    for (int i = 0; i < size1; i++)
+    {
+        tree.add(_randomNDimensional(2), i);
+        queries.add(_randomNDimensional(2), i);
+    }
+
+    QVector<quint32> nearest;
+    QBENCHMARK
+    {
+        tree.nearestJoin(queries, &nearest);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeNearestJoin2()
+{
+    QKDTree tree(2);
+    QKDTree queries(2);
+    for (int i = 0; i < size2; i++)
+    {
+        tree.add(_randomNDimensional(2), i);
+        queries.add(_randomNDimensional(2), i);
+    }
+
+    QVector<quint32> nearest;
+    QBENCHMARK
+    {
+        tree.nearestJoin(queries, &nearest);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeJoinNaive1()
+{
+    //The same join as benchmarkTreeNearestJoin1, one nearestIndex() call per query key
+    QKDTree tree(2);
+    QKDTree queries(2);
+    for (int i = 0; i < size1; i++)
+    {
+        tree.add(_randomNDimensional(2), i);
+        queries.add(_randomNDimensional(2), i);
+    }
+
+    QVectorND position(2);
+    quint32 index;
+    QBENCHMARK
+    {
+        for (QKDTree::const_iterator it = queries.begin(); it != queries.end(); ++it)
+        {
+            position[0] = it.key()[0];
+            position[1] = it.key()[1];
+            tree.nearestIndex(position, &index);
+        }
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeJoinNaive2()
+{
+    QKDTree tree(2);
+    QKDTree queries(2);
+    for (int i = 0; i < size2; i++)
+    {
+        tree.add(_randomNDimensional(2), i);
+        queries.add(_randomNDimensional(2), i);
+    }
+
+    QVectorND position(2);
+    quint32 index;
+    QBENCHMARK
+    {
+        for (QKDTree::const_iterator it = queries.begin(); it != queries.end(); ++it)
+        {
+            position[0] = it.key()[0];
+            position[1] = it.key()[1];
+            tree.nearestIndex(position, &index);
+        }
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeIterate1()
+{
+    QKDTree tree(2);
+    for (int i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    qreal sum = 0.0;
+    QBENCHMARK
+    {
+        for (QKDTree::const_iterator it = tree.begin(); it != tree.end(); ++it)
+            sum += it.key()[0];
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeIterate2()
+{
+    QKDTree tree(2);
+    for (int i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    qreal sum = 0.0;
+    QBENCHMARK
+    {
+        for (QKDTree::const_iterator it = tree.begin(); it != tree.end(); ++it)
+            sum += it.key()[0];
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeForEach1()
+{
+    QKDTree tree(2);
+    for (int i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    CountingVisitor visitor;
+    QBENCHMARK
+    {
+        tree.forEach(&visitor);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeForEach2()
+{
+    QKDTree tree(2);
+    for (int i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    CountingVisitor visitor;
+    QBENCHMARK
+    {
+        tree.forEach(&visitor);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkFixedTreeAdd1()
+{
+    QKDTreeT<2> tree;
+    for (uint i = 0; i < size1; i++)
+        tree.add(QKDTreeT<2>::Position(_randomNDimensional(2)), i);
+
+    QBENCHMARK
+    {
+        tree.add(QKDTreeT<2>::Position(_randomNDimensional(2)), "final");
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkFixedTreeAdd2()
+{
+    QKDTreeT<2> tree;
+    for (uint i = 0; i < size2; i++)
+        tree.add(QKDTreeT<2>::Position(_randomNDimensional(2)), i);
+
+    QBENCHMARK
+    {
+        tree.add(QKDTreeT<2>::Position(_randomNDimensional(2)), "final");
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkFixedTreeNearest1()
+{
+    QKDTreeT<2> tree;
+    for (uint i = 0; i < size1; i++)
+        tree.add(QKDTreeT<2>::Position(_randomNDimensional(2)), i);
+
+    const QKDTreeT<2>::Position pos(_randomNDimensional(2));
+    QKDTreeT<2>::Entry nearestResult;
+    QBENCHMARK
+    {
+        tree.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkFixedTreeNearest2()
+{
+    QKDTreeT<2> tree;
+    for (uint i = 0; i < size2; i++)
+        tree.add(QKDTreeT<2>::Position(_randomNDimensional(2)), i);
+
+    const QKDTreeT<2>::Position pos(_randomNDimensional(2));
+    QKDTreeT<2>::Entry nearestResult;
+    QBENCHMARK
+    {
+        tree.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkFloatTreeNearest1()
+{
+    typedef QKDTreeT<2, float> Tree;
+    Tree tree;
+    for (uint i = 0; i < size1; i++)
+        tree.add(Tree::Position(_randomNDimensional(2)), i);
+
+    const Tree::Position pos(_randomNDimensional(2));
+    Tree::Entry nearestResult;
+    QBENCHMARK
+    {
+        tree.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkFloatTreeNearest2()
+{
+    typedef QKDTreeT<2, float> Tree;
+    Tree tree;
+    for (uint i = 0; i < size2; i++)
+        tree.add(Tree::Position(_randomNDimensional(2)), i);
+
+    const Tree::Position pos(_randomNDimensional(2));
+    Tree::Entry nearestResult;
+    QBENCHMARK
+    {
+        tree.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkPayloadTreeNearestIndex1()
+{
+    typedef QKDTreeT<2, qreal, quint32> Tree;
+    Tree tree;
+    for (uint i = 0; i < size1; i++)
+        tree.add(Tree::Position(_randomNDimensional(2)), i);
+
+    const Tree::Position pos(_randomNDimensional(2));
+    quint32 index = 0;
+    QBENCHMARK
+    {
+        tree.nearestIndex(pos, &index);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkPayloadTreeNearestIndex2()
+{
+    typedef QKDTreeT<2, qreal, quint32> Tree;
+    Tree tree;
+    for (uint i = 0; i < size2; i++)
+        tree.add(Tree::Position(_randomNDimensional(2)), i);
+
+    const Tree::Position pos(_randomNDimensional(2));
+    quint32 index = 0;
+    QBENCHMARK
+    {
+        tree.nearestIndex(pos, &index);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkBucketNearest1_data()
+{
+    QTest::addColumn<int>("bucketSize");
+    QTest::newRow("1") << 1;
+    QTest::newRow("4") << 4;
+    QTest::newRow("8") << 8;
+    QTest::newRow("16") << 16;
+    QTest::newRow("32") << 32;
+    QTest::newRow("64") << 64;
+}
+
+//private test
+void QKDTreeTests::benchmarkBucketNearest1()
+{
+    QFETCH(int, bucketSize);
+
+    QKDTreeT<2> tree(false, bucketSize);
+    for (uint i = 0; i < size1; i++)
+        tree.add(QKDTreeT<2>::Position(_randomNDimensional(2)), i);
+
+    const QKDTreeT<2>::Position pos(_randomNDimensional(2));
+    QKDTreeT<2>::Entry nearestResult;
+    QBENCHMARK
+    {
+        tree.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkBucketNearest2_data()
+{
+    this->benchmarkBucketNearest1_data();
+}
+
+//private test
+void QKDTreeTests::benchmarkBucketNearest2()
+{
+    QFETCH(int, bucketSize);
+
+    QKDTreeT<2> tree(false, bucketSize);
+    for (uint i = 0; i < size2; i++)
+        tree.add(QKDTreeT<2>::Position(_randomNDimensional(2)), i);
+
+    const QKDTreeT<2>::Position pos(_randomNDimensional(2));
+    QKDTreeT<2>::Entry nearestResult;
+    QBENCHMARK
+    {
+        tree.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkBalancedTreeAddSorted1()
+{
+    QBENCHMARK
+    {
+        QKDTree tree(2);
+        tree.setBalanceFactor(2.0);
+        for (uint i = 0; i < size1; i++)
+            tree.add(QPointF(i, i), i);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkBalancedTreeAddSorted2()
+{
+    QBENCHMARK
+    {
+        QKDTree tree(2);
+        tree.setBalanceFactor(2.0);
+        for (uint i = 0; i < size2; i++)
+            tree.add(QPointF(i, i), i);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeRemove1()
+{
+    QKDTree tree(2);
+    QList<QVectorND> positions;
+    for (uint i = 0; i < size1; i++)
+    {
+        positions.append(_randomNDimensional(2));
+        tree.add(positions.last(), i);
+    }
+
+    int i = 0;
+    QBENCHMARK
+    {
+        const QVectorND& pos = positions[i++ % positions.size()];
+        tree.remove(pos);
+        tree.add(pos, "back");
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeRemove2()
+{
+    QKDTree tree(2);
+    QList<QVectorND> positions;
+    for (uint i = 0; i < size2; i++)
+    {
+        positions.append(_randomNDimensional(2));
+        tree.add(positions.last(), i);
+    }
+
+    int i = 0;
+    QBENCHMARK
+    {
+        const QVectorND& pos = positions[i++ % positions.size()];
+        tree.remove(pos);
+        tree.add(pos, "back");
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkForestAdd1()
+{
+    QKDForest forest(2);
+    for (uint i = 0; i < size1; i++)
+        forest.add(_randomNDimensional(2), i);
+
+    QBENCHMARK
+    {
+        forest.add(_randomNDimensional(2), "final");
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkForestAdd2()
+{
+    QKDForest forest(2);
+    for (uint i = 0; i < size2; i++)
+        forest.add(_randomNDimensional(2), i);
+
+    QBENCHMARK
+    {
+        forest.add(_randomNDimensional(2), "final");
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkForestNearest1()
+{
+    QKDForest forest(2);
+    for (uint i = 0; i < size1; i++)
+        forest.add(_randomNDimensional(2), i);
+
+    const QVectorND pos = _randomNDimensional(2);
+    QKDTreeNode nearestResult;
+    QBENCHMARK
+    {
+        forest.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkForestNearest2()
+{
+    QKDForest forest(2);
+    for (uint i = 0; i < size2; i++)
+        forest.add(_randomNDimensional(2), i);
+
+    const QVectorND pos = _randomNDimensional(2);
+    QKDTreeNode nearestResult;
+    QBENCHMARK
+    {
+        forest.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkForestIndexBuild1_data()
+{
+    QTest::addColumn<int>("treeCount");
+    QTest::newRow("1") << 1;
+    QTest::newRow("4") << 4;
+    QTest::newRow("8") << 8;
+}
+
+//private test
+void QKDTreeTests::benchmarkForestIndexBuild1()
+{
+    QFETCH(int, treeCount);
+
+    const int dim = 64;
+    const QVector<QVectorND> positions = _clusteredNDimensional(dim, size1);
+    QVector<QVariant> values;
+    for (uint i = 0; i < size1; i++)
+        values.append(i);
+
+    QKDForestIndex index(dim, treeCount);
+    QBENCHMARK
+    {
+        index.build(positions, values);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkForestIndexBuild2_data()
+{
+    this->benchmarkForestIndexBuild1_data();
+}
+
+//private test
+void QKDTreeTests::benchmarkForestIndexBuild2()
+{
+    QFETCH(int, treeCount);
+
+    const int dim = 64;
+    const QVector<QVectorND> positions = _clusteredNDimensional(dim, size2);
+    QVector<QVariant> values;
+    for (uint i = 0; i < size2; i++)
+        values.append(i);
+
+    QKDForestIndex index(dim, treeCount);
+    QBENCHMARK
+    {
+        index.build(positions, values);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkForestIndexNearest1_data()
+{
+    QTest::addColumn<int>("treeCount");
+    QTest::addColumn<int>("maxChecks");
+    QTest::newRow("1 tree, 64 checks") << 1 << 64;
+    QTest::newRow("1 tree, 256 checks") << 1 << 256;
+    QTest::newRow("1 tree, 1024 checks") << 1 << 1024;
+    QTest::newRow("4 trees, 64 checks") << 4 << 64;
+    QTest::newRow("4 trees, 256 checks") << 4 << 256;
+    QTest::newRow("4 trees, 1024 checks") << 4 << 1024;
+    QTest::newRow("8 trees, 64 checks") << 8 << 64;
+    QTest::newRow("8 trees, 256 checks") << 8 << 256;
+    QTest::newRow("8 trees, 1024 checks") << 8 << 1024;
+}
+
+//private test
+void QKDTreeTests::benchmarkForestIndexNearest1()
+{
+    QFETCH(int, treeCount);
+    QFETCH(int, maxChecks);
+
+    //The same data for every row, so the rows can be compared
+    qsrand(1);
+    const int dim = 64;
+    QVector<QVectorND> positions = _clusteredNDimensional(dim, size1 + 20);
+    const QVector<QVectorND> queries = positions.mid(size1);
+    positions.resize(size1);
+    QVector<QVariant> values;
+    for (uint i = 0; i < size1; i++)
+        values.append(i);
+
+    QKDForestIndex index(dim, treeCount);
+    index.build(positions, values);
+
+    QList<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        results.clear();
+        foreach(const QVectorND& pos, queries)
+        {
+            QKDTreeNode nearestResult;
+            index.nearestNode(pos, maxChecks, &nearestResult);
+            results.append(nearestResult);
+        }
+    }
+
+    const QKDTreeDistanceMetric metric;
+    int exact = 0;
+    for (int i = 0; i < queries.size(); i++)
+    {
+        qreal backupDist = std::numeric_limits<qreal>::max();
+        foreach(const QVectorND& vec, positions)
+            backupDist = qMin(backupDist, metric.distance(vec, queries[i]));
+        if (metric.distance(results[i].position(), queries[i]) == backupDist)
+            exact++;
+    }
+    if (_verbose())
+        qDebug() << treeCount << "trees with maxChecks" << maxChecks << "found the true nearest neighbor for" << exact
+                 << "of" << queries.size();
+}
+
+//private test
+void QKDTreeTests::benchmarkForestIndexNearest2_data()
+{
+    this->benchmarkForestIndexNearest1_data();
+}
+
+//private test
+void QKDTreeTests::benchmarkForestIndexNearest2()
+{
+    QFETCH(int, treeCount);
+    QFETCH(int, maxChecks);
+
+    //The same data for every row, so the rows can be compared
+    qsrand(1);
+    const int dim = 64;
+    QVector<QVectorND> positions = _clusteredNDimensional(dim, size2 + 20);
+    const QVector<QVectorND> queries = positions.mid(size2);
+    positions.resize(size2);
+    QVector<QVariant> values;
+    for (uint i = 0; i < size2; i++)
+        values.append(i);
+
+    QKDForestIndex index(dim, treeCount);
+    index.build(positions, values);
+
+    QList<QKDTreeNode> results;
+    QBENCHMARK
+    {
+        results.clear();
+        foreach(const QVectorND& pos, queries)
+        {
+            QKDTreeNode nearestResult;
+            index.nearestNode(pos, maxChecks, &nearestResult);
+            results.append(nearestResult);
+        }
+    }
+
+    const QKDTreeDistanceMetric metric;
+    int exact = 0;
+    for (int i = 0; i < queries.size(); i++)
+    {
+        qreal backupDist = std::numeric_limits<qreal>::max();
+        foreach(const QVectorND& vec, positions)
+            backupDist = qMin(backupDist, metric.distance(vec, queries[i]));
+        if (metric.distance(results[i].position(), queries[i]) == backupDist)
+            exact++;
+    }
+    if (_verbose())
+        qDebug() << treeCount << "trees with maxChecks" << maxChecks << "found the true nearest neighbor for" << exact
+                 << "of" << queries.size();
+}
+
+//private test
+void QKDTreeTests::benchmarkSnapshotAdd1()
+{
+    QKDSnapshotTree tree(2);
+    for (uint i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    QBENCHMARK
+    {
+        tree.add(_randomNDimensional(2), "final");
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkSnapshotAdd2()
+{
+    QKDSnapshotTree tree(2);
+    for (uint i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    QBENCHMARK
+    {
+        tree.add(_randomNDimensional(2), "final");
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkSnapshotNearest1()
+{
+    QKDSnapshotTree tree(2);
+    for (uint i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QKDTreeSnapshot snapshot = tree.snapshot();
+    const QVectorND pos = _randomNDimensional(2);
+    QKDTreeNode nearestResult;
+    QBENCHMARK
+    {
+        snapshot.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkSnapshotNearest2()
+{
+    QKDSnapshotTree tree(2);
+    for (uint i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QKDTreeSnapshot snapshot = tree.snapshot();
+    const QVectorND pos = _randomNDimensional(2);
+    QKDTreeNode nearestResult;
+    QBENCHMARK
+    {
+        snapshot.nearestNode(pos, &nearestResult);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeRange1()
+{
+    QKDTree tree(2);
+
+    for (uint i = 0; i < size1; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    //About 1% of the points
+    const QRectF viewport(qrand(), qrand(), RAND_MAX / 10.0, RAND_MAX / 10.0);
+    CountingVisitor visitor;
+    QBENCHMARK
+    {
+        tree.rangeQuery(viewport, &visitor);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkTreeRange2()
+{
+    QKDTree tree(2);
+
+    for (uint i = 0; i < size2; i++)
+        tree.add(_randomNDimensional(2), i);
+
+    const QRectF viewport(qrand(), qrand(), RAND_MAX / 10.0, RAND_MAX / 10.0);
+    CountingVisitor visitor;
+    QBENCHMARK
+    {
+        tree.rangeQuery(viewport, &visitor);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkListAdd1()
+{
+    QList<QVectorND> list;
+
+    for (int i = 0; i < size1; i++)
+    {
+        QVectorND pos = _randomNDimensional(2);
+        list.append(pos);
+    }
+
+    QBENCHMARK
+    {
+        QVectorND pos = _randomNDimensional(2);
+        list.append(pos);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkListAdd2()
+{
+    QList<QVectorND> list;
+
+    for (int i = 0; i < size2; i++)
+    {
+        QVectorND pos = _randomNDimensional(2);
+        list.append(pos);
+    }
+
+    QBENCHMARK
+    {
+        QVectorND pos = _randomNDimensional(2);
+        list.append(pos);
+    }
+}
+
+//private test
+void QKDTreeTests::benchmarkListNearest1()
+{
+    QList<QVectorND> list;
+    QList<QVectorND> results;
+
+    for (int i = 0; i < size1; i++)
+    {
+        QVectorND pos = _randomNDimensional(2);
+        list.append(pos);
+    }
+
+    for (int i = 0; i < 1; i++)
+    {
+        QVectorND pos = _randomNDimensional(2);
 
         QVectorND best(1);
         QBENCHMARK
@@ -387,6 +3893,13 @@ void QKDTreeTests::benchmarkListNearest2()
     }
 }
 
+//private static
+bool QKDTreeTests::_verbose()
+{
+    //Benchmarks that trade accuracy for speed only print how accurate they were when asked to
+    return !qgetenv("QKDTREE_VERBOSE").isEmpty();
+}
+
 //private static
 QVectorND QKDTreeTests::_randomNDimensional(int n)
 {
@@ -397,3 +3910,26 @@ QVectorND QKDTreeTests::_randomNDimensional(int n)
 
     return toRet;
 }
+
+//private static
+QVector<QVectorND> QKDTreeTests::_clusteredNDimensional(int n, int count)
+{
+    //Tight clouds around a few dozen random centers, the way feature vectors tend to bunch up
+    const int clusters = 32;
+    const int spread = RAND_MAX / 16;
+    QVector<QVectorND> centers;
+    for (int i = 0; i < clusters; i++)
+        centers.append(_randomNDimensional(n));
+
+    QVector<QVectorND> toRet;
+    toRet.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        QVectorND pos = centers.at(qrand() % clusters);
+        for (int d = 0; d < n; d++)
+            pos[d] += qrand() % spread - spread / 2;
+        toRet.append(pos);
+    }
+
+    return toRet;
+}
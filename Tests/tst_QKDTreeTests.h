@@ -17,22 +17,154 @@ private Q_SLOTS:
     void insertionTest();
     void containsKeyTest();
     void valueTest();
+    void addNodeTest();
     void bigNearestTest();
+    void approximateNearestTest();
+    void bestBinTest();
     void nearestPosByPosTest();
+    void buildTest();
+    void buildSortedTest();
+    void buildDuplicatesTest();
+    void parallelBuildTest();
+    void nearestIndexTest();
+    void builtinMetricsTest();
+    void nearestIteratorTest();
+    void nearestNodesTest();
+    void batchNearestTest();
+    void knnGraphTest();
+    void nearestJoinTest();
+    void withinDistanceTest();
+    void rangeQueryTest();
+    void removeTest();
+    void removeDuplicatesTest();
+    void balancedAddTest();
+    void iterationTest();
+    void mappedTreeTest();
+    void forestTest();
+    void forestIndexTest();
+    void snapshotTest();
+    void snapshotConcurrentTest();
+    void fixedDimensionTreeTest();
+    void bucketTest();
+    void floatTreeTest();
+    void payloadTest();
 
     void benchmarkTreeAdd1();
     void benchmarkTreeAdd2();
 
+    void benchmarkTreeAddAll1();
+    void benchmarkTreeAddAll2();
+
+    void benchmarkTreeBuild1();
+    void benchmarkTreeBuild2();
+
+    void benchmarkTreeParallelBuild_data();
+    void benchmarkTreeParallelBuild();
+
+    void benchmarkTreeOpenMapped1();
+    void benchmarkTreeOpenMapped2();
+
     void benchmarkTreeNearest1();
     void benchmarkTreeNearest2();
 
+    void benchmarkTreeNearestIndex1();
+    void benchmarkTreeNearestIndex2();
+
+    void benchmarkTreeManhattanNearest1();
+    void benchmarkTreeManhattanNearest2();
+
+    void benchmarkTreeApproximateNearest1_data();
+    void benchmarkTreeApproximateNearest1();
+    void benchmarkTreeApproximateNearest2_data();
+    void benchmarkTreeApproximateNearest2();
+
+    void benchmarkTreeBestBin1_data();
+    void benchmarkTreeBestBin1();
+    void benchmarkTreeBestBin2_data();
+    void benchmarkTreeBestBin2();
+
+    void benchmarkTreeNearestK1();
+    void benchmarkTreeNearestK2();
+
+    void benchmarkTreeNearestIterator1();
+    void benchmarkTreeNearestIterator2();
+
+    void benchmarkTreeBatchNearest1();
+    void benchmarkTreeBatchNearest2();
+
+    void benchmarkTreeKnnGraph1();
+    void benchmarkTreeKnnGraph2();
+
+    void benchmarkTreeKnnNaive1();
+    void benchmarkTreeKnnNaive2();
+    void benchmarkTreeNearestJoin1();
+    void benchmarkTreeNearestJoin2();
+    void benchmarkTreeJoinNaive1();
+    void benchmarkTreeJoinNaive2();
+
+    void benchmarkTreeIterate1();
+    void benchmarkTreeIterate2();
+
+    void benchmarkTreeForEach1();
+    void benchmarkTreeForEach2();
+
+    void benchmarkFixedTreeAdd1();
+    void benchmarkFixedTreeAdd2();
+
+    void benchmarkFixedTreeNearest1();
+    void benchmarkFixedTreeNearest2();
+
+    void benchmarkFloatTreeNearest1();
+    void benchmarkFloatTreeNearest2();
+
+    void benchmarkPayloadTreeNearestIndex1();
+    void benchmarkPayloadTreeNearestIndex2();
+
+    void benchmarkBucketNearest1_data();
+    void benchmarkBucketNearest1();
+    void benchmarkBucketNearest2_data();
+    void benchmarkBucketNearest2();
+
+    void benchmarkBalancedTreeAddSorted1();
+    void benchmarkBalancedTreeAddSorted2();
+
+    void benchmarkTreeRemove1();
+    void benchmarkTreeRemove2();
+
+    void benchmarkForestAdd1();
+    void benchmarkForestAdd2();
+
+    void benchmarkForestNearest1();
+    void benchmarkForestNearest2();
+
+    void benchmarkForestIndexBuild1_data();
+    void benchmarkForestIndexBuild1();
+    void benchmarkForestIndexBuild2_data();
+    void benchmarkForestIndexBuild2();
+
+    void benchmarkForestIndexNearest1_data();
+    void benchmarkForestIndexNearest1();
+    void benchmarkForestIndexNearest2_data();
+    void benchmarkForestIndexNearest2();
+
+    void benchmarkSnapshotAdd1();
+    void benchmarkSnapshotAdd2();
+
+    void benchmarkSnapshotNearest1();
+    void benchmarkSnapshotNearest2();
+
+    void benchmarkTreeRange1();
+    void benchmarkTreeRange2();
+
     void benchmarkListAdd1();
     void benchmarkListAdd2();
 
     void benchmarkListNearest1();
     void benchmarkListNearest2();
 
+    static bool _verbose();
     static QVectorND _randomNDimensional(int n);
+    static QVector<QVectorND> _clusteredNDimensional(int n, int count);
 };
 
 #endif // TST_QKDTREETESTS_H